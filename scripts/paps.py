@@ -0,0 +1,177 @@
+######################################################################
+#  Render text with paps in process, through the C API of libpaps.
+#
+#  import paps
+#  pdf = paps.render(text, format='pdf', columns=2, header=True)
+#  for chunk in paps.render_pages(text, format='pdf'):
+#    send(chunk)
+#
+#  The options are the members of paps_options_t in libpaps.h, which
+#  correspond to the command line options of paps.
+#
+# Dov Grobgeld <dov.grobgeld@gmail.com>
+######################################################################
+
+import ctypes
+import ctypes.util
+import os
+
+FORMATS = {'ps' : 0, 'postscript' : 0, 'pdf' : 1, 'svg' : 2}
+WRAPS = {'word' : 0, 'char' : 1, 'word-char' : 2}
+
+# Must match PAPS_API_VERSION in libpaps.h
+API_VERSION = 1
+
+class Options(ctypes.Structure):
+  '''The paps_options_t struct of libpaps.h'''
+  _fields_ = [('api_version', ctypes.c_int),
+              ('format', ctypes.c_int),
+              ('font', ctypes.c_char_p),
+              ('header_font', ctypes.c_char_p),
+              ('paper', ctypes.c_char_p),
+              ('columns', ctypes.c_int),
+              ('landscape', ctypes.c_int),
+              ('rtl', ctypes.c_int),
+              ('markup', ctypes.c_int),
+              ('justify', ctypes.c_int),
+              ('hyphens', ctypes.c_int),
+              ('wrap', ctypes.c_int),
+              ('show_wrap', ctypes.c_int),
+              ('separation_lines', ctypes.c_int),
+              ('header', ctypes.c_int),
+              ('footer', ctypes.c_int),
+              ('title', ctypes.c_char_p),
+              ('header_left', ctypes.c_char_p),
+              ('header_center', ctypes.c_char_p),
+              ('header_right', ctypes.c_char_p),
+              ('footer_left', ctypes.c_char_p),
+              ('footer_center', ctypes.c_char_p),
+              ('footer_right', ctypes.c_char_p),
+              ('top_margin', ctypes.c_int),
+              ('bottom_margin', ctypes.c_int),
+              ('left_margin', ctypes.c_int),
+              ('right_margin', ctypes.c_int),
+              ('gutter_width', ctypes.c_int),
+              ('lpi', ctypes.c_double)]
+
+WRITE_FUNC = ctypes.CFUNCTYPE(ctypes.c_int,
+                              ctypes.c_void_p,
+                              ctypes.POINTER(ctypes.c_char),
+                              ctypes.c_size_t)
+
+_lib = None
+
+def _load_library():
+  '''Load libpaps. $PAPS_LIBRARY may give its path.'''
+  global _lib
+  if _lib is not None:
+    return _lib
+
+  path = (os.environ.get('PAPS_LIBRARY')
+          or ctypes.util.find_library('paps')
+          or 'libpaps.so.0')
+  lib = ctypes.CDLL(path)
+  lib.paps_options_init.argtypes = [ctypes.POINTER(Options)]
+  lib.paps_options_init.restype = None
+  lib.paps_render.argtypes = [ctypes.POINTER(Options),
+                              ctypes.c_char_p,
+                              ctypes.c_size_t,
+                              WRITE_FUNC,
+                              ctypes.c_void_p]
+  lib.paps_render.restype = ctypes.c_int
+  lib.paps_begin.argtypes = [ctypes.POINTER(Options),
+                             ctypes.c_char_p,
+                             ctypes.c_size_t]
+  lib.paps_begin.restype = ctypes.c_void_p
+  for name in ('paps_next_page', 'paps_finish'):
+    func = getattr(lib, name)
+    func.argtypes = [ctypes.c_void_p,
+                     ctypes.POINTER(ctypes.POINTER(ctypes.c_char)),
+                     ctypes.POINTER(ctypes.c_size_t)]
+    func.restype = ctypes.c_int
+  lib.paps_free.argtypes = [ctypes.c_void_p]
+  lib.paps_free.restype = None
+  lib.paps_version.argtypes = []
+  lib.paps_version.restype = ctypes.c_char_p
+  _lib = lib
+  return lib
+
+def version():
+  return _load_library().paps_version().decode()
+
+def _make_options(lib, format, wrap, options):
+  opts = Options()
+  lib.paps_options_init(ctypes.byref(opts))
+  if opts.api_version != API_VERSION:
+    raise RuntimeError(f'Unsupported libpaps API version {opts.api_version}')
+  opts.format = FORMATS[format]
+  opts.wrap = WRAPS[wrap]
+  for key, val in options.items():
+    if val is None:
+      continue
+    if isinstance(val, str):
+      val = val.encode()
+    setattr(opts, key, val)
+  return opts
+
+def render_to(write, text, format='ps', wrap='word-char', **options):
+  '''Render text, a str or UTF-8 bytes, and pass the output to write()
+  in pieces as it is produced. Returns the number of pages.'''
+  lib = _load_library()
+  opts = _make_options(lib, format, wrap, options)
+  if isinstance(text, str):
+    text = text.encode()
+
+  errors = []
+  def write_func(closure, data, length):
+    try:
+      write(ctypes.string_at(data, length))
+    except Exception as e:
+      errors.append(e)
+      return 1
+    return 0
+
+  num_pages = lib.paps_render(ctypes.byref(opts),
+                              text,
+                              len(text),
+                              WRITE_FUNC(write_func),
+                              None)
+  if errors:
+    raise errors[0]
+  if num_pages < 0:
+    raise RuntimeError('paps failed to render the text')
+  return num_pages
+
+def render(text, format='ps', **options):
+  '''Render text, a str or UTF-8 bytes, and return the output'''
+  chunks = []
+  render_to(chunks.append, text, format, **options)
+  return b''.join(chunks)
+
+def render_pages(text, format='pdf', wrap='word-char', **options):
+  '''Render text, a str or UTF-8 bytes, a page at a time. Yields the
+  output of every page as it is rendered, and then the rest of the
+  output. Only PDF output can be rendered a page at a time.'''
+  lib = _load_library()
+  opts = _make_options(lib, format, wrap, options)
+  if isinstance(text, str):
+    text = text.encode()
+
+  document = lib.paps_begin(ctypes.byref(opts), text, len(text))
+  if not document:
+    raise RuntimeError('paps failed to render the text')
+  data = ctypes.POINTER(ctypes.c_char)()
+  length = ctypes.c_size_t()
+  try:
+    while True:
+      status = lib.paps_next_page(document, ctypes.byref(data), ctypes.byref(length))
+      if status < 0:
+        raise RuntimeError('paps failed to render the text')
+      if status == 0:
+        break
+      yield ctypes.string_at(data, length.value)
+    if lib.paps_finish(document, ctypes.byref(data), ctypes.byref(length)) < 0:
+      raise RuntimeError('paps failed to render the text')
+    yield ctypes.string_at(data, length.value)
+  finally:
+    lib.paps_free(document)
@@ -25,7 +25,7 @@
 using namespace std;
 using namespace fmt;
 
-static string scalar_to_string(scalar_t scalar,
+static string scalar_to_string(const scalar_t& scalar,
                                const string& spec="")
 {
   if (holds_alternative<string>(scalar))
@@ -59,56 +59,86 @@ static string scalar_to_string(scalar_t scalar,
   throw runtime_error("Unrecognized type!"); // I shouldn't be here!
 }
 
-// Take a python like format string and a dictionary and format
-// it according to the format string.
-string format_from_dict(const string& str,
-                        dict_t dict)
+// A double }} in the literal text is a single }
+static string unescape_braces(const string& text)
 {
   string res;
+  for (size_t i=0; i<text.size(); i++)
+  {
+    res += text[i];
+    if (text[i] == '}' && i+1 < text.size() && text[i+1] == '}')
+      i++;
+  }
+  return res;
+}
 
-  // Currenly no support for double {{ and double }}
-  int pos=0;
+// Split the format string into the literal text and the fields
+CompiledFormat::CompiledFormat(const string& str)
+{
+  Segment segment;
+  size_t pos=0;
   size_t len = str.size();
   while (true) {
     size_t start = str.find("{", pos);
     if (start == string::npos || start == len-1)
       break;
+
+    // A double {{ is a literal {
     if (str[start+1]=='{')
     {
-      res += str.substr(pos, start+1);
-      pos = start+1;
+      segment.text += unescape_braces(str.substr(pos, start+1-pos));
+      pos = start+2;
       continue;
     }
     size_t end = str.find("}", start);
     if (end == string::npos)
-      throw runtime_error(format("No end brace for start {{ at {}", start));
+      throw runtime_error(fmt::format("No end brace for start {{ at {}", start));
     if (end < len-1 && str[end+1] == '}')
-      throw runtime_error(format("Can't have double }}}} in formatting clause!", start));
+      throw runtime_error(fmt::format("Can't have double }}}} in formatting clause!", start));
 
-    // TBD - fill in
-    res += str.substr(pos, start-pos);
+    segment.text += unescape_braces(str.substr(pos, start-pos));
 
     string spec = str.substr(start+1, end-start-1);
     size_t colon_pos = spec.find(":");
     if (colon_pos == string::npos)
-    {
-      if (dict.count(spec) == 0)
-        throw runtime_error(format("Can't find {} in dictionary!", spec));
-      res += scalar_to_string(dict[spec]);
-    }
+      segment.key = spec;
     else
     {
       // Split on ':'
-      string spec_format = spec.substr(colon_pos+1);
-      spec = spec.substr(0, colon_pos);
-      res += scalar_to_string(dict[spec], spec_format);
+      segment.key = spec.substr(0, colon_pos);
+      segment.spec = spec.substr(colon_pos+1);
     }
+    m_keys.insert(segment.key);
+    m_segments.push_back(move(segment));
+    segment = Segment();
 
     pos = end+1;
   }
 
-  res += str.substr(pos);
-  
+  m_tail = segment.text + unescape_braces(str.substr(pos));
+}
+
+string CompiledFormat::format(const dict_t& dict) const
+{
+  string res;
+
+  for (const auto& segment : m_segments)
+  {
+    res += segment.text;
+    auto it = dict.find(segment.key);
+    if (it == dict.end())
+      throw runtime_error(fmt::format("Can't find {} in dictionary!", segment.key));
+    res += scalar_to_string(it->second, segment.spec);
+  }
+  res += m_tail;
+
   return res;
 }
 
+// Take a python like format string and a dictionary and format
+// it according to the format string.
+string format_from_dict(const string& str,
+                        const dict_t& dict)
+{
+  return CompiledFormat(str).format(dict);
+}
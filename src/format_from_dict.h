@@ -24,16 +24,45 @@
 
 #include <string>
 #include <map>
+#include <set>
+#include <vector>
 #include <variant>
 #include <fmt/chrono.h>
 
 using scalar_t = std::variant<int, std::string, double, std::time_t>;
 using dict_t = std::map<std::string, scalar_t>;
 
+// A python like format string that is parsed once, and may then be
+// formatted with many dictionaries. Throws std::runtime_error for a
+// malformed format string.
+class CompiledFormat {
+ public:
+  CompiledFormat() = default;
+  CompiledFormat(const std::string& str);
+
+  std::string format(const dict_t& dict) const;
+
+  // The dictionary keys that the format string refers to
+  const std::set<std::string>& keys() const { return m_keys; }
+  bool references(const std::string& key) const { return m_keys.count(key) > 0; }
+  bool empty() const { return m_segments.empty() && m_tail.empty(); }
+
+ private:
+  // Literal text followed by a field
+  struct Segment {
+    std::string text;
+    std::string key;
+    std::string spec;
+  };
+  std::vector<Segment> m_segments;
+  std::string m_tail;   // Literal text after the last field
+  std::set<std::string> m_keys;
+};
+
 // Take a python like format string and a dictionary and format
 // it according to the format string.
 std::string format_from_dict(const std::string& str,
-                             dict_t dict);
+                             const dict_t& dict);
 
 
 #endif /* FORMAT_FROM_DICT */
@@ -0,0 +1,265 @@
+/*
+ * input_prefetch.cc: Reading of the input files ahead of their use.
+ *
+ * Copyright (C) 2002, 2005, 2022 Dov Grobgeld <dov.grobgeld@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include <config.h>
+#include "input_prefetch.h"
+#include <stdexcept>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+using namespace std;
+
+// The size of the reads of a file whose size is not known
+#define PREFETCH_BLOCK_SIZE (64 * 1024)
+
+InputPrefetcher::InputPrefetcher(const vector<string>& filenames, int depth)
+  : m_filenames(filenames),
+    m_slots(filenames.size()),
+    m_depth(depth > 0 ? depth : 1)
+{
+#ifdef HAVE_LIBURING
+  // Every file in flight has a single request at a time
+  struct io_uring *ring = new struct io_uring;
+  if (io_uring_queue_init(m_depth, ring, 0) == 0)
+    {
+      // The opens and reads need Linux 5.6
+      struct io_uring_probe *probe = io_uring_get_probe_ring(ring);
+      bool supported = probe
+        && io_uring_opcode_supported(probe, IORING_OP_OPENAT)
+        && io_uring_opcode_supported(probe, IORING_OP_READ);
+      if (probe)
+        io_uring_free_probe(probe);
+      if (supported)
+        {
+          m_ring = ring;
+          m_uses_io_uring = true;
+          m_threads.emplace_back(&InputPrefetcher::run_io_uring, this);
+          return;
+        }
+      io_uring_queue_exit(ring);
+    }
+  delete ring;
+#endif
+
+  for (size_t i=0; i<m_depth && i<m_filenames.size(); i++)
+    m_threads.emplace_back(&InputPrefetcher::run_thread, this);
+}
+
+InputPrefetcher::~InputPrefetcher()
+{
+  {
+    lock_guard<mutex> lock(m_mutex);
+    m_stop = true;
+  }
+  m_cond.notify_all();
+  for (auto& t : m_threads)
+    t.join();
+}
+
+string InputPrefetcher::take(size_t idx)
+{
+  unique_lock<mutex> lock(m_mutex);
+  Slot& slot = m_slots[idx];
+  m_cond.wait(lock, [&] { return slot.done; });
+
+  // Let the next files be read while this one is used
+  m_taken = idx + 1;
+  m_cond.notify_all();
+
+  if (!slot.error.empty())
+    throw runtime_error(slot.error);
+  return move(slot.data);
+}
+
+// Get the next file to read, if it is within depth files of those that
+// have been taken. Returns false when there is none, or when the
+// prefetcher is stopped. Must be called with the mutex locked.
+bool InputPrefetcher::next_to_start(size_t& idx)
+{
+  if (m_stop || m_next_start >= m_filenames.size()
+      || m_next_start >= m_taken + m_depth)
+    return false;
+  idx = m_next_start++;
+  return true;
+}
+
+void InputPrefetcher::finish(size_t idx, string&& data, const string& error)
+{
+  {
+    lock_guard<mutex> lock(m_mutex);
+    m_slots[idx].data = move(data);
+    m_slots[idx].error = error;
+    m_slots[idx].done = true;
+  }
+  m_cond.notify_all();
+}
+
+// Read all of fd, of a file of size bytes if it is known and otherwise
+// 0, into data. Returns 0 or an errno value.
+static int
+read_fd_contents(int fd, size_t size, string& data)
+{
+  size_t len = 0;
+  data.resize(size ? size + 1 : PREFETCH_BLOCK_SIZE);
+  while (true)
+    {
+      if (len == data.size())
+        data.resize(data.size() * 2);
+      ssize_t n = read(fd, &data[len], data.size() - len);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n < 0)
+        return errno;
+      if (n == 0)
+        break;
+      len += n;
+    }
+  data.resize(len);
+  return 0;
+}
+
+void InputPrefetcher::run_thread()
+{
+  while (true)
+    {
+      size_t idx;
+      {
+        unique_lock<mutex> lock(m_mutex);
+        m_cond.wait(lock, [&] {
+            return m_stop || m_next_start >= m_filenames.size()
+              || m_next_start < m_taken + m_depth;
+          });
+        if (!next_to_start(idx))
+          return;
+      }
+
+      string data;
+      int err = 0;
+      int fd = open(m_filenames[idx].c_str(), O_RDONLY | O_CLOEXEC);
+      if (fd < 0)
+        err = errno;
+      else
+        {
+          struct stat st;
+          size_t size = fstat(fd, &st) == 0 && S_ISREG(st.st_mode) ? st.st_size : 0;
+          err = read_fd_contents(fd, size, data);
+          close(fd);
+        }
+      finish(idx, move(data), err ? strerror(err) : "");
+    }
+}
+
+#ifdef HAVE_LIBURING
+// A file that is being opened or read through the io_uring
+struct PrefetchRequest {
+  size_t idx;
+  int fd = -1;
+  size_t len = 0;
+  string data;
+};
+
+void InputPrefetcher::run_io_uring()
+{
+  struct io_uring *ring = (struct io_uring*)m_ring;
+  size_t in_flight = 0;
+
+  while (true)
+    {
+      // Open the files that are within the window
+      {
+        unique_lock<mutex> lock(m_mutex);
+        if (in_flight == 0)
+          m_cond.wait(lock, [&] {
+              return m_stop || m_next_start >= m_filenames.size()
+                || m_next_start < m_taken + m_depth;
+            });
+        size_t idx;
+        while (next_to_start(idx))
+          {
+            PrefetchRequest *req = new PrefetchRequest;
+            req->idx = idx;
+            struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+            io_uring_prep_openat(sqe, AT_FDCWD, m_filenames[idx].c_str(), O_RDONLY | O_CLOEXEC, 0);
+            io_uring_sqe_set_data(sqe, req);
+            in_flight++;
+          }
+      }
+      if (in_flight == 0)
+        break;
+
+      io_uring_submit_and_wait(ring, 1);
+      struct io_uring_cqe *cqe;
+      while (io_uring_peek_cqe(ring, &cqe) == 0)
+        {
+          PrefetchRequest *req = (PrefetchRequest*)io_uring_cqe_get_data(cqe);
+          int res = cqe->res;
+          io_uring_cqe_seen(ring, cqe);
+
+          if (res < 0 || (req->fd >= 0 && res == 0))
+            {
+              // An error, or the end of the file
+              if (req->fd >= 0)
+                close(req->fd);
+              req->data.resize(req->len);
+              finish(req->idx, move(req->data), res < 0 ? strerror(-res) : "");
+              delete req;
+              in_flight--;
+              continue;
+            }
+
+          if (req->fd < 0)
+            {
+              // Opened. The size is known once the file is open.
+              struct stat st;
+              req->fd = res;
+              size_t size = fstat(req->fd, &st) == 0 && S_ISREG(st.st_mode) ? st.st_size : 0;
+              req->data.resize(size ? size + 1 : PREFETCH_BLOCK_SIZE);
+            }
+          else
+            {
+              req->len += res;
+              if (req->len == req->data.size())
+                req->data.resize(req->data.size() * 2);
+            }
+
+          struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+          io_uring_prep_read(sqe, req->fd, &req->data[req->len],
+                             req->data.size() - req->len, req->len);
+          io_uring_sqe_set_data(sqe, req);
+        }
+    }
+
+  io_uring_queue_exit(ring);
+  delete ring;
+  m_ring = nullptr;
+}
+#else
+void InputPrefetcher::run_io_uring()
+{
+}
+#endif
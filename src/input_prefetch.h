@@ -0,0 +1,74 @@
+/*
+ * input_prefetch.h: Reading of the input files ahead of their use.
+ *
+ * Copyright (C) 2002, 2005, 2022 Dov Grobgeld <dov.grobgeld@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ *
+ */
+#ifndef INPUT_PREFETCH_H
+#define INPUT_PREFETCH_H
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+// Opens and reads a list of files in the background, so that the I/O of
+// the next files overlaps the work on the current one. At most depth
+// files that have not been taken yet are read ahead. The files are read
+// through an io_uring when paps is built with liburing and the kernel
+// supports it, and otherwise by depth threads.
+class InputPrefetcher {
+ public:
+  InputPrefetcher(const std::vector<std::string>& filenames, int depth);
+  ~InputPrefetcher();
+
+  // Wait for the file with index idx to be read, and return its
+  // contents. Every file may only be taken once. Throws
+  // std::runtime_error with the reason when it could not be read.
+  std::string take(size_t idx);
+
+  // Whether the files are read through an io_uring
+  bool uses_io_uring() const { return m_uses_io_uring; }
+
+ private:
+  struct Slot {
+    bool done = false;
+    std::string data;
+    std::string error;
+  };
+
+  bool next_to_start(size_t& idx);
+  void finish(size_t idx, std::string&& data, const std::string& error);
+  void run_thread();
+  void run_io_uring();
+
+  std::vector<std::string> m_filenames;
+  std::vector<Slot> m_slots;
+  size_t m_depth;
+  size_t m_next_start = 0;   // The next file to open
+  size_t m_taken = 0;        // The files before this one have been taken
+  bool m_stop = false;
+  bool m_uses_io_uring = false;
+  void *m_ring = nullptr;
+  std::mutex m_mutex;
+  std::condition_variable m_cond;
+  std::vector<std::thread> m_threads;
+};
+
+#endif /* INPUT_PREFETCH_H */
@@ -0,0 +1,488 @@
+/*
+ * libpaps.cc: The C API for rendering text with paps in process.
+ *
+ * Copyright (C) 2002, 2005, 2022 Dov Grobgeld <dov.grobgeld@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "paps_core.h"
+#include "libpaps.h"
+#include <cairo/cairo-ps.h>
+#include <cairo/cairo-pdf.h>
+#include <cairo/cairo-svg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <deque>
+
+using namespace std;
+
+#define LIBPAPS_EXPORT extern "C" __attribute__((visibility("default")))
+
+// The size of the blocks of the text that paps_next_page() lays out at
+// a time. A block ends at the end of a line.
+#define LIBPAPS_BLOCK_SIZE (16 * 1024)
+
+/* The user's write function, as the closure of the cairo write function */
+struct LibpapsWriter {
+  paps_write_func_t write_func;
+  void *closure;
+};
+
+static cairo_status_t
+libpaps_write_func(void *closure,
+                   const unsigned char *data,
+                   unsigned int length)
+{
+  LibpapsWriter *writer = (LibpapsWriter*)closure;
+  if (writer->write_func(writer->closure, data, length))
+    return CAIRO_STATUS_WRITE_ERROR;
+  return CAIRO_STATUS_SUCCESS;
+}
+
+LIBPAPS_EXPORT void
+paps_options_init(paps_options_t *options)
+{
+  memset(options, 0, sizeof(*options));
+  options->api_version = PAPS_API_VERSION;
+  options->format = PAPS_FORMAT_POSTSCRIPT;
+  options->columns = 1;
+  options->wrap = PAPS_WRAP_WORD_CHAR;
+  options->top_margin = MARGIN_TOP;
+  options->bottom_margin = MARGIN_BOTTOM;
+  options->left_margin = MARGIN_LEFT;
+  options->right_margin = MARGIN_RIGHT;
+  options->gutter_width = 40;
+}
+
+LIBPAPS_EXPORT const char *
+paps_version(void)
+{
+  return PACKAGE_STRING;
+}
+
+/* A document that is rendered, by paps_render() at once, or a page at
+ * a time by paps_next_page() */
+struct paps_document {
+  PageLayout page_layout {};
+  string input;                 // The text, which ends with a new line
+  cairo_surface_t *surface = nullptr;
+  cairo_t *cr = nullptr;
+  PangoContext *pango_context = nullptr;
+  PangoFontDescription *font_description = nullptr;
+  LibpapsWriter writer;
+  string output;                // The output of the current page
+  dict_t document_info;
+  deque<GList*> paragraphs;     // The batches of paragraphs that are laid out
+  GList *pango_lines = nullptr; // The laid out lines, from the next page on
+  deque<GList*> page_starts;    // The measured pages, from the next one on
+  size_t text_pos = 0;          // The text before this is laid out
+  int page_idx = 1;             // The next page
+};
+
+/* Set up the page layout the way that main() does it for the same
+ * command line options, and the surface that the output of the given
+ * format is written through write_func. Returns false on an error,
+ * after which the document must still be freed. */
+static bool
+init_document(paps_document_t *document,
+              const paps_options_t *options,
+              const char *text,
+              size_t length,
+              cairo_write_func_t write_func,
+              void *closure)
+{
+  if (options->api_version < 1 || options->api_version > PAPS_API_VERSION)
+    {
+      fprintf(stderr, _("%1$s: Unsupported API version %2$d.\n"), g_get_prgname (), options->api_version);
+      return false;
+    }
+  if (options->columns <= 0)
+    {
+      fprintf(stderr, _("%s: Invalid input: columns=%d.\n"), g_get_prgname (), options->columns);
+      return false;
+    }
+  if (options->format < PAPS_FORMAT_POSTSCRIPT || options->format > PAPS_FORMAT_SVG)
+    {
+      fprintf(stderr, _("%s: Invalid output format.\n"), g_get_prgname ());
+      return false;
+    }
+
+  paper_type = PAPER_TYPE_A4;
+  if (options->paper && !_paps_arg_paper_cb("paper", options->paper, nullptr))
+    return false;
+
+  switch (options->wrap)
+    {
+    case PAPS_WRAP_WORD:
+      opt_wrap = PANGO_WRAP_WORD;
+      break;
+    case PAPS_WRAP_CHAR:
+      opt_wrap = PANGO_WRAP_CHAR;
+      break;
+    default:
+      opt_wrap = PANGO_WRAP_WORD_CHAR;
+      break;
+    }
+  output_format = (output_format_t)options->format;
+
+  if (!paps_glyph_face)
+    {
+      paps_glyph_face = cairo_user_font_face_create();
+      cairo_user_font_face_set_render_glyph_func(paps_glyph_face, paps_render_glyph);
+    }
+
+  PageLayout& page_layout = document->page_layout;
+  double page_width = paper_sizes[(int)paper_type].width;
+  double page_height = paper_sizes[(int)paper_type].height;
+  if (options->landscape)
+    swap(page_width, page_height);
+  page_layout.page_width = page_width;
+  page_layout.page_height = page_height;
+  page_layout.paper_type = paper_type;
+  page_layout.num_columns = options->columns;
+  page_layout.left_margin = options->left_margin;
+  page_layout.right_margin = options->right_margin;
+  page_layout.gutter_width = options->gutter_width;
+  page_layout.top_margin = options->top_margin;
+  page_layout.bottom_margin = options->bottom_margin;
+  page_layout.header_ypos = page_layout.top_margin;
+  page_layout.scale_x = page_layout.scale_y = 1.0;
+  page_layout.column_height = (int)page_height
+                            - page_layout.top_margin
+                            - page_layout.bottom_margin;
+  page_layout.column_width = ((int)page_width
+                            - page_layout.left_margin - page_layout.right_margin
+                            - (options->columns - 1) * options->gutter_width) / options->columns;
+  page_layout.do_draw_separation_line = options->separation_lines;
+  page_layout.do_landscape = options->landscape;
+  page_layout.do_justify = options->justify;
+  page_layout.do_show_hyphens = options->hyphens;
+  page_layout.do_show_wrap = options->show_wrap;
+  page_layout.do_use_markup = options->markup;
+  page_layout.do_draw_header = options->header;
+  page_layout.do_draw_footer = options->footer;
+  page_layout.do_tumble = true;
+  page_layout.do_duplex = true;
+  page_layout.first_line_no = 1;
+  page_layout.lpi = options->lpi;
+  page_layout.pango_dir = options->rtl ? PANGO_DIRECTION_RTL : PANGO_DIRECTION_LTR;
+  page_layout.header_left = (char*)options->header_left;
+  page_layout.header_center = (char*)options->header_center;
+  page_layout.header_right = (char*)options->header_right;
+  page_layout.footer_left = (char*)options->footer_left;
+  page_layout.footer_center = (char*)options->footer_center;
+  page_layout.footer_right = (char*)options->footer_right;
+  page_layout.filename_path = options->title ? options->title : "stdin";
+  page_layout.filename = page_layout.filename_path;
+  page_layout.title = page_layout.filename;
+  page_layout.header_font_desc = options->header_font
+    ? options->header_font : MAKE_FONT_NAME (HEADER_FONT_FAMILY, HEADER_FONT_SCALE);
+
+  if (page_layout.column_width <= 0)
+    {
+      fprintf(stderr, _("%s: No room for the text between the margins.\n"), g_get_prgname ());
+      return false;
+    }
+  compute_page_geometry(&page_layout);
+
+  /* Postscript pages stay in portrait and are rotated when drawn */
+  double surface_page_width = page_width;
+  double surface_page_height = page_height;
+  if (output_format == FORMAT_POSTSCRIPT && options->landscape)
+    swap(surface_page_width, surface_page_height);
+
+  if (output_format == FORMAT_POSTSCRIPT)
+    document->surface = cairo_ps_surface_create_for_stream(write_func,
+                                                           closure,
+                                                           surface_page_width,
+                                                           surface_page_height);
+  else if (output_format == FORMAT_PDF)
+    document->surface = cairo_pdf_surface_create_for_stream(write_func,
+                                                            closure,
+                                                            surface_page_width,
+                                                            surface_page_height);
+  else
+    document->surface = cairo_svg_surface_create_for_stream(write_func,
+                                                            closure,
+                                                            surface_page_width,
+                                                            surface_page_height);
+  document->cr = cairo_create(document->surface);
+  document->pango_context = create_pango_context(document->cr, page_layout.pango_dir);
+
+  document->font_description = pango_font_description_from_string(
+      options->font ? options->font : MAKE_FONT_NAME (DEFAULT_FONT_FAMILY, DEFAULT_FONT_SIZE));
+  PangoFontDescription *font_description = document->font_description;
+  if ((pango_font_description_get_set_fields (font_description) & PANGO_FONT_MASK_FAMILY) == 0)
+    pango_font_description_set_family (font_description, DEFAULT_FONT_FAMILY);
+  if ((pango_font_description_get_set_fields (font_description) & PANGO_FONT_MASK_SIZE) == 0)
+    pango_font_description_set_size (font_description, atoi(DEFAULT_FONT_SIZE) * PANGO_SCALE);
+  glyph_font_size = pango_font_description_get_size(font_description) / PANGO_SCALE;
+  pango_context_set_font_description (document->pango_context, font_description);
+
+  // The paragraphs are split on the NUL terminated text, which also
+  // must end with a new line.
+  document->input.assign(text, length);
+  if (document->input.empty() || document->input.back() != '\n')
+    document->input += '\n';
+
+  page_layout.text = document->input.c_str();
+  page_layout.text_length = document->input.size();
+
+  if (output_format == FORMAT_POSTSCRIPT)
+    postscript_dsc_comments(document->surface, &page_layout);
+
+  return true;
+}
+
+/* Finish the output of the document, and report whether it could be
+ * written. */
+static bool
+finish_document(paps_document_t *document)
+{
+  cairo_destroy(document->cr);
+  document->cr = nullptr;
+  cairo_surface_finish(document->surface);
+  cairo_status_t status = cairo_surface_status(document->surface);
+  if (status != CAIRO_STATUS_SUCCESS)
+    {
+      fprintf(stderr, _("%1$s: Failed writing the output: %2$s\n"), g_get_prgname (), cairo_status_to_string(status));
+      return false;
+    }
+  return true;
+}
+
+LIBPAPS_EXPORT void
+paps_free(paps_document_t *document)
+{
+  if (!document)
+    return;
+  if (document->cr)
+    cairo_destroy(document->cr);
+  if (document->surface)
+    cairo_surface_destroy(document->surface);
+  g_list_free_full(document->pango_lines, g_free);
+  for (GList *paragraphs : document->paragraphs)
+    free_paragraphs(paragraphs);
+  if (document->pango_context)
+    g_object_unref(document->pango_context);
+  if (document->font_description)
+    pango_font_description_free(document->font_description);
+  delete document;
+}
+
+LIBPAPS_EXPORT int
+paps_render(const paps_options_t *options,
+            const char *text,
+            size_t length,
+            paps_write_func_t write_func,
+            void *closure)
+{
+  paps_document_t *document = new paps_document;
+  document->writer = { write_func, closure };
+  if (!init_document(document, options, text, length, &libpaps_write_func, &document->writer))
+    {
+      paps_free(document);
+      return -1;
+    }
+
+  PageLayout *page_layout = &document->page_layout;
+  GList *paragraphs = split_text_into_paragraphs(document->pango_context,
+                                                 page_layout,
+                                                 page_layout->column_width,
+                                                 document->input.c_str());
+  document->paragraphs.push_back(paragraphs);
+  document->pango_lines = split_paragraphs_into_lines(page_layout, paragraphs);
+
+  int num_pages = output_pages(document->surface,
+                               document->cr,
+                               document->pango_lines,
+                               page_layout,
+                               document->pango_context,
+                               1);
+  bool ok = finish_document(document);
+  paps_free(document);
+
+  return ok ? num_pages : -1;
+}
+
+LIBPAPS_EXPORT paps_document_t *
+paps_begin(const paps_options_t *options,
+           const char *text,
+           size_t length)
+{
+  paps_document_t *document = new paps_document;
+  if (!init_document(document, options, text, length,
+                     &paps_cairo_string_write_func, &document->output))
+    {
+      paps_free(document);
+      return nullptr;
+    }
+
+  // PostScript and SVG surfaces only write their pages when they are
+  // finished.
+  if (output_format != FORMAT_PDF)
+    {
+      fprintf(stderr, _("%s: Only PDF output can be rendered a page at a time.\n"), g_get_prgname ());
+      paps_free(document);
+      return nullptr;
+    }
+
+  // The number of pages is not known until the last page is done
+  if (document_info_keys(&document->page_layout).count("num_pages"))
+    {
+      fprintf(stderr, _("%s: {num_pages} is not supported when rendering a page at a time.\n"), g_get_prgname ());
+      paps_free(document);
+      return nullptr;
+    }
+  build_document_info(&document->page_layout, document->document_info);
+  document->document_info["num_pages"] = 0;
+
+  return document;
+}
+
+/* Lay out the paragraphs of the next block of whole lines of the text,
+ * and append their lines to those of the document. */
+static void
+layout_next_block(paps_document_t *document)
+{
+  PageLayout *page_layout = &document->page_layout;
+  string& input = document->input;
+  size_t begin = document->text_pos;
+  size_t end = input.find('\n', MIN(begin + LIBPAPS_BLOCK_SIZE, input.size() - 1)) + 1;
+
+  // The paragraphs are split up to the end of the block, that is cut
+  // off for the moment. The paragraphs point into the text.
+  char cut = input[end];
+  input[end] = '\0';
+  GList *paragraphs = split_text_into_paragraphs(document->pango_context,
+                                                 page_layout,
+                                                 page_layout->column_width,
+                                                 input.c_str() + begin);
+  input[end] = cut;
+
+  document->paragraphs.push_back(paragraphs);
+  document->pango_lines = g_list_concat(document->pango_lines,
+                                        split_paragraphs_into_lines(page_layout, paragraphs));
+  document->text_pos = end;
+
+  // The block ends with a new line, so the next one starts on the line after it
+  if (paragraphs)
+    page_layout->first_line_no = ((Paragraph*)g_list_last(paragraphs)->data)->line_no + 1;
+}
+
+/* Measure the pages from the last one that was started, which may have
+ * grown with the lines of the last block, and append the starts of the
+ * pages after it. The pages before it are complete, so every line is
+ * only measured again until the page that it is on is complete. */
+static void
+measure_pending_pages(paps_document_t *document)
+{
+  GList *first = document->page_starts.empty()
+    ? document->pango_lines : document->page_starts.back();
+  if (!first)
+    return;
+
+  int page_idx = document->page_idx + MAX((int)document->page_starts.size() - 1, 0);
+  vector<GList*> page_starts;
+  output_pages_pass(document->surface, document->cr, first, &document->page_layout,
+                    document->pango_context, document->document_info,
+                    page_idx, -1, true, &page_starts,
+                    nullptr, nullptr);
+  if (!document->page_starts.empty())
+    document->page_starts.pop_back();
+  document->page_starts.insert(document->page_starts.end(), page_starts.begin(), page_starts.end());
+}
+
+LIBPAPS_EXPORT int
+paps_next_page(paps_document_t *document,
+               const unsigned char **data,
+               size_t *length)
+{
+  PageLayout *page_layout = &document->page_layout;
+
+  document->output.clear();
+  *data = nullptr;
+  *length = 0;
+
+  // Lay out the text until the page after the next one has started
+  while (document->page_starts.size() < 2 && document->text_pos < document->input.size())
+    {
+      layout_next_block(document);
+      measure_pending_pages(document);
+    }
+  if (!document->pango_lines)
+    return 0;
+
+  // Draw the lines of the page, and free them
+  document->page_starts.pop_front();
+  GList *end = document->page_starts.empty() ? nullptr : document->page_starts.front();
+  if (end)
+    {
+      end->prev->next = nullptr;
+      end->prev = nullptr;
+    }
+  output_pages_pass(document->surface, document->cr, document->pango_lines, page_layout,
+                    document->pango_context, document->document_info,
+                    document->page_idx, -1, false, nullptr,
+                    nullptr, nullptr);
+  g_list_free_full(document->pango_lines, g_free);
+  document->pango_lines = end;
+  document->page_idx++;
+
+  // Free the paragraphs that all lines of have been drawn
+  const char *next_text = end
+    ? ((LineLink*)end->data)->para->text
+    : document->input.c_str() + document->text_pos;
+  while (!document->paragraphs.empty())
+    {
+      GList *last = g_list_last(document->paragraphs.front());
+      if (last && ((Paragraph*)last->data)->text >= next_text)
+        break;
+      free_paragraphs(document->paragraphs.front());
+      document->paragraphs.pop_front();
+    }
+
+  cairo_status_t status = cairo_surface_status(document->surface);
+  if (status != CAIRO_STATUS_SUCCESS)
+    {
+      fprintf(stderr, _("%1$s: Failed writing the output: %2$s\n"), g_get_prgname (), cairo_status_to_string(status));
+      return -1;
+    }
+
+  *data = (const unsigned char*)document->output.data();
+  *length = document->output.size();
+  return 1;
+}
+
+LIBPAPS_EXPORT int
+paps_finish(paps_document_t *document,
+            const unsigned char **data,
+            size_t *length)
+{
+  document->output.clear();
+  *data = nullptr;
+  *length = 0;
+  if (!finish_document(document))
+    return -1;
+
+  *data = (const unsigned char*)document->output.data();
+  *length = document->output.size();
+  return document->page_idx - 1;
+}
@@ -0,0 +1,149 @@
+/*
+ * libpaps.h: The C API for rendering text with paps in process.
+ *
+ * Copyright (C) 2002, 2005, 2022 Dov Grobgeld <dov.grobgeld@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ *
+ */
+#ifndef LIBPAPS_H
+#define LIBPAPS_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Bumped when paps_options_t is extended. New members are only ever
+ * added at the end of the struct. */
+#define PAPS_API_VERSION 1
+
+typedef enum {
+  PAPS_FORMAT_POSTSCRIPT = 0,
+  PAPS_FORMAT_PDF = 1,
+  PAPS_FORMAT_SVG = 2
+} paps_format_t;
+
+typedef enum {
+  PAPS_WRAP_WORD = 0,
+  PAPS_WRAP_CHAR = 1,
+  PAPS_WRAP_WORD_CHAR = 2
+} paps_wrap_t;
+
+/* The render options. They correspond to the command line options of
+ * paps with the same names. Initialize them with paps_options_init(),
+ * which sets the defaults of paps. A NULL string means the default. */
+typedef struct {
+  int api_version;            /* Set to PAPS_API_VERSION by paps_options_init() */
+  paps_format_t format;
+  const char *font;           /* A pango font description, e.g. "Monospace 10" */
+  const char *header_font;
+  const char *paper;          /* legal, letter, a4 or a3 */
+  int columns;
+  int landscape;
+  int rtl;
+  int markup;
+  int justify;
+  int hyphens;
+  paps_wrap_t wrap;
+  int show_wrap;
+  int separation_lines;
+  int header;
+  int footer;
+  const char *title;
+  const char *header_left;
+  const char *header_center;
+  const char *header_right;
+  const char *footer_left;
+  const char *footer_center;
+  const char *footer_right;
+  int top_margin;
+  int bottom_margin;
+  int left_margin;
+  int right_margin;
+  int gutter_width;
+  double lpi;                 /* 0 for the line spacing of the font */
+} paps_options_t;
+
+/* Receives the output as it is produced. Returns 0 on success, and
+ * anything else to stop the rendering with an error. */
+typedef int (*paps_write_func_t)(void *closure,
+                                 const unsigned char *data,
+                                 size_t length);
+
+void paps_options_init(paps_options_t *options);
+
+/* Render the UTF-8 text of the given length and pass the output to
+ * write_func. Returns the number of pages, or -1 on an error, which is
+ * then described on stderr. Rendering is not reentrant, so only one
+ * thread may call it at a time. */
+int paps_render(const paps_options_t *options,
+                const char *text,
+                size_t length,
+                paps_write_func_t write_func,
+                void *closure);
+
+/* A document that is rendered a page at a time, for callers that pull
+ * the output as they are ready for it, e.g. from an event loop:
+ *
+ *   paps_document_t *document = paps_begin(&options, text, length);
+ *   while ((status = paps_next_page(document, &data, &length)) > 0)
+ *     send(data, length);
+ *   if (status == 0)
+ *     num_pages = paps_finish(document, &data, &length);
+ *   paps_free(document);
+ *
+ * Every call only does a bounded amount of work: paps_next_page() lays
+ * out no more than a block of the text beyond the page that it draws.
+ * The output is owned by the document, and is valid until the next call
+ * with it. Only PDF output is supported, as PostScript and SVG output
+ * is only produced when it is finished, and paps_begin() fails for
+ * those formats. The number of pages is not known before the end, so
+ * {num_pages} can not be used in the headers and footers. The same
+ * restrictions of reentrancy as for paps_render() apply. */
+typedef struct paps_document paps_document_t;
+
+/* Start rendering the UTF-8 text of the given length, which is copied,
+ * as PDF. Returns NULL on an error, which is then described on stderr,
+ * also when the format of the options is not PAPS_FORMAT_PDF. */
+paps_document_t *paps_begin(const paps_options_t *options,
+                            const char *text,
+                            size_t length);
+
+/* Render the next page, and set data and length to the output that it
+ * produced, which may be empty. Returns 1 when a page was rendered, 0
+ * when all pages have been rendered, and -1 on an error. */
+int paps_next_page(paps_document_t *document,
+                   const unsigned char **data,
+                   size_t *length);
+
+/* Complete the output, and set data and length to the rest of it.
+ * Returns the number of pages, or -1 on an error. */
+int paps_finish(paps_document_t *document,
+                const unsigned char **data,
+                size_t *length);
+
+/* Free the document, which may also be done before it is finished */
+void paps_free(paps_document_t *document);
+
+const char *paps_version(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBPAPS_H */
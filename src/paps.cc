@@ -20,299 +20,42 @@
  *
  */
 
+#include "paps_core.h"
 #include <glib/gstdio.h>
-#include <pango/pango.h>
 #include <pango/pangoft2.h>
-#include <pango/pangocairo.h>
-#include <cairo/cairo.h>
 #include <cairo/cairo-ps.h>
 #include <cairo/cairo-pdf.h>
 #include <cairo/cairo-svg.h>
 #include <errno.h>
-#include <langinfo.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <signal.h>
+#include <poll.h>
+#include <dirent.h>
+#include <map>
+#include <set>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
-#include <time.h>
+#include <math.h>
 #include <locale.h>
-#include <libgen.h>
-#include <config.h>
 #include <string>
-#include <fmt/core.h>
-#include "format_from_dict.h"
+#include "input_prefetch.h"
 #include <vector>
+#include <stdexcept>
 
 using namespace std;
-using namespace fmt;
 
-#ifndef _XOPEN_SOURCE
-#define _XOPEN_SOURCE /* for wcwidth */
-// int wcwidth(wchar_t c);
-#endif
-#include <wchar.h>
-
-#if ENABLE_NLS
-#include <libintl.h>
-
-#define	_(str)		gettext(str)
-#ifdef gettext_noop
-#define N_(str)		gettext_noop(str)
-#else
-#define N_(str)		(str)
-#endif
-
-#else	/* NLS is disabled */
-#define _(str)		(str)
-#define N_(str)		(str)
-#endif
-
-#define BUFSIZE 1024
-#define DEFAULT_FONT_FAMILY     "Monospace"
-#define DEFAULT_FONT_SIZE       "12"
-#define HEADER_FONT_FAMILY      "Monospace Bold"
-#define HEADER_FONT_SCALE       "12"
-#define MAKE_FONT_NAME(f,s)     f " " s
-
-/*
- * Cairo sets limit on the comment line for cairo_ps_surface_dsc_comment() to
- * 255 characters, including the initial percent characters.
- */
-#define	CAIRO_COMMENT_MAX       255
-
-#define	MARGIN_LEFT     36
-#define	MARGIN_RIGHT    36
-#define	MARGIN_TOP      36
-#define	MARGIN_BOTTOM   36
-
-
-typedef enum {
-    PAPER_TYPE_A4 = 0,
-    PAPER_TYPE_US_LETTER = 1,
-    PAPER_TYPE_US_LEGAL = 2,
-    PAPER_TYPE_A3 = 3
-} paper_type_t ;
-
-typedef enum {
-    FORMAT_POSTSCRIPT = 0,
-    FORMAT_PDF = 1,
-    FORMAT_SVG = 2
-} output_format_t ;
-
-typedef struct  {
-    double width;
-    double height;
-} paper_size_t;
-
-static const paper_size_t paper_sizes[] = {
-    { 595.28, 841.89}, /* A4 */
-    { 612, 792},       /* US letter */
-    { 612, 1008},      /* US legal */
-    { 842, 1190}       /* A3 */
-};
-
-struct PageLayout {
-  ~PageLayout() {
-  };
-
-  int column_width;
-  int column_height;
-  int num_columns;
-  int gutter_width;  /* These are all in postscript points=1/72 inch... */
-  int top_margin;  
-  int bottom_margin;
-  int left_margin;
-  int right_margin;
-  int num_pages;
-  double page_width;
-  double page_height;
-  int header_ypos;
-  int header_sep;
-  int header_height;
-  int footer_height;
-  paper_type_t paper_type;
-  gdouble scale_x;
-  gdouble scale_y;
-  bool do_draw_header;
-  bool do_draw_footer;
-  bool do_duplex;
-  bool do_tumble;
-  bool do_landscape;
-  bool do_justify;
-  bool do_show_hyphens;
-  bool do_draw_separation_line;
-  bool do_draw_contour;
-  bool do_show_wrap;
-  bool do_use_markup;
-  bool do_stretch_chars;
-  PangoDirection pango_dir;
-  string title;
-  string filename_path;
-  string filename;
-  char* header_left = nullptr;
-  char* header_center = nullptr;
-  char* header_right = nullptr;
-  char* footer_left = nullptr;
-  char* footer_center = nullptr;
-  char* footer_right = nullptr;
-  string header_font_desc;
-  gdouble lpi;
-  gdouble cpi;
-  dict_t document_info;
-};
-
-struct LineLink {
-  PangoLayoutLine *pango_line;
-  PangoRectangle logical_rect;
-  PangoRectangle ink_rect;
-  int formfeed;
-  bool wrapped;   // Whether the paragraph was character wrapped
-};
+#define ESTIMATE_PAGES_FRACTION 0.05   // The default part of the text that --estimate-pages lays out
 
-typedef struct _Paragraph Paragraph;
-
-/* Structure representing a paragraph
- */
-struct _Paragraph {
-  const char *text;
-  int length;
-  int height;   /* Height, in pixels */
-  int formfeed;
-  bool wrapped; 
-  bool clipped;   // Whether the line was clipped. Used for CPI.
-  PangoLayout *layout;
-};
-
-/* Information passed in user data when drawing outlines */
-static GList *split_paragraphs_into_lines  (PageLayout   *page_layout,
-                                            GList           *paragraphs);
-static char  *read_file                    (FILE            *file,
-                                            gchar           *encoding);
-static GList *split_text_into_paragraphs   (PangoContext    *pango_context,
-                                            PageLayout   *page_layout,
-                                            int              paint_width,
-                                            const char      *text);
-static int    output_pages                 (cairo_surface_t * surface,
-                                            cairo_t         *cr,
-                                            GList           *pango_lines,
-                                            PageLayout   *page_layout,
-                                            PangoContext    *pango_context);
-static void   eject_column                 (cairo_t         *cr,
-                                            double          title_height,
-                                            PageLayout   *page_layout,
-                                            int              column_idx,
-                                            bool             measure_only);
-static void   eject_page                   (cairo_t         *cr);
-static void   start_page                   (cairo_surface_t *surface,
-                                            cairo_t         *cr, 
-                                            PageLayout   *page_layout,
-                                            bool            measure_only);
-static void   draw_line_to_page            (cairo_t         *cr,
-                                            int              column_idx,
-                                            int              column_pos,
-                                            PageLayout   *page_layout,
-                                            PangoLayoutLine *line,
-                                            bool         draw_wrap_character);
-static int    draw_page_header_line_to_page(cairo_t         *cr,
-                                            bool         is_footer,
-                                            PageLayout   *page_layout,
-                                            PangoContext    *ctx,
-                                            int              page,
-                                            int              num_pages,
-                                            dict_t&           document_info,
-                                            bool             measure_only);
-static void   postscript_dsc_comments      (cairo_surface_t *surface,
-                                            PageLayout   *page_layout);
-
-static void build_document_info            (PageLayout* page_layout,
-                                            dict_t& document_info);
-
-bool
-copy_pango_parse_enum (GType       type,
-		   const char *str,
- 		   int        *value,
-		   bool    warn,
-		   char      **possible_values);
-
-static char* get_encoding(void);
-string get_date();
-string fn_basename(const string& filename);
-
-FILE *output_fh;
-static paper_type_t paper_type = PAPER_TYPE_A4;
+static gint64 start_time = 0;      // When paps started, for --stats
 static bool output_format_set = false;
-static output_format_t output_format = FORMAT_POSTSCRIPT;
-static PangoGravity gravity = PANGO_GRAVITY_AUTO;
-static PangoGravityHint gravity_hint = PANGO_GRAVITY_HINT_NATURAL;
-static PangoWrapMode opt_wrap = PANGO_WRAP_WORD_CHAR;
-static cairo_font_face_t *paps_glyph_face = NULL; /* Special face for paps characters, e.g. newline */
-static double glyph_font_size = -1;
-
-/* Render function for paps glyphs */
-static cairo_status_t
-paps_render_glyph(cairo_scaled_font_t *scaled_font G_GNUC_UNUSED,
-                  unsigned long glyph,
-                  cairo_t *cr,
-                  cairo_text_extents_t *extents)
-{
-  char ch = (unsigned char)glyph;
-
-  if (ch == 'R' || ch == 'L')
-  {
-    // A newline sign that I created with MetaPost
-    cairo_save(cr);
-    cairo_scale(cr,0.005,-0.005); // TBD - figure out the scaling.
-    if (ch == 'L')
-    {
-      cairo_scale(cr,-1,1);
-      // cairo_translate(cr,-120,0);  // Keep glyph protruding to the right.
-    }
-    cairo_translate(cr, 20,-50);
-    cairo_move_to(cr, 0, 175);
-    cairo_curve_to(cr, 25.69278, 175, 53.912, 177.59557, 71.25053, 158.75053);
-    cairo_curve_to(cr, 103.52599, 123.67075, 64.54437, 77.19373, 34.99985, 34.99985);
-    cairo_set_line_width(cr, 25);
-    cairo_stroke(cr);
-
-    cairo_move_to(cr,0,0);
-    cairo_line_to(cr,75,0);
-    cairo_line_to(cr,0,75);
-    cairo_close_path(cr);
-    cairo_fill(cr);
-    cairo_restore(cr);
-  }
-  return CAIRO_STATUS_SUCCESS;
-}
-
-static bool
-_paps_arg_paper_cb(const char *option_name,
-                   const char *value,
-                   gpointer    data)
-{
-  bool retval = true;
-  
-  if (value && *value)
-    {
-      if (g_ascii_strcasecmp(value, "legal") == 0)
-        paper_type = PAPER_TYPE_US_LEGAL;
-      else if (g_ascii_strcasecmp(value, "letter") == 0)
-        paper_type = PAPER_TYPE_US_LETTER;
-      else if (g_ascii_strcasecmp(value, "a4") == 0)
-        paper_type = PAPER_TYPE_A4;
-      else if (g_ascii_strcasecmp(value, "a3") == 0)
-        paper_type = PAPER_TYPE_A3;
-      else {
-        retval = false;
-        fprintf(stderr, _("Unknown page size name: %s.\n"), value);
-      }
-    }
-  else
-    {
-      fprintf(stderr, _("You must specify page size.\n"));
-      retval = false;
-    }
-  
-  return retval;
-}
+static double estimate_pages_fraction = 0; /* The part of the text that --estimate-pages lays out */
 
 static bool
 parse_int (const char *word,
@@ -340,7 +83,7 @@ parse_int (const char *word,
 }
 
 // A local copy of the deprecated pango_parse_enum.
-bool
+static bool
 copy_pango_parse_enum (GType       type,
 		   const char *str,
  		   int        *value,
@@ -457,6 +200,135 @@ parse_gravity (const char *name,
                       name, arg, data, error));
 }
 
+/* Parse a highlight style, a comma separated list of bold, italic,
+ * underline, strikethrough, fg=COLOR and bg=COLOR.
+ */
+static bool
+parse_highlight_style(const char *style, vector<PangoAttribute*>& attrs)
+{
+  gchar **items = g_strsplit(style, ",", -1);
+  bool ok = items[0] != nullptr;
+  for (int i=0; ok && items[i]; i++)
+    {
+      const char *item = items[i];
+      PangoColor color;
+      if (g_str_equal(item, "bold"))
+        attrs.push_back(pango_attr_weight_new(PANGO_WEIGHT_BOLD));
+      else if (g_str_equal(item, "italic"))
+        attrs.push_back(pango_attr_style_new(PANGO_STYLE_ITALIC));
+      else if (g_str_equal(item, "underline"))
+        attrs.push_back(pango_attr_underline_new(PANGO_UNDERLINE_SINGLE));
+      else if (g_str_equal(item, "strikethrough"))
+        attrs.push_back(pango_attr_strikethrough_new(true));
+      else if (g_str_has_prefix(item, "fg=") && pango_color_parse(&color, item+3))
+        attrs.push_back(pango_attr_foreground_new(color.red, color.green, color.blue));
+      else if (g_str_has_prefix(item, "bg=") && pango_color_parse(&color, item+3))
+        attrs.push_back(pango_attr_background_new(color.red, color.green, color.blue));
+      else
+        ok = false;
+    }
+  g_strfreev(items);
+
+  if (!ok)
+    {
+      for (auto attr : attrs)
+        pango_attribute_destroy(attr);
+      attrs.clear();
+    }
+  return ok;
+}
+
+/* Parse PATTERN[:STYLE] of --highlight-regex. A trailing part that is
+ * not a valid style is taken to be a part of the pattern.
+ */
+static bool
+_paps_arg_highlight_cb(const char *option_name,
+                       const char *value,
+                       gpointer    data G_GNUC_UNUSED,
+                       GError    **error)
+{
+  Highlight highlight;
+  string pattern = value;
+  size_t colon = pattern.rfind(':');
+  if (colon == string::npos
+      || !parse_highlight_style(pattern.c_str() + colon + 1, highlight.attrs))
+    parse_highlight_style("bg=yellow", highlight.attrs);
+  else
+    pattern.erase(colon);
+
+  highlight.regex = g_regex_new(pattern.c_str(), G_REGEX_OPTIMIZE, (GRegexMatchFlags)0, error);
+  if (!highlight.regex)
+    {
+      for (auto attr : highlight.attrs)
+        pango_attribute_destroy(attr);
+      return false;
+    }
+  highlights.push_back(highlight);
+  return true;
+}
+
+static bool
+_paps_arg_line_numbers_cb(const gchar *option_name,
+                          const gchar *value,
+                          gpointer     data)
+{
+  PageLayout *page_layout = (PageLayout*)data;
+
+  page_layout->line_number_digits = 6;
+  if (value && *value)
+    {
+      gchar *p = nullptr;
+      long digits = strtol(value, &p, 10);
+      if (*p || digits <= 0 || digits > 20)
+        {
+          fprintf(stderr, _("Given line number width was invalid.\n"));
+          return false;
+        }
+      page_layout->line_number_digits = digits;
+    }
+
+  return true;
+}
+
+static bool
+_paps_arg_invalid_utf8_cb(const char *option_name,
+                          const char *value,
+                          gpointer    data)
+{
+  if (value && g_ascii_strcasecmp(value, "reject") == 0)
+    invalid_utf8 = INVALID_UTF8_REJECT;
+  else if (value && g_ascii_strcasecmp(value, "replace") == 0)
+    invalid_utf8 = INVALID_UTF8_REPLACE;
+  else if (value && g_ascii_strcasecmp(value, "latin1") == 0)
+    invalid_utf8 = INVALID_UTF8_LATIN1;
+  else
+    {
+      fprintf(stderr, _("Unknown invalid UTF-8 handling: %s.\n"), value ? value : "");
+      return false;
+    }
+
+  return true;
+}
+
+static bool
+_paps_arg_estimate_pages_cb(const char *option_name,
+                            const char *value,
+                            gpointer    data)
+{
+  estimate_pages_fraction = ESTIMATE_PAGES_FRACTION;
+  if (value && *value)
+    {
+      char *p = nullptr;
+      estimate_pages_fraction = g_ascii_strtod(value, &p);
+      if (*p || !(estimate_pages_fraction > 0.0 && estimate_pages_fraction <= 1.0))
+        {
+          fprintf(stderr, _("Given fraction of the text to estimate the pages from was invalid.\n"));
+          return false;
+        }
+    }
+
+  return true;
+}
 
 static bool
 _paps_arg_format_cb(const char *option_name,
@@ -546,26 +418,426 @@ _paps_arg_cpi_cb(const gchar *option_name,
 }
 
 
-/*
- * Return codeset name of the environment's locale. Use UTF8 by default
+/* The header of an input file that the reader process of render_batch()
+ * sends over its socket. A file that was read comes with a memfd that
+ * holds its contents, and otherwise the header is followed by the reason
+ * that it could not be read. */
+struct BatchFileHeader {
+  bool failed;
+  size_t size;
+};
+
+/* Write all of the data to fd. Returns false on an error. */
+static bool
+write_fully(int fd, const void *data, size_t len)
+{
+  const char *p = (const char*)data;
+  while (len > 0)
+    {
+      ssize_t n = write(fd, p, len);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return false;
+      p += n;
+      len -= n;
+    }
+  return true;
+}
+
+/* Read len bytes from fd. Returns false on an error or at the end. */
+static bool
+read_fully(int fd, void *data, size_t len)
+{
+  char *p = (char*)data;
+  while (len > 0)
+    {
+      ssize_t n = read(fd, p, len);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return false;
+      p += n;
+      len -= n;
+    }
+  return true;
+}
+
+/* Send the header of a file over sock, together with file_fd unless
+ * it is -1. Returns false on an error. */
+static bool
+send_batch_file(int sock, const BatchFileHeader& header, int file_fd)
+{
+  struct iovec iov = { (void*)&header, sizeof(header) };
+  union {
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (file_fd >= 0)
+    {
+      msg.msg_control = control.buf;
+      msg.msg_controllen = sizeof(control.buf);
+      struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+      cmsg->cmsg_level = SOL_SOCKET;
+      cmsg->cmsg_type = SCM_RIGHTS;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+      memcpy(CMSG_DATA(cmsg), &file_fd, sizeof(int));
+    }
+  ssize_t n;
+  while ((n = sendmsg(sock, &msg, 0)) < 0 && errno == EINTR)
+    ;
+  return n == (ssize_t)sizeof(header);
+}
+
+/* Receive the header of a file from sock, and the fd that comes with
+ * it in file_fd, or -1. Returns false on an error or at the end. */
+static bool
+receive_batch_file(int sock, BatchFileHeader& header, int *file_fd)
+{
+  struct iovec iov = { &header, sizeof(header) };
+  union {
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+  ssize_t n;
+  while ((n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR)
+    ;
+  *file_fd = -1;
+  struct cmsghdr *cmsg = n > 0 ? CMSG_FIRSTHDR(&msg) : nullptr;
+  if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+    memcpy(file_fd, CMSG_DATA(cmsg), sizeof(int));
+  return n > 0 && read_fully(sock, (char*)&header + n, sizeof(header) - n);
+}
+
+/* Render every file in a child process of its own, one after the other,
+ * while the next files are read ahead. Only the reading overlaps with
+ * the rendering; the files are rendered one at a time. Every child
+ * returns with the name of its file, and input_fd, a file descriptor
+ * of its contents, and renders it as paps does a single file. The parent
+ * exits once all files are done, with status 1 if any of them failed. A
+ * process per file keeps the global state of a document from leaking
+ * into the next one. The files are read ahead, by the threads or the
+ * io_uring of the prefetcher, in a reader process that is forked first,
+ * so that the process that forks the children stays single threaded.
+ * The reader writes every file into a memfd, which it passes over a
+ * socket, so that the parent never copies the contents.
  */
-static char*
-get_encoding(void)
+static const char *
+render_batch(int num_files, char **files, int prefetch_depth, int *input_fd)
 {
-  static char *encoding = nullptr;
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0)
+    {
+      fprintf(stderr, _("%1$s: Failed to start a process: %2$s\n"), g_get_prgname (), strerror(errno));
+      exit(1);
+    }
 
-  if (encoding == nullptr)
-    encoding = nl_langinfo(CODESET);
+  fflush(stdout);
+  fflush(stderr);
+  pid_t reader = fork();
+  if (reader < 0)
+    {
+      fprintf(stderr, _("%1$s: Failed to start a process: %2$s\n"), g_get_prgname (), strerror(errno));
+      exit(1);
+    }
+  if (reader == 0)
+    {
+      close(fds[0]);
+      bool ok = true;
+      {
+        vector<string> filenames(files, files + num_files);
+        InputPrefetcher prefetcher(filenames, prefetch_depth);
+        for (int i=0; i<num_files && ok; i++)
+          {
+            BatchFileHeader header = { false, 0 };
+            string data;
+            int file_fd = -1;
+            try
+              {
+                data = prefetcher.take(i);
+                file_fd = memfd_create("paps-input", MFD_CLOEXEC);
+                if (file_fd < 0 || !write_fully(file_fd, data.data(), data.size()))
+                  throw runtime_error(strerror(errno));
+                header.size = data.size();
+              }
+            catch (const runtime_error& e)
+              {
+                if (file_fd >= 0)
+                  close(file_fd);
+                file_fd = -1;
+                header.failed = true;
+                data = e.what();
+                header.size = data.size();
+              }
+            ok = send_batch_file(fds[1], header, file_fd)
+              && (!header.failed || write_fully(fds[1], data.data(), data.size()));
+            if (file_fd >= 0)
+              close(file_fd);
+          }
+      }
+      _exit(ok ? 0 : 1);
+    }
+  close(fds[1]);
+
+  int status = 0;
+  for (int i=0; i<num_files; i++)
+    {
+      BatchFileHeader header;
+      int file_fd;
+      if (!receive_batch_file(fds[0], header, &file_fd))
+        {
+          fprintf(stderr, _("%s: The process that reads the input files failed.\n"), g_get_prgname ());
+          status = 1;
+          break;
+        }
+      if (header.failed)
+        {
+          string reason(header.size, '\0');
+          if (header.size && !read_fully(fds[0], &reason[0], header.size))
+            reason = _("The input ended early");
+          fprintf(stderr, _("%1$s: Failed to read %2$s: %3$s\n"), g_get_prgname (), files[i], reason.c_str());
+          status = 1;
+          continue;
+        }
+      if (file_fd < 0)
+        {
+          fprintf(stderr, _("%s: The process that reads the input files failed.\n"), g_get_prgname ());
+          status = 1;
+          break;
+        }
+
+      fflush(stdout);
+      fflush(stderr);
+      pid_t pid = fork();
+      if (pid < 0)
+        {
+          fprintf(stderr, _("%1$s: Failed to start a process: %2$s\n"), g_get_prgname (), strerror(errno));
+          exit(1);
+        }
+      if (pid == 0)
+        {
+          close(fds[0]);
+          // The reader left the offset at the end of the contents
+          lseek(file_fd, 0, SEEK_SET);
+          *input_fd = file_fd;
+          return files[i];
+        }
+      close(file_fd);
+
+      int child_status;
+      while (waitpid(pid, &child_status, 0) < 0 && errno == EINTR)
+        ;
+      if (!WIFEXITED(child_status) || WEXITSTATUS(child_status) != 0)
+        status = 1;
+    }
+
+  close(fds[0]);
+  int reader_status;
+  while (waitpid(reader, &reader_status, 0) < 0 && errno == EINTR)
+    ;
+  if (!WIFEXITED(reader_status) || WEXITSTATUS(reader_status) != 0)
+    status = 1;
+  exit(status);
+}
+
+/* The name of the output file of an input file in out_dir */
+static gchar *
+batch_output_filename(const char *out_dir, const char *filename)
+{
+  const char *ext = output_format == FORMAT_PDF ? ".pdf"
+    : output_format == FORMAT_SVG ? ".svg" : ".ps";
+  return g_build_filename(out_dir, (fn_basename(filename) + ext).c_str(), nullptr);
+}
 
-  return encoding;
+/* Whether dir is parent_dir, or a directory inside of it */
+static bool
+dir_is_inside(const char *dir, const char *parent_dir)
+{
+  char *real_dir = realpath(dir, nullptr);
+  char *real_parent = realpath(parent_dir, nullptr);
+  bool inside = false;
+  if (real_dir && real_parent)
+    {
+      size_t len = strlen(real_parent);
+      inside = strncmp(real_dir, real_parent, len) == 0
+        && (real_dir[len] == '\0' || real_dir[len] == '/' || real_parent[len-1] == '/');
+    }
+  free(real_dir);
+  free(real_parent);
+  return inside;
 }
 
-static cairo_status_t paps_cairo_write_func(void *closure G_GNUC_UNUSED,
-                                            const unsigned char *data,
-                                            unsigned int length)
+/* Render the files that are written, or moved, into watch_dir, and
+ * those that are already there and have no up to date output, into
+ * out_dir. Up to num_workers files are rendered at a time, each in a
+ * child process, and the smallest waiting file is started first. The
+ * fonts are loaded before the children are forked, so that they start
+ * with them. This returns, with the name of the file, only in the
+ * children, and runs until it is killed. Files whose names start with
+ * a dot are ignored, so that they may be written under such a name and
+ * then renamed.
+ */
+static const char *
+watch_directory(const char *watch_dir,
+                const char *out_dir,
+                int num_workers,
+                const char *font,
+                const char *header_font)
 {
-  fwrite(data,length,1,output_fh);
-  return CAIRO_STATUS_SUCCESS;
+  int inotify_fd = inotify_init1(IN_CLOEXEC);
+  if (inotify_fd < 0
+      || inotify_add_watch(inotify_fd, watch_dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+    {
+      fprintf(stderr, _("%1$s: Failed to watch %2$s: %3$s\n"), g_get_prgname (), watch_dir, strerror(errno));
+      exit(1);
+    }
+
+  /* The children are reaped when a SIGCHLD is read from signal_fd */
+  sigset_t sigchld, old_mask;
+  sigemptyset(&sigchld);
+  sigaddset(&sigchld, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &sigchld, &old_mask);
+  int signal_fd = signalfd(-1, &sigchld, SFD_CLOEXEC);
+  if (signal_fd < 0)
+    {
+      fprintf(stderr, _("%1$s: Failed to watch %2$s: %3$s\n"), g_get_prgname (), watch_dir, strerror(errno));
+      exit(1);
+    }
+
+  for (const char *desc : { font, header_font })
+    {
+      PangoFontMap *fontmap = get_font_map();
+      PangoContext *ctx = pango_font_map_create_context(fontmap);
+      PangoFontDescription *font_description = pango_font_description_from_string(desc);
+      PangoFont *loaded = pango_font_map_load_font(fontmap, ctx, font_description);
+      if (loaded)
+        g_object_unref(loaded);
+      pango_font_description_free(font_description);
+      g_object_unref(ctx);
+    }
+
+  multimap<off_t, string> queue;   // The waiting files by size
+  set<string> queued;
+  map<pid_t, string> running;
+  set<string> running_paths;
+  set<string> rerun;               // The running files that changed since
+
+  auto enqueue_path = [&](const string& path, bool if_outdated) {
+    GStatBuf st, out_st;
+    if (g_stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode) || queued.count(path))
+      return;
+    // A file that changes while it is rendered is rendered again, once,
+    // after it is done, and not by a second worker at the same time.
+    if (running_paths.count(path))
+      {
+        rerun.insert(path);
+        return;
+      }
+    if (if_outdated)
+      {
+        gchar *output = batch_output_filename(out_dir, path.c_str());
+        bool up_to_date = g_stat(output, &out_st) == 0 && out_st.st_mtime >= st.st_mtime;
+        g_free(output);
+        if (up_to_date)
+          return;
+      }
+    queue.emplace(st.st_size, path);
+    queued.insert(path);
+  };
+  auto enqueue = [&](const char *name, bool if_outdated) {
+    if (name[0] == '.')
+      return;
+    gchar *path = g_build_filename(watch_dir, name, nullptr);
+    enqueue_path(path, if_outdated);
+    g_free(path);
+  };
+
+  DIR *dir = opendir(watch_dir);
+  if (dir)
+    {
+      struct dirent *entry;
+      while ((entry = readdir(dir)) != nullptr)
+        enqueue(entry->d_name, true);
+      closedir(dir);
+    }
+
+  while (true)
+    {
+      while ((int)running.size() < num_workers && !queue.empty())
+        {
+          string path = queue.begin()->second;
+          queue.erase(queue.begin());
+          queued.erase(path);
+
+          fflush(stdout);
+          fflush(stderr);
+          pid_t pid = fork();
+          if (pid < 0)
+            {
+              fprintf(stderr, _("%1$s: Failed to start a process: %2$s\n"), g_get_prgname (), strerror(errno));
+              exit(1);
+            }
+          if (pid == 0)
+            {
+              close(inotify_fd);
+              close(signal_fd);
+              sigprocmask(SIG_SETMASK, &old_mask, nullptr);
+              return g_strdup(path.c_str());
+            }
+          running[pid] = path;
+          running_paths.insert(path);
+        }
+
+      struct pollfd fds[2] = { { inotify_fd, POLLIN, 0 }, { signal_fd, POLLIN, 0 } };
+      if (poll(fds, 2, -1) < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          fprintf(stderr, _("%1$s: Failed to watch %2$s: %3$s\n"), g_get_prgname (), watch_dir, strerror(errno));
+          exit(1);
+        }
+
+      if (fds[0].revents & POLLIN)
+        {
+          char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+          ssize_t len = read(inotify_fd, buf, sizeof(buf));
+          for (char *p = buf; len > 0 && p < buf + len; )
+            {
+              struct inotify_event *event = (struct inotify_event*)p;
+              if (event->len)
+                enqueue(event->name, false);
+              p += sizeof(struct inotify_event) + event->len;
+            }
+        }
+
+      if (fds[1].revents & POLLIN)
+        {
+          struct signalfd_siginfo info;
+          (void) !read(signal_fd, &info, sizeof(info));
+          pid_t pid;
+          int status;
+          while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+            {
+              if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+                fprintf(stderr, _("%1$s: Failed to render %2$s\n"), g_get_prgname (), running[pid].c_str());
+              string path = running[pid];
+              running.erase(pid);
+              running_paths.erase(path);
+              if (rerun.erase(path))
+                enqueue_path(path, false);
+            }
+        }
+    }
 }
 
 int main(int argc, char *argv[])
@@ -574,16 +846,41 @@ int main(int argc, char *argv[])
   gboolean do_stretch_chars = false;
   gboolean do_draw_separation_line = false;
   gboolean do_use_markup = false;
+  gboolean do_ansi = false;
   gboolean do_show_wrap = false; /* Whether to show wrap characters */
   gboolean do_show_version = false; // Show version and exit
   int num_columns = 1;
+  int num_shards = 1;
+  int num_first_pages = 0;
+  int fit_pages = 0;
+  int num_pages = 0;
   int top_margin = MARGIN_TOP, bottom_margin = MARGIN_BOTTOM,
       right_margin = MARGIN_RIGHT, left_margin = MARGIN_LEFT;
   int gutter_width = 40;
   gboolean do_fatal_warnings = false;
+  gboolean do_linearize = false;
+  gboolean do_verify_layout = false;
+  gboolean do_stats = false;
+  gboolean do_collate = false, do_reverse = false;
+  int num_copies = 1;
+  gboolean do_count_pages = false;
   const gchar *font = MAKE_FONT_NAME (DEFAULT_FONT_FAMILY, DEFAULT_FONT_SIZE);
   gchar *encoding = nullptr;
   gchar *output = nullptr;
+  gchar *watch_output = nullptr;   // The output of --watch-dir, once it is complete
+  gchar *append_to = nullptr;
+  gchar *map_file = nullptr;
+  gchar *page_index_file = nullptr;
+  FILE *page_index_fh = nullptr;
+  DscIndex dsc_index = { nullptr, 0, 0, "", -1, -1, {}, -1 };
+  gchar *out_dir = nullptr;
+  gchar *watch_dir = nullptr;
+  gchar *font_file = nullptr;
+  gchar *header_font_file = nullptr;
+  string font_file_family, header_font_file_family;
+  int num_workers = g_get_num_processors();
+  int prefetch_depth = 4;
+  int input_fd = -1;
   gchar *htitle = nullptr;
   gchar *header_left = nullptr;
   gchar *header_center = nullptr;
@@ -592,7 +889,7 @@ int main(int argc, char *argv[])
   gchar *footer_center = nullptr;
   gchar *footer_right = nullptr;
   PageLayout page_layout;
-  GOptionContext *ctxt = g_option_context_new("[text file]");
+  GOptionContext *ctxt = g_option_context_new("[text file...]");
   GOptionEntry entries[] = {
     {"landscape", 0, 0, G_OPTION_ARG_NONE, &do_landscape,
      N_("Landscape output. (Default: portrait)"), nullptr},
@@ -600,8 +897,20 @@ int main(int argc, char *argv[])
      N_("Number of columns output. (Default: 1)"), "NUM"},
     {"font", 0, 0, G_OPTION_ARG_STRING, &font,
      N_("Set font. (Default: Monospace 12)"), "DESC"},
+    {"font-file", 0, 0, G_OPTION_ARG_FILENAME, &font_file,
+     N_("Use the font in the TrueType or OpenType FILE, without looking up the system fonts."), "FILE"},
+    {"header-font-file", 0, 0, G_OPTION_ARG_FILENAME, &header_font_file,
+     N_("Use the font in FILE for the header and footer, without looking up the system fonts."), "FILE"},
     {"output", 'o', 0, G_OPTION_ARG_STRING, &output,
      N_("Output file. (Default: stdout)"), "DESC"},
+    {"out-dir", 0, 0, G_OPTION_ARG_STRING, &out_dir,
+     N_("Render every input file into a file of its own in DIR."), "DIR"},
+    {"prefetch", 0, 0, G_OPTION_ARG_INT, &prefetch_depth,
+     N_("Number of input files to read ahead with --out-dir. (Default: 4)"), "NUM"},
+    {"watch-dir", 0, 0, G_OPTION_ARG_STRING, &watch_dir,
+     N_("Render the files that appear in DIR into --out-dir, smallest first."), "DIR"},
+    {"workers", 0, 0, G_OPTION_ARG_INT, &num_workers,
+     N_("Number of files that --watch-dir renders at a time. (Default: number of processors)"), "NUM"},
     {"version", 'v', 0, G_OPTION_ARG_NONE, &do_show_version,
      N_("Current version."), nullptr},
     {"rtl", 0, 0, G_OPTION_ARG_NONE, &do_rtl,
@@ -654,8 +963,16 @@ int main(int argc, char *argv[])
      N_("Right side of the footer. Default is localized date."), "FOOTER_RIGHT"},
     {"markup", 0, 0, G_OPTION_ARG_NONE, &do_use_markup,
      N_("Interpret input text as pango markup."), nullptr},
+    {"ansi", 0, 0, G_OPTION_ARG_NONE, &do_ansi,
+     N_("Interpret ANSI color and style escape sequences."), nullptr},
+    {"line-numbers", 0, G_OPTION_FLAG_OPTIONAL_ARG, G_OPTION_ARG_CALLBACK, (gpointer)&_paps_arg_line_numbers_cb,
+     N_("Number the lines, with NUM digits. (Default: 6)"), "NUM"},
+    {"highlight-regex", 0, 0, G_OPTION_ARG_CALLBACK, (gpointer)&_paps_arg_highlight_cb,
+     N_("Highlight the matches of PATTERN with STYLE. (Default style: bg=yellow)"), "PATTERN[:STYLE]"},
     {"encoding", 0, 0, G_OPTION_ARG_STRING, &encoding,
      N_("Assume encoding of input text. (Default: UTF-8)"), "ENCODING"},
+    {"invalid-utf8", 0, 0, G_OPTION_ARG_CALLBACK, (gpointer)_paps_arg_invalid_utf8_cb,
+     N_("What to do with invalid UTF-8 input: reject, replace or latin1. (Default: reject)"), "POLICY"},
     {"lpi", 0, 0, G_OPTION_ARG_CALLBACK, (gpointer)_paps_arg_lpi_cb,
      N_("Set the amount of lines per inch."), "REAL"},
     {"cpi", 0, 0, G_OPTION_ARG_CALLBACK, (gpointer)_paps_arg_cpi_cb,
@@ -666,6 +983,34 @@ int main(int argc, char *argv[])
     {"stretch-chars", 0, 0, G_OPTION_ARG_NONE, &do_stretch_chars,
      N_("Stretch characters in y-direction to fill lines."), nullptr},
      */
+    {"shards", 0, 0, G_OPTION_ARG_INT, &num_shards,
+     N_("Render PDF output in NUM parallel shards. (Default: 1)"), "NUM"},
+    {"append-to", 0, 0, G_OPTION_ARG_STRING, &append_to,
+     N_("Append the pages to an existing PDF file as an incremental update."), "FILE"},
+    {"linearize", 0, 0, G_OPTION_ARG_NONE, &do_linearize,
+     N_("Write linearized PDF for fast display of the first page."), nullptr},
+    {"map", 0, 0, G_OPTION_ARG_STRING, &map_file,
+     N_("Write the page and position of every input line as JSON lines to FILE."), "FILE"},
+    {"page-index", 0, 0, G_OPTION_ARG_STRING, &page_index_file,
+     N_("Write the byte offsets of the pages of the PostScript output as JSON to FILE."), "FILE"},
+    {"fit-pages", 0, 0, G_OPTION_ARG_INT, &fit_pages,
+     N_("Reduce the font size until the text fits on NUM pages."), "NUM"},
+    {"first-pages", 0, 0, G_OPTION_ARG_INT, &num_first_pages,
+     N_("Write the first NUM pages of the PDF output as soon as they are laid out, and the rest once it is done."), "NUM"},
+    {"count-pages", 0, 0, G_OPTION_ARG_NONE, &do_count_pages,
+     N_("Print the number of pages to stdout, without any output."), nullptr},
+    {"estimate-pages", 0, G_OPTION_FLAG_OPTIONAL_ARG, G_OPTION_ARG_CALLBACK, (gpointer)&_paps_arg_estimate_pages_cb,
+     N_("Print an estimate of the number of pages to stdout, from laying out FRACTION of the text. (Default: 0.05)"), "FRACTION"},
+    {"copies", 0, 0, G_OPTION_ARG_INT, &num_copies,
+     N_("Output NUM copies of every page. (Default: 1)"), "NUM"},
+    {"collate", 0, 0, G_OPTION_ARG_NONE, &do_collate,
+     N_("Output the copies as copies of the whole document."), nullptr},
+    {"reverse", 0, 0, G_OPTION_ARG_NONE, &do_reverse,
+     N_("Output the pages from the last one to the first."), nullptr},
+    {"stats", 0, 0, G_OPTION_ARG_NONE, &do_stats,
+     N_("Report the number of pages and the time to the first page on stderr."), nullptr},
+    {"verify-layout", 0, 0, G_OPTION_ARG_NONE, &do_verify_layout,
+     N_("Check that the parallel layout of the pages matches the serial one, without output."), nullptr},
     {"g-fatal-warnings", 0, 0, G_OPTION_ARG_NONE, &do_fatal_warnings,
      N_("Make all glib warnings fatal."), "REAL"},
 
@@ -696,6 +1041,11 @@ int main(int argc, char *argv[])
   cairo_t *cr;
   cairo_surface_t *surface = nullptr;
   double surface_page_width = 0, surface_page_height = 0;
+  void *write_closure;
+  int first_page_idx = 1;
+  string pdf_output;  // PDF output that is post processed before it is written
+
+  start_time = g_get_monotonic_time();
 
   /* Set locale from environment */
   (void) setlocale(LC_ALL, "");
@@ -711,6 +1061,7 @@ int main(int argc, char *argv[])
 
   /* Init PageLayout parameters set by the option parsing */
   page_layout.cpi = page_layout.lpi = 0.0L;
+  page_layout.line_number_digits = 0;
 
   options = g_option_group_new("main","","",&page_layout, nullptr);
   g_option_group_add_entries(options, entries);
@@ -736,6 +1087,19 @@ int main(int argc, char *argv[])
   if (do_fatal_warnings)
     g_log_set_always_fatal(G_LOG_LEVEL_MASK);
 
+  /* The font files are the only fonts that are used then. With only a
+   * header font file, the text is still in the system fonts. */
+  if (font_file)
+    font_file_family = add_font_file(font_file, false);
+  if (header_font_file)
+    {
+      header_font_file_family = add_font_file(header_font_file, !font_file);
+      PangoFontDescription *desc = pango_font_description_from_string(header_font_desc);
+      pango_font_description_set_family(desc, header_font_file_family.c_str());
+      header_font_desc = pango_font_description_to_string(desc);
+      pango_font_description_free(desc);
+    }
+
   if (do_rtl)
     pango_dir = PANGO_DIRECTION_RTL;
 
@@ -750,7 +1114,79 @@ int main(int argc, char *argv[])
   page_layout.do_draw_header = do_draw_header;
   page_layout.do_draw_footer = do_draw_footer;
 
-  if (argc > 1)
+  if (watch_dir)
+    {
+      if (!out_dir)
+        {
+          fprintf(stderr, _("%s: --watch-dir needs --out-dir.\n"), g_get_prgname ());
+          exit(1);
+        }
+      if (argc > 1 || append_to || map_file || page_index_file)
+        {
+          fprintf(stderr, _("%s: Input files, --append-to, --map and --page-index are not supported with --watch-dir.\n"), g_get_prgname ());
+          exit(1);
+        }
+      if (num_workers <= 0)
+        num_workers = 1;
+      if (dir_is_inside(out_dir, watch_dir))
+        {
+          fprintf(stderr, _("%s: --out-dir may not be --watch-dir or inside of it.\n"), g_get_prgname ());
+          exit(1);
+        }
+
+      /* This returns in the process that renders the file */
+      filename_in = watch_directory(watch_dir, out_dir, num_workers, font, header_font_desc);
+      start_time = g_get_monotonic_time();
+
+      /* The output is written under a hidden name, and only renamed into
+       * place once it is complete. A partial output of a worker that
+       * failed would otherwise look up to date, and never be redone. */
+      watch_output = batch_output_filename(out_dir, filename_in);
+      gchar *basename = g_path_get_basename(watch_output);
+      gchar *tmp_basename = g_strdup_printf(".%d.%s", (int)getpid(), basename);
+      output = g_build_filename(out_dir, tmp_basename, nullptr);
+      g_free(tmp_basename);
+      g_free(basename);
+      IN = fopen(filename_in, "r");
+      if (!IN)
+        {
+          fprintf(stderr, _("Failed to open %s!\n"), filename_in);
+          exit(1);
+        }
+    }
+  else if (out_dir)
+    {
+      if (argc < 2)
+        {
+          fprintf(stderr, _("%s: --out-dir needs input files.\n"), g_get_prgname ());
+          exit(1);
+        }
+      if (append_to || map_file || page_index_file)
+        {
+          fprintf(stderr, _("%s: --append-to, --map and --page-index are not supported with --out-dir.\n"), g_get_prgname ());
+          exit(1);
+        }
+      if (output)
+        fprintf(stderr, _("%s: --output is ignored with --out-dir.\n"), g_get_prgname ());
+
+      /* This returns in the process that renders the file */
+      filename_in = render_batch(argc - 1, argv + 1, prefetch_depth, &input_fd);
+      start_time = g_get_monotonic_time();
+
+      output = batch_output_filename(out_dir, filename_in);
+      IN = fdopen(input_fd, "r");
+      if (!IN)
+        {
+          fprintf(stderr, _("Failed to open %s!\n"), filename_in);
+          exit(1);
+        }
+    }
+  else if (argc > 2)
+    {
+      fprintf(stderr, _("%s: Several input files need --out-dir.\n"), g_get_prgname ());
+      exit(1);
+    }
+  else if (argc > 1)
     {
       filename_in = argv[1];
       IN = fopen(filename_in, "r");
@@ -766,8 +1202,41 @@ int main(int argc, char *argv[])
       IN = stdin;
     }
 
-  // For now always write to stdout
-  if (output == nullptr)
+  /* Appending to a file that does not exist yet is the same as
+   * writing a new PDF to it. */
+  if (append_to)
+    {
+      if (output)
+        fprintf(stderr, _("%s: --output is ignored with --append-to.\n"), g_get_prgname ());
+      if (output_format_set && output_format != FORMAT_PDF)
+        fprintf(stderr, _("%s: --append-to always produces PDF output.\n"), g_get_prgname ());
+      output = nullptr;
+      output_format = FORMAT_PDF;
+      output_format_set = true;
+
+      if (!g_file_test(append_to, G_FILE_TEST_EXISTS))
+        {
+          output = append_to;
+          append_to = nullptr;
+        }
+      else
+        {
+          if (num_shards > 1)
+            fprintf(stderr, _("%s: --shards is not supported with --append-to, ignoring.\n"), g_get_prgname ());
+          if (do_linearize)
+            fprintf(stderr, _("%s: --linearize is not supported with --append-to, ignoring.\n"), g_get_prgname ());
+          num_shards = 1;
+          do_linearize = false;
+          first_page_idx = append_pdf_page_count(append_to) + 1;
+        }
+    }
+
+  // For now always write to stdout. Counting the pages writes no output,
+  // and neither does verifying the layout, so the output file is left
+  // alone.
+  if (append_to || do_count_pages || estimate_pages_fraction > 0 || do_verify_layout)
+    output_fh = nullptr;
+  else if (output == nullptr)
     output_fh = stdout;
   else
     {
@@ -779,6 +1248,24 @@ int main(int argc, char *argv[])
         }
     }
 
+  // Counting the pages writes no map and no page index either
+  if ((map_file || page_index_file) && (do_count_pages || estimate_pages_fraction > 0))
+    {
+      fprintf(stderr, _("%s: --map and --page-index are not supported with --count-pages and --estimate-pages, ignoring.\n"), g_get_prgname ());
+      map_file = nullptr;
+      page_index_file = nullptr;
+    }
+
+  if (map_file)
+    {
+      map_fh = fopen(map_file, "w");
+      if (!map_fh)
+        {
+          fprintf(stderr, _("Failed to open %s for writing!\n"), map_file);
+          exit(1);
+        }
+    }
+
   /* Page layout */
   page_width = paper_sizes[(int)paper_type].width;
   page_height = paper_sizes[(int)paper_type].height;
@@ -793,6 +1280,70 @@ int main(int argc, char *argv[])
       /* Otherwise keep postscript default */
     }
   
+  if (num_shards > 1 && output_format != FORMAT_PDF)
+    {
+      fprintf(stderr, _("%s: --shards is only supported for PDF output, ignoring.\n"), g_get_prgname ());
+      num_shards = 1;
+    }
+  else if (num_shards <= 0)
+    {
+      fprintf(stderr, _("%s: Invalid input: --shards=%d, using default.\n"), g_get_prgname (), num_shards);
+      num_shards = 1;
+    }
+
+  if (page_index_file && output_format != FORMAT_POSTSCRIPT)
+    fprintf(stderr, _("%s: --page-index is only supported for PostScript output, ignoring.\n"), g_get_prgname ());
+  else if (page_index_file)
+    {
+      page_index_fh = fopen(page_index_file, "w");
+      if (!page_index_fh)
+        {
+          fprintf(stderr, _("Failed to open %s for writing!\n"), page_index_file);
+          exit(1);
+        }
+    }
+
+  if (do_linearize && output_format != FORMAT_PDF)
+    {
+      fprintf(stderr, _("%s: --linearize is only supported for PDF output, ignoring.\n"), g_get_prgname ());
+      do_linearize = false;
+    }
+
+  if (num_first_pages < 0)
+    {
+      fprintf(stderr, _("%s: Invalid input: --first-pages=%d, ignoring.\n"), g_get_prgname (), num_first_pages);
+      num_first_pages = 0;
+    }
+  else if (num_first_pages > 0 && output_format != FORMAT_PDF)
+    {
+      fprintf(stderr, _("%s: --first-pages is only supported for PDF output, ignoring.\n"), g_get_prgname ());
+      num_first_pages = 0;
+    }
+  else if (num_first_pages > 0 && (append_to || do_linearize || map_fh || do_verify_layout))
+    {
+      fprintf(stderr, _("%s: --first-pages is not supported with --append-to, --linearize, --map or --verify-layout, ignoring.\n"), g_get_prgname ());
+      num_first_pages = 0;
+    }
+  else if (num_first_pages > 0 && num_shards > 1)
+    {
+      fprintf(stderr, _("%s: --shards is ignored with --first-pages.\n"), g_get_prgname ());
+      num_shards = 1;
+    }
+
+  if (num_copies <= 0)
+    {
+      fprintf(stderr, _("%s: Invalid input: --copies=%d, using default.\n"), g_get_prgname (), num_copies);
+      num_copies = 1;
+    }
+  /* The copies are replayed from the recordings of the pages of the
+   * whole document, that the shards and the first pages skip. */
+  if ((num_copies > 1 || do_reverse) && (num_shards > 1 || num_first_pages > 0))
+    {
+      fprintf(stderr, _("%s: --shards and --first-pages are ignored with --copies and --reverse.\n"), g_get_prgname ());
+      num_shards = 1;
+      num_first_pages = 0;
+    }
+
   /* Swap width and height for landscape except for postscript */
   surface_page_width = page_width;
   surface_page_height = page_height;
@@ -802,36 +1353,51 @@ int main(int argc, char *argv[])
       surface_page_height = page_width;
     }
         
-  if (output_format == FORMAT_POSTSCRIPT)
+  /* With shards or --first-pages the main surface is only used for
+   * measuring, and the output is written by the merge of the shards. */
+  write_closure = num_shards > 1 || num_first_pages > 0 || do_verify_layout
+    || do_count_pages || estimate_pages_fraction > 0 ? nullptr : output_fh;
+
+  if (output_format == FORMAT_POSTSCRIPT && page_index_fh && write_closure)
+    {
+      /* The output is indexed on its way to the output file */
+      dsc_index.fh = output_fh;
+      surface = cairo_ps_surface_create_for_stream(&paps_cairo_dsc_index_write_func,
+                                                   &dsc_index,
+                                                   surface_page_width,
+                                                   surface_page_height);
+    }
+  else if (output_format == FORMAT_POSTSCRIPT)
     surface = cairo_ps_surface_create_for_stream(&paps_cairo_write_func,
-                                                 nullptr,
+                                                 write_closure,
                                                  surface_page_width,
                                                  surface_page_height);
+  else if (output_format == FORMAT_PDF && num_shards == 1 && (append_to || do_linearize))
+    surface = cairo_pdf_surface_create_for_stream(&paps_cairo_string_write_func,
+                                                  &pdf_output,
+                                                  surface_page_width,
+                                                  surface_page_height);
   else if (output_format == FORMAT_PDF)
     surface = cairo_pdf_surface_create_for_stream(&paps_cairo_write_func,
-                                                  nullptr,
+                                                  write_closure,
                                                   surface_page_width,
                                                   surface_page_height);
   else 
     surface = cairo_svg_surface_create_for_stream(&paps_cairo_write_func,
-                                                  nullptr,
+                                                  write_closure,
                                                   surface_page_width,
                                                   surface_page_height);
 
   cr = cairo_create(surface);
 
-  pango_context = pango_cairo_create_context(cr);
-  pango_cairo_context_set_resolution(pango_context, 72.0); /* Native postscript resolution */
-  
   /* Setup pango */
-  pango_context_set_base_dir (pango_context, pango_dir);
-  pango_context_set_language (pango_context, pango_language_get_default ());
-  pango_context_set_base_gravity (pango_context, gravity);
-  pango_context_set_gravity_hint (pango_context, gravity_hint);
+  pango_context = create_pango_context(cr, pango_dir);
   
   /* create the font description */
   font_description = pango_font_description_from_string (font);
-  if ((pango_font_description_get_set_fields (font_description) & PANGO_FONT_MASK_FAMILY) == 0)
+  if (font_file)
+    pango_font_description_set_family (font_description, font_file_family.c_str());
+  else if ((pango_font_description_get_set_fields (font_description) & PANGO_FONT_MASK_FAMILY) == 0)
     pango_font_description_set_family (font_description, DEFAULT_FONT_FAMILY);
   if ((pango_font_description_get_set_fields (font_description) & PANGO_FONT_MASK_SIZE) == 0)
     pango_font_description_set_size (font_description, atoi(DEFAULT_FONT_SIZE) * PANGO_SCALE);
@@ -898,8 +1464,21 @@ int main(int argc, char *argv[])
   page_layout.do_show_hyphens = do_show_hyphens;
   page_layout.do_stretch_chars = do_stretch_chars;
   page_layout.do_use_markup = do_use_markup;
+  page_layout.do_ansi = do_ansi;
+  if (do_ansi && (do_use_markup || page_layout.cpi > 0.0))
+    {
+      fprintf(stderr, _("%s: --ansi is not supported with --markup or --cpi, ignoring.\n"), g_get_prgname ());
+      page_layout.do_ansi = false;
+    }
+  page_layout.line_number_width = 0;
+  page_layout.document_info_built = false;
+  page_layout.first_line_no = 1;
+  page_layout.starts_in_line = false;
   page_layout.do_tumble = do_tumble;
   page_layout.do_duplex = do_duplex;
+  page_layout.num_copies = num_copies;
+  page_layout.do_collate = do_collate;
+  page_layout.do_reverse = do_reverse;
   page_layout.pango_dir = pango_dir;
   page_layout.filename_path = filename_in;
   page_layout.filename = fn_basename(filename_in);
@@ -911,11 +1490,13 @@ int main(int argc, char *argv[])
   page_layout.header_font_desc = header_font_desc;
 
   /* calculate x-coordinate scale */
-  if (page_layout.cpi > 0.0L)
+  if (page_layout.cpi > 0.0)
     {
       gint font_size;
 
       fontmap = pango_ft2_font_map_new ();
+      if (font_file_config)
+        pango_fc_font_map_set_config (PANGO_FC_FONT_MAP (fontmap), font_file_config);
       fontset = pango_font_map_load_fontset (fontmap, pango_context, font_description, pango_language_get_default());
       metrics = pango_fontset_get_metrics (fontset);
       max_width = pango_font_metrics_get_approximate_char_width (metrics);
@@ -935,923 +1516,157 @@ int main(int argc, char *argv[])
 
   page_layout.scale_x = page_layout.scale_y = 1.0;
 
+  /* Make room for the line numbers, and a space, in every column */
+  int text_column_width = page_layout.column_width;
+  if (!set_line_number_width(&page_layout, pango_context, text_column_width))
+    {
+      fprintf(stderr, _("%s: No room for the text beside the line numbers.\n"), g_get_prgname ());
+      exit(1);
+    }
+
   if (encoding == nullptr)
     encoding = get_encoding();
 
   text = read_file(IN, encoding);
-
-  if (output_format == FORMAT_POSTSCRIPT)
-    postscript_dsc_comments(surface, &page_layout);
-
-  paragraphs = split_text_into_paragraphs(pango_context,
-                                          &page_layout,
-                                          page_layout.column_width, 
-                                          text);
-  pango_lines = split_paragraphs_into_lines(&page_layout, paragraphs);
-
-  cairo_scale(cr, page_layout.scale_x, page_layout.scale_y);
-
-  output_pages(surface,
-               cr,
-               pango_lines,
-               &page_layout,
-               pango_context);
-
-  cairo_destroy (cr);
-  cairo_surface_finish (surface);
-  cairo_surface_destroy(surface);
-  g_option_context_free(ctxt);
-
-  return 0;
-}
-
-
-/* Read an entire file into a string
- */
-static char *
-read_file (FILE   *file,
-           gchar  *encoding)
-{
-  GString *inbuf;
-  char *text;
-  char buffer[BUFSIZE];
-  GIConv cvh = nullptr;
-  gsize inc_seq_bytes = 0;
-
-
-  if (encoding != nullptr)
-    {
-      cvh = g_iconv_open ("UTF-8", encoding);
-      if (cvh == (GIConv)-1)
-        {
-          fprintf(stderr, _("%s: Invalid encoding: %s\n"), g_get_prgname (), encoding);
-          exit(1);
-        }
-    }
-
-  inbuf = g_string_new (nullptr);
-  while (1)
+  page_layout.text = text;
+  page_layout.text_length = strlen(text);
+
+  if (fit_pages > 0 && page_layout.cpi > 0.0)
+    fprintf(stderr, _("%s: --fit-pages is not supported with --cpi, ignoring.\n"), g_get_prgname ());
+  else if (fit_pages > 0
+           && !fit_font_size(surface, cr, &page_layout, pango_context, font_description,
+                             text_column_width, fit_pages))
     {
-      char *ib, *ob, obuffer[BUFSIZE * 6], *bp;
-      gsize iblen, oblen;
-
-      bp = fgets (buffer+inc_seq_bytes, BUFSIZE-inc_seq_bytes-1, file);
-      if (inc_seq_bytes)
-        inc_seq_bytes = 0;
-
-      if (ferror (file))
+      if (page_layout.column_width <= 0)
         {
-          fprintf(stderr, _("%s: Error reading file.\n"), g_get_prgname ());
-          (void) g_string_free (inbuf, true);
+          fprintf(stderr, _("%1$s: The text can not be fitted on %2$d pages, as there is no room for it beside the line numbers.\n"),
+                  g_get_prgname (), fit_pages);
           exit(1);
         }
-      else if (bp == nullptr)
-        break;
-
-      if (cvh != nullptr)
-        {
-          ib = buffer;
-          iblen = strlen (ib);
-          ob = bp = obuffer;
-          oblen = BUFSIZE * 6 - 1;
-          if (g_iconv (cvh, &ib, &iblen, &ob, &oblen) == (gsize)-1)
-            {
-              /*
-               * EINVAL - incomplete sequence at the end of the buffer. Move the
-               * incomplete sequence bytes to the beginning of the buffer for
-               * the next round of conversion.
-               */
-              if (errno == EINVAL)
-                {
-                  inc_seq_bytes = iblen;
-                  memmove (buffer, ib, inc_seq_bytes);
-                }
-              else
-                {
-                  fprintf (stderr, _("%1$s: Error while converting input from '%2$s' to UTF-8.\n"),
-                    g_get_prgname(), encoding);
-                  exit(1);
-                }
-             }
-          obuffer[BUFSIZE * 6 - 1 - oblen] = 0;
-        }
-      g_string_append (inbuf, bp);
-    }
-
-  fclose (file);
-
-  /* Add a trailing new line if it is missing */
-  if (inbuf->len && inbuf->str[inbuf->len-1] != '\n')
-    g_string_append(inbuf, "\n");
-
-  text = g_string_free (inbuf, false);
-
-  if (encoding != nullptr && cvh != nullptr)
-    g_iconv_close(cvh);
-
-  return text;
-}
-
-// Turn off the use of hyphens
-static void
-layout_turn_off_hyphens(PangoLayout *layout)
-{
-  // Request not to get any hypens
-  PangoAttrList *attrs = pango_layout_get_attributes(layout);
-  if (attrs == NULL)
-    attrs = pango_attr_list_new ();
-  pango_attr_list_insert(attrs, pango_attr_insert_hyphens_new(FALSE));
-  pango_layout_set_attributes (layout, attrs);
-}
-
-/* Take a UTF8 string and break it into paragraphs on \n characters
- */
-static GList *
-split_text_into_paragraphs (PangoContext *pango_context,
-                            PageLayout *page_layout,
-                            int paint_width,  /* In pixels */
-                            const char *text)
-{
-  const char *p = text;
-  char *next;
-  gunichar wc;
-  GList *result = nullptr;
-  const char *last_para = text;
-
-  /* If we are using markup we treat the entire text as a single paragraph.
-   * I tested it and found that this is much slower than the split and
-   * assign method used below. Otherwise we might as well use this single
-   * chunk method always.
-   *
-   * I don't think we need this at all, and are better of reading one
-   * line at a time...
-   */
-#if 0
-  if (0 && page_layout->do_use_markup)
-    {
-      Paragraph *para = g_new (Paragraph, 1);
-      para->wrapped = false; /* No wrapped chars for markups */
-      para->clipped = false;
-      para->text = text;
-      para->length = strlen(text);
-      para->layout = pango_layout_new (pango_context);
-      pango_layout_set_attributes (para->layout, attrs);
-      pango_layout_set_markup (para->layout, para->text, para->length);
-      pango_layout_set_justify (para->layout, page_layout->do_justify);
-      pango_layout_set_alignment (para->layout,
-                                  page_layout->pango_dir == PANGO_DIRECTION_LTR
-                                      ? PANGO_ALIGN_LEFT : PANGO_ALIGN_RIGHT);
-      pango_layout_set_width (para->layout, paint_width * PANGO_SCALE);
-      pango_layout_set_wrap (para->layout, opt_wrap);
-
-      para->height = 0;
-      
-      result = g_list_prepend (result, para);
-    }
-  else
-#endif
-    {
-
-      while (p != nullptr && *p)
-        {
-          wc = g_utf8_get_char (p);
-          next = g_utf8_next_char (p);
-          if (wc == (gunichar)-1)
-            {
-              fprintf (stderr, _("%s: Invalid character in input\n"), g_get_prgname ());
-              wc = 0;
-            }
-          if (!*p || !wc || wc == '\r' || wc == '\n' || wc == '\f')
-            {
-              Paragraph *para = g_new (Paragraph, 1);
-              para->wrapped = false;
-              para->clipped = false;
-              para->text = last_para;
-              para->length = p - last_para;
-              /* handle dos line breaks */
-              if (wc == '\r' && *next == '\n')
-                  next = g_utf8_next_char(next);
-              para->layout = pango_layout_new (pango_context);
-
-              if (page_layout->cpi > 0.0L)
-                {
-                  /* figuring out the correct width from the pango_font_metrics_get_approximate_width()
-                   * is really hard and pango_layout_set_wrap() doesn't work properly then.
-                   * Those are not reliable to render the characters exactly according to the given CPI.
-                   * So re-calculate the width to wrap up to be comfortable with CPI.
-                   */
-                  wchar_t *wtext = nullptr, *wnewtext = nullptr;
-                  gchar *newtext = nullptr;
-                  gsize len, col, i, wwidth = 0;
-                  PangoRectangle ink_rect, logical_rect;
-
-                  wtext = (wchar_t *)g_utf8_to_ucs4 (para->text, para->length, nullptr, nullptr, nullptr);
-                  if (wtext == nullptr)
-                    {
-                      fprintf (stderr, _("%s: Unable to convert UTF-8 to UCS-4.\n"), g_get_prgname ());
-                    fail:
-                      g_free (wtext);
-                      g_free (wnewtext);
-                      g_free (newtext);
-                      exit (1);
-                    }
-                  len = g_utf8_strlen (para->text, para->length);
-                  /* the amount of characters that can be put on the line against CPI */
-                  col = (int)(page_layout->column_width / 72.0 * page_layout->cpi);
-                  if (len > col)
-                    {
-                      /* need to wrap them up */
-                      wnewtext = g_new (wchar_t, wcslen (wtext) + 1);
-                      para->clipped = true;
-                      if (wnewtext == nullptr)
-                        {
-                          fprintf (stderr, _("%s: Unable to allocate the memory.\n"), g_get_prgname ());
-                          goto fail;
-                        }
-                      for (i = 0; i < len; i++)
-                        {
-                          gssize w = wcwidth (wtext[i]);
-
-                          if (w >= 0)
-                            wwidth += w;
-                          if (wwidth > col)
-                            break;
-                          wnewtext[i] = wtext[i];
-                        }
-                      wnewtext[i] = 0L;
-
-                      newtext = g_ucs4_to_utf8 ((const gunichar *)wnewtext, i, nullptr, nullptr, nullptr);
-                      if (newtext == nullptr)
-                        {
-                          fprintf (stderr, _("%s: Unable to convert UCS-4 to UTF-8.\n"), g_get_prgname ());
-                          goto fail;
-                        }
-                      if (page_layout->do_use_markup)
-                          pango_layout_set_markup (para->layout, newtext, -1);
-                      else
-                          pango_layout_set_text (para->layout, newtext, -1);
-
-                      // Request not to get any hypens
-                      if (!page_layout->do_show_hyphens)
-                        layout_turn_off_hyphens(para->layout);
-
-                      pango_layout_get_extents (para->layout, &ink_rect, &logical_rect);
-                      paint_width = logical_rect.width / PANGO_SCALE;
-                      g_free (wnewtext);
-                      g_free (newtext);
-
-                      para->length = i;
-                      next = g_utf8_offset_to_pointer (para->text, para->length);
-                      wc = g_utf8_get_char (g_utf8_prev_char (next));
-                    }
-                  else
-                    {
-                      pango_layout_set_text (para->layout, para->text, para->length);
-                    }
-
-                  g_free (wtext);
-
-                  pango_layout_set_width (para->layout, -1);
-                }
-              else
-                {
-                  if (page_layout->do_use_markup)
-                      pango_layout_set_markup (para->layout, para->text, para->length);
-                  else
-                      pango_layout_set_text (para->layout, para->text, para->length);
-                  pango_layout_set_width (para->layout, paint_width * PANGO_SCALE);
-
-                  pango_layout_set_wrap (para->layout, opt_wrap);
-
-                  if (!page_layout->do_show_hyphens)
-                    layout_turn_off_hyphens(para->layout);
-
-                  if (opt_wrap == PANGO_WRAP_CHAR)
-                      para->wrapped = true;                    
-
-                  /* Should we support truncation as well? */
-                }
-                  
-              pango_layout_set_justify (para->layout, page_layout->do_justify);
-              pango_layout_set_alignment (para->layout,
-                                          page_layout->pango_dir == PANGO_DIRECTION_LTR
-                                          ? PANGO_ALIGN_LEFT : PANGO_ALIGN_RIGHT);
-
-              para->height = 0;
-
-              last_para = next;
-            
-              if (wc == '\f')
-                para->formfeed = 1;
-              else
-                para->formfeed = 0;
-
-              result = g_list_prepend (result, para);
-            }
-          if (!wc) /* incomplete character at end */
-            break;
-          p = next;
-        }
-    }
-
-  return g_list_reverse (result);
-}
-
-
-
-/* Split a list of paragraphs into a list of lines.
- */
-GList *
-split_paragraphs_into_lines(PageLayout *page_layout,
-                            GList         *paragraphs)
-{
-  GList *line_list = nullptr;
-  int max_height = 0;
-  /* Read the file */
-
-  /* Now split all the pagraphs into lines */
-  GList *par_list;
-
-  par_list = paragraphs;
-  while(par_list)
-    {
-      int para_num_lines, i;
-      LineLink *line_link;
-      Paragraph *para = (Paragraph*)par_list->data;
-
-      para_num_lines = pango_layout_get_line_count(para->layout);
-
-      for (i=0; i<para_num_lines; i++)
-        {
-          PangoRectangle logical_rect, ink_rect;
-          
-          line_link = g_new(LineLink, 1);
-          line_link->formfeed = 0;
-          line_link->wrapped = (para->wrapped && i < para_num_lines - 1) || (para->clipped);
-          line_link->pango_line = pango_layout_get_line(para->layout, i);
-          pango_layout_line_get_extents(line_link->pango_line,
-                                        &ink_rect, &logical_rect);
-          line_link->logical_rect = logical_rect;
-          if (para->formfeed && i == (para_num_lines - 1))
-              line_link->formfeed = 1;
-          line_link->ink_rect = ink_rect;
-          line_list = g_list_prepend(line_list, line_link);
-          if (logical_rect.height > max_height)
-              max_height = logical_rect.height;
-        }
-
-      par_list = par_list->next;
-    }
-  
-  /*
-   * not fixed for cairo backend: disable
-   *
-  if (page_layout->do_stretch_chars && page_layout->lpi > 0.0L)
-      page_layout->scale_y = 1.0 / page_layout->lpi * 72.0 * PANGO_SCALE / max_height;
-   */
-
-  return g_list_reverse(line_list);
-  
-}
-
-
-/*
- * Define PostScript document header information.
- */
-void
-postscript_dsc_comments(cairo_surface_t *surface, PageLayout *pl)
-{
-  char buf[CAIRO_COMMENT_MAX];
-  int x, y;
-
-  /*
-   * Title
-   */
-  snprintf(buf, CAIRO_COMMENT_MAX, "%%%%Title: %s", pl->title.c_str());
-  cairo_ps_surface_dsc_comment (surface, buf);
-
-  /*
-   * Orientation
-   */
-  if (pl->do_landscape)
-    {
-      cairo_ps_surface_dsc_comment (surface, "%%Orientation: Landscape");
-      x = (int)pl->page_height;
-      y = (int)pl->page_width;
+      fprintf(stderr, _("%1$s: The text does not fit on %2$d pages even with a font size of %3$d.\n"),
+              g_get_prgname (), fit_pages, MIN_FIT_FONT_SIZE);
     }
-  else
+  if (page_layout.column_width <= 0)
     {
-      cairo_ps_surface_dsc_comment (surface, "%%Orientation: Portrait");
-      x = (int)pl->page_width;
-      y = (int)pl->page_height;
+      fprintf(stderr, _("%s: No room for the text beside the line numbers.\n"), g_get_prgname ());
+      exit(1);
     }
 
-  /*
-   * Redefine BoundingBox to cover the whole paper. Cairo creates the entry
-   * based on the text only. This may affect further processing, such as with
-   * convert(1).
-   */
-  snprintf(buf, CAIRO_COMMENT_MAX, "%%%%BoundingBox: 0 0 %d %d", x, y);
-  cairo_ps_surface_dsc_comment (surface, buf);
-
-  /*
-   * Duplex
-   */
-  if (pl->do_duplex)
+  /* Only count the pages, without any output */
+  if (do_count_pages || estimate_pages_fraction > 0)
     {
-      cairo_ps_surface_dsc_comment(surface, "%%Requirements: duplex");
-      cairo_ps_surface_dsc_begin_setup(surface);
-
-      if (pl->do_tumble)
-        cairo_ps_surface_dsc_comment(surface, "%%IncludeFeature: *Duplex DuplexTumble");
-      else
-        cairo_ps_surface_dsc_comment(surface, "%%IncludeFeature: *Duplex DuplexNoTumble");
-    }
-  else
-    cairo_ps_surface_dsc_begin_setup(surface);
-
-  if (pl->paper_type == PAPER_TYPE_US_LEGAL)
-    cairo_ps_surface_dsc_comment (surface, "%%IncludeFeature: *PageSize Legal");
-  if (pl->paper_type == PAPER_TYPE_US_LETTER)
-    cairo_ps_surface_dsc_comment (surface, "%%IncludeFeature: *PageSize Letter");
-  if (pl->paper_type == PAPER_TYPE_A4)
-    cairo_ps_surface_dsc_comment (surface, "%%IncludeFeature: *PageSize A4");
-  if (pl->paper_type == PAPER_TYPE_A3)
-    cairo_ps_surface_dsc_comment (surface, "%%IncludeFeature: *PageSize A3");
-}
-
-
-int
-output_pages(cairo_surface_t *surface,
-             cairo_t       *cr,
-             GList         *pango_lines,
-             PageLayout *page_layout,
-             PangoContext  *pango_context)
-{
-  int pango_column_height = page_layout->column_height * PANGO_SCALE;
-  int height = 0;
-  int num_pages = -1; // This will be calculated in the measurement pass below
-  int title_height = 0;
-  GList *pango_lines_start = pango_lines;
-  dict_t document_info;
-
-  // Fill in the static document info 
-  build_document_info(page_layout, document_info);
-  document_info["num_pages"] = 0;
-
-  // Do twice, the first time only measure without shipping
-  for (int i=0; i<2; i++)
-    {
-      int page_idx = 1;
-      bool measure_only = i==0;
-      LineLink *prev_line_link = nullptr;
-      int column_idx = 0;
-      int column_y_pos = 0;
-
-      column_y_pos = 0;
-      document_info["page_idx"] = page_idx;
-
-      pango_lines = pango_lines_start;
-      start_page(surface, cr, page_layout, measure_only);
-    
-      if (page_layout->do_draw_header)
-        {
-          title_height = draw_page_header_line_to_page(cr, false, page_layout, pango_context, page_idx, num_pages, document_info, measure_only);
-          column_y_pos = title_height;
-        }
-      if (page_layout->do_draw_footer)
-          draw_page_header_line_to_page(cr, true, page_layout, pango_context, page_idx, num_pages, document_info, measure_only);
-
-      while(pango_lines)
-        {
-          LineLink *line_link = (LineLink*)pango_lines->data;
-          PangoLayoutLine *line = line_link->pango_line;
-          bool draw_wrap_character = page_layout->do_show_wrap && line_link->wrapped;
-          
-          /* Check if we need to move to next column */
-          if ((column_y_pos + line_link->logical_rect.height
-               >= pango_column_height) ||
-              (prev_line_link && prev_line_link->formfeed))
-            {
-              column_idx++;
-              column_y_pos = title_height;
-              if (column_idx == page_layout->num_columns)
-                {
-                  column_idx = 0;
-                  if (!measure_only)
-                    eject_page(cr);
-                  page_idx++;
-                  document_info["page_idx"] = page_idx;
-                  start_page(surface, cr, page_layout, measure_only);
-    
-                  if (page_layout->do_draw_header) {
-                    title_height = draw_page_header_line_to_page(cr, false, page_layout, pango_context, page_idx, num_pages, document_info, measure_only);
-                    column_y_pos = title_height;
-                  }
-                  if (page_layout->do_draw_footer) 
-                    draw_page_header_line_to_page(cr, true, page_layout, pango_context, page_idx, num_pages, document_info, measure_only);
-                }
-              else
-                {
-                  eject_column(cr,
-                               title_height/PANGO_SCALE,
-                               page_layout,
-                               column_idx,
-                               measure_only
-                               );
-                }
-            }
-          if (page_layout->lpi > 0.0L)
-            height = (int)(1.0 / page_layout->lpi * 72.0 * PANGO_SCALE);
-          else
-            height = line_link->logical_rect.height;
-          if (!measure_only)
-            draw_line_to_page(cr,
-                              column_idx,
-                              column_y_pos+height,
-                              page_layout,
-                              line,
-                              draw_wrap_character);
-          column_y_pos += height;
-          pango_lines = pango_lines->next;
-          prev_line_link = line_link;
-        }
-      if (!measure_only)
-        eject_page(cr);
-
-      if (measure_only)
-        {
-          num_pages = page_idx;
-          document_info["num_pages"] = num_pages;
-        }
+      double pages = count_pages(surface,
+                                 cr,
+                                 &page_layout,
+                                 pango_context,
+                                 do_count_pages ? 1.0 : estimate_pages_fraction);
+      printf("%d\n", (int)ceil(pages));
+      cairo_destroy (cr);
+      cairo_surface_destroy(surface);
+      return 0;
     }
-  return num_pages;
-}
 
-void eject_column(cairo_t *cr,
-                  double title_height,
-                  PageLayout *page_layout,
-                  int column_idx,
-                  bool measure_only)
-{
-  double x_pos, y_top, y_bot, total_gutter;
-
-#if 0
-  fprintf(stderr, "do_draw_separation_line column_idx = %d %d\n", page_layout->do_draw_separation_line, column_idx);
-#endif
-  if (!page_layout->do_draw_separation_line)
-    return;
-
-  if (page_layout->pango_dir == PANGO_DIRECTION_RTL)
-    column_idx = (page_layout->num_columns - column_idx);
-
-  if (column_idx == 1)
-    total_gutter = 1.0 * page_layout->gutter_width /2;
-  else
-    total_gutter = (column_idx - 0.5) * page_layout->gutter_width;
-      
-  x_pos = page_layout->left_margin
-        + page_layout->column_width * column_idx
-      + total_gutter;
+  if (output_format == FORMAT_POSTSCRIPT)
+    postscript_dsc_comments(surface, &page_layout);
 
-  y_top = page_layout->top_margin + page_layout->header_height + page_layout->header_sep / 2 + title_height;
-  y_bot = page_layout->page_height - page_layout->bottom_margin - page_layout->footer_height;
+  paragraphs = split_text_into_paragraphs(pango_context,
+                                          &page_layout,
+                                          page_layout.column_width, 
+                                          text);
 
-  if (!measure_only)
+  /* The first pages can only be written before the rest is laid out
+   * when the headers do not need the number of pages. */
+  if (num_first_pages > 0
+      && document_info_keys(&page_layout).count("num_pages"))
     {
-      cairo_move_to(cr,x_pos, y_top);
-      cairo_line_to(cr,x_pos, y_bot);
-      cairo_set_line_width(cr, 0.1);
-      cairo_stroke(cr);
+      fprintf(stderr, _("%s: --first-pages is not supported with {num_pages}, ignoring.\n"), g_get_prgname ());
+      num_first_pages = 0;
     }
-}
 
-void eject_page(cairo_t *cr)
-{
-  cairo_show_page(cr);
-}
+  cairo_scale(cr, page_layout.scale_x, page_layout.scale_y);
 
-void start_page(cairo_surface_t *surface,
-                cairo_t *cr,
-                PageLayout *page_layout,
-                bool measure_only)
-{
-  cairo_identity_matrix(cr);
+  if (num_first_pages == 0)
+    pango_lines = split_paragraphs_into_lines(&page_layout, paragraphs);
 
-  if (output_format == FORMAT_POSTSCRIPT)
+  if (do_verify_layout)
     {
-      char buf[CAIRO_COMMENT_MAX];
-      int x, y;
-
-      if (page_layout->do_landscape)
-        {
-          x = (int)page_layout->page_height;
-          y = (int)page_layout->page_width;
-        }
-      else
-        {
-          x = (int)page_layout->page_width;
-          y = (int)page_layout->page_height;
-        }
-      if (!measure_only)
-        {
-          cairo_ps_surface_dsc_begin_page_setup (surface);
-    
-          snprintf(buf, CAIRO_COMMENT_MAX, "%%%%PageBoundingBox: 0 0 %d %d", x, y);
-          cairo_ps_surface_dsc_comment (surface, buf);
-        }
+      bool ok = verify_layout(surface,
+                              cr,
+                              pango_lines,
+                              &page_layout,
+                              pango_context,
+                              surface_page_width,
+                              surface_page_height);
+      cairo_destroy (cr);
+      cairo_surface_destroy(surface);
+      return ok ? 0 : 1;
     }
 
-  if (page_layout->do_landscape)
-    {
-      if (output_format == FORMAT_POSTSCRIPT)
-        {
-          if (!measure_only)
-            cairo_ps_surface_dsc_comment (surface, "%%PageOrientation: Landscape");
-          cairo_translate(cr, 0, page_layout->page_width);
-          cairo_rotate(cr, -G_PI_2);
-        }
-    }
+  if (num_first_pages > 0)
+    num_pages = output_pages_first_fast(surface,
+                                        cr,
+                                        paragraphs,
+                                        &page_layout,
+                                        pango_context,
+                                        num_first_pages,
+                                        surface_page_width,
+                                        surface_page_height);
+  else if (num_shards > 1)
+    num_pages = output_pages_sharded(surface,
+                                     cr,
+                                     pango_lines,
+                                     &page_layout,
+                                     pango_context,
+                                     num_shards,
+                                     surface_page_width,
+                                     surface_page_height,
+                                     do_linearize ? &pdf_output : nullptr);
   else
-    {
-      if (output_format == FORMAT_POSTSCRIPT)
-        cairo_ps_surface_dsc_comment (surface, "%%PageOrientation: Portrait");
-    }
-}
-
-void
-draw_line_to_page(cairo_t *cr,
-                  int column_idx,
-                  int column_pos,
-                  PageLayout *page_layout,
-                  PangoLayoutLine *line,
-                  bool draw_wrap_character)
-{
-  /* Assume square aspect ratio for now */
-  double y_pos = page_layout->top_margin
-               + page_layout->header_sep
-               + column_pos / PANGO_SCALE;
-  double x_pos = page_layout->left_margin
-               + column_idx * (page_layout->column_width
-                               + page_layout->gutter_width);
-  PangoRectangle ink_rect, logical_rect;
-
-  /* Do RTL column layout for RTL direction */
-  if (page_layout->pango_dir == PANGO_DIRECTION_RTL)
-    {
-      x_pos = page_layout->left_margin
-        + (page_layout->num_columns-1-column_idx)
-        * (page_layout->column_width + page_layout->gutter_width);
-    }
-  
-  pango_layout_line_get_extents(line,
-                                &ink_rect,
-                                &logical_rect);
+    num_pages = output_pages(surface,
+                             cr,
+                             pango_lines,
+                             &page_layout,
+                             pango_context,
+                             first_page_idx) - first_page_idx + 1;
 
-  if (page_layout->pango_dir == PANGO_DIRECTION_RTL) {
-      x_pos += page_layout->column_width  - logical_rect.width / PANGO_SCALE;
-  }
-
-  cairo_move_to(cr, x_pos, y_pos);
-  pango_cairo_show_layout_line(cr, line);
+  cairo_destroy (cr);
+  cairo_surface_finish (surface);
+  cairo_surface_destroy(surface);
 
-  if (draw_wrap_character)
+  if (append_to)
+    append_pdf_update(append_to, pdf_output);
+  else if (do_linearize)
+    write_linearized_pdf(pdf_output);
+  if (watch_output)
     {
-      cairo_set_font_face(cr, paps_glyph_face);
-      cairo_set_font_size(cr, glyph_font_size);
-
-      if (page_layout->pango_dir == PANGO_DIRECTION_LTR)
-        {
-          cairo_move_to(cr, x_pos + page_layout->column_width, y_pos);
-          cairo_show_text(cr, "R");
-        }
-      else
+      bool ok = !ferror(output_fh);
+      ok = fclose(output_fh) == 0 && ok;
+      if (!ok || rename(output, watch_output) != 0)
         {
-          double left_margin = page_layout->left_margin
-            + (page_layout->num_columns-1-column_idx)
-            * (page_layout->column_width + page_layout->gutter_width);
-
-          cairo_move_to(cr, left_margin, y_pos); 
-          cairo_show_text(cr, "L");
+          fprintf(stderr, _("%s: Failed to write to %s!\n"), g_get_prgname (), watch_output);
+          unlink(output);
+          exit(1);
         }
     }
-}
-
-/*
- * Provide date string from current locale converted to UTF-8.
- */
-string
-get_date()
-{
-  time_t t = time(nullptr);
-  GIConv cvh = nullptr;
-  GString *inbuf;
-  char *ib, *ob, obuffer[BUFSIZE * 6], *bp;
-  gsize iblen, oblen;
-  static char *date_utf8 = nullptr;
-
-  if (date_utf8 == nullptr) {
-    char date[256];
-    t = time(nullptr);
-    strftime(date, sizeof(date), "%c", localtime(&t));
-
-    cvh = g_iconv_open("UTF-8", get_encoding());
-    if (cvh == (GIConv)-1) {
-      fprintf(stderr, _("%s: Invalid encoding: %s\n"), g_get_prgname(), get_encoding());
-      exit(1);
-    }
-
-    inbuf = g_string_new(nullptr);
-    ib = bp = date;
-    iblen = strlen(ib);
-    ob = bp = obuffer;
-    oblen = BUFSIZE * 6 - 1;
-
-    if (g_iconv(cvh, &ib, &iblen, &ob, &oblen) == (gsize)-1) {
-      fprintf(stderr, _("%1$s: Error while converting date string from '%2$s' to UTF-8.\n"),
-        g_get_prgname(), get_encoding());
-      /* Return the unconverted string. */
-      /*
-       * inbuf isn't used here, but a few memory is
-       * allocated by default. so it should be freed anyway.
-       */
-      (void) g_string_free(inbuf, true);
-      g_iconv_close(cvh);
-      return date;
-    }
-
-    obuffer[BUFSIZE * 6 - 1 - oblen] = 0;
-    g_string_append(inbuf, bp);
-
-    date_utf8 = g_string_free(inbuf, false);
-    g_iconv_close(cvh);
-  }
-
-  return date_utf8;
-}
-
-int
-draw_page_header_line_to_page(cairo_t         *cr,
-                              bool             is_footer,
-                              PageLayout   *page_layout,
-                              PangoContext    *ctx,
-                              int              page,
-                              int              num_pages,
-                              dict_t&          document_info,
-                              bool             measure_only)
-{
-  PangoLayout *layout = pango_layout_new(ctx);
-  PangoLayoutLine *line;
-  PangoRectangle ink_rect={0,0,0,0}, logical_rect = {0,0,0,0};
-  /* Assume square aspect ratio for now */
-  double x_pos, y_pos;
-  int height;
-  gdouble line_pos;
-
-  /* Reset gravity?? */
-
-  // Three lines:
-  //    1. Date
-  //    2. Filename (title)
-  //    3. Page
-  string header = format("<span font_desc=\"{}\">{}</span>\n"
-                  "<span font_desc=\"{}\">{}</span>\n"
-                  "<span font_desc=\"{}\">{}</span>",
-                  page_layout->header_font_desc,
-                  get_date().c_str(),
-                    page_layout->header_font_desc,
-                    page_layout->title.c_str(),
-                    page_layout->header_font_desc,
-                    page
-                    );
-
-  vector<string> header_parts = {"","",""};
-  if (is_footer)
-    {
-      if (page_layout->footer_left)
-        header_parts[0] = page_layout->footer_left;
-    
-      if (page_layout->footer_center)
-        header_parts[1] = page_layout->footer_center;
-      
-      if (page_layout->footer_right)
-        header_parts[2] = page_layout->footer_right;
-    }
-  else
+  if (map_fh)
+    fclose(map_fh);
+  if (page_index_fh)
     {
-      if (page_layout->header_left)
-        header_parts[0]=page_layout->header_left;
-      else
-        header_parts[0]=get_date();
-    
-      if (page_layout->header_center)
-        header_parts[1] = page_layout->header_center;
-      else
-        header_parts[1] = page_layout->filename;
-      
-      if (page_layout->header_right)
-        header_parts[2] = page_layout->header_right;
-      else
-        header_parts[2] = format("{}",page);
+      if (dsc_index.fh)
+        write_dsc_index(page_index_fh, dsc_index);
+      fclose(page_index_fh);
     }
+  g_option_context_free(ctxt);
 
-  for (auto& v : header_parts)
-    v = format_from_dict(v, document_info);
-
-  header = "";
-  for (auto& hp : header_parts)
-    header += format("<span font_desc=\"{}\">{}</span>\n",
-                     page_layout->header_font_desc,
-                     hp);
-
-  pango_layout_set_markup(layout, header.c_str(), -1);
-
-  /* The title is in the center */
-  line = pango_layout_get_line(layout, 0);
-  pango_layout_line_get_extents(line,
-                                &ink_rect,
-                                &logical_rect);
-  x_pos = page_layout->left_margin;
-
-  height = logical_rect.height / PANGO_SCALE /3.0;
-
-  /* The header is placed right after the margin */
-  if (is_footer)
-    {
-      y_pos = page_layout->page_height - page_layout->bottom_margin*0.5;
-      page_layout->footer_height = height;
-    }
-  else
-    {
-      y_pos = page_layout->top_margin + height;
-      page_layout->header_height = height;
-    }
-
-  cairo_move_to(cr, x_pos,y_pos);
-  if (!measure_only)
-    pango_cairo_show_layout_line(cr,line);
-
-  /* output a right edge of header/footer */
-  line = pango_layout_get_line(layout, 1);
-  pango_layout_line_get_extents(line,
-                                &ink_rect,
-                                &logical_rect);
-  /* pagenum_rect = logical_rect; */
-  x_pos = page_layout->left_margin + (page_layout->page_width-page_layout->left_margin-page_layout->right_margin)*0.5 - 0.5*logical_rect.width/PANGO_SCALE;
-  cairo_move_to(cr, x_pos,y_pos);
-  if (!measure_only)
-    pango_cairo_show_layout_line(cr,line);
-
-  /* output a "center" of header/footer */
-  line = pango_layout_get_line(layout, 2);
-  pango_layout_line_get_extents(line,
-                                &ink_rect,
-                                &logical_rect);
-  x_pos = page_layout->page_width - page_layout->right_margin - (logical_rect.width / PANGO_SCALE );
-
-  //  x_pos = page_layout->page_width - page_layout->right_margin -
-  //      ((logical_rect.width + pagenum_rect.width) / PANGO_SCALE + page_layout->gutter_width);
-  cairo_move_to(cr, x_pos,y_pos);
-  if(!measure_only)
-    pango_cairo_show_layout_line(cr,line);
-
-  g_object_unref(layout);
-
-  /* header separator */
-  if (!measure_only && page_layout->do_draw_separation_line)
-    {
-      if (is_footer)
-        line_pos = page_layout->page_height - page_layout->bottom_margin * 1.1;
-      else
-        line_pos = page_layout->top_margin + page_layout->header_height + page_layout->header_sep;
-      line_pos += logical_rect.height/2.0/PANGO_SCALE;
-      cairo_move_to(cr, page_layout->left_margin, line_pos);
-      cairo_line_to(cr,page_layout->page_width - page_layout->right_margin, line_pos);
-      cairo_set_line_width(cr,0.1); // TBD
-      cairo_stroke(cr);
-    }
-
-  return logical_rect.height;
-}
-
-// Build the document info hash table that may be used in the headers
-// and footers
-static void
-build_document_info(PageLayout* page_layout,
-                    dict_t& document_info)
-{
-  document_info["filename"] = page_layout->filename;
-  document_info["path"] = page_layout->filename_path;
-
-  GStatBuf stat_buf;
-  g_stat(page_layout->filename_path.c_str(), &stat_buf);
-  document_info["mtime"] = (time_t)stat_buf.st_mtime;
-  document_info["now"] = time(nullptr);
+  /* Unless the first pages were written early, they are only complete
+   * once the whole output is. */
+  if (!first_page_time)
+    first_page_time = g_get_monotonic_time();
+  if (do_stats)
+    fprintf(stderr, _("%1$s: %2$d pages, the first written after %3$.1f ms, all after %4$.1f ms\n"),
+            g_get_prgname (), num_pages,
+            (first_page_time - start_time) / 1000.0,
+            (g_get_monotonic_time() - start_time) / 1000.0);
 
-  page_layout->document_info["num_pages"] = page_layout->num_pages;
-}
-
-string fn_basename(const string& filename)
-{
-  return basename((char*)filename.c_str());
+  return 0;
 }
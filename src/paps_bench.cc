@@ -0,0 +1,309 @@
+/*
+ * paps_bench.cc: Micro benchmarks of the internal functions of paps.
+ *
+ * Copyright (C) 2002, 2005, 2022 Dov Grobgeld <dov.grobgeld@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "paps_core.h"
+#include <cairo/cairo-pdf.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <locale.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <string>
+#include <functional>
+
+using namespace std;
+
+// Every benchmark is repeated until it has run for at least this long
+#define BENCH_MIN_TIME_USEC 500000
+
+/* Run fn repeatedly and print the average time of a run, and the
+ * throughput when the amount of bytes that a run handles is given.
+ * Only fn is timed, setup and teardown are run around every run of it.
+ */
+static void
+bench(const char *name,
+      size_t bytes,
+      const function<void()>& fn,
+      const function<void()>& setup = nullptr,
+      const function<void()>& teardown = nullptr)
+{
+  gint64 total = 0;
+  int iterations = 0;
+
+  while (total < BENCH_MIN_TIME_USEC || iterations < 3)
+    {
+      if (setup)
+        setup();
+      gint64 start = g_get_monotonic_time();
+      fn();
+      total += g_get_monotonic_time() - start;
+      if (teardown)
+        teardown();
+      iterations++;
+    }
+
+  double usec = (double)total / iterations;
+  if (bytes)
+    printf("%-36s %12.3f ms %10.1f MB/s\n", name, usec / 1000, bytes / usec);
+  else
+    printf("%-36s %12.3f us\n", name, usec);
+}
+
+/* Make up a text of roughly size bytes, with lines of varying length,
+ * some of which need to be wrapped. */
+static string
+make_text(size_t size)
+{
+  static const char *words[] = {
+    "lorem", "ipsum", "dolor", "sit", "amet,", "consectetur", "adipiscing",
+    "elit,", "sed", "do", "eiusmod", "tempor", "incididunt", "ut", "labore",
+    "et", "dolore", "magna", "aliqua.", "int", "main(void)", "{", "}", "=",
+    "return", "0;", "0x7fff", "for", "(i=0;", "i<n;", "i++)"
+  };
+  const int num_words = sizeof(words) / sizeof(words[0]);
+  string text;
+  unsigned int seed = 1;
+
+  while (text.size() < size)
+    {
+      seed = seed * 1103515245 + 12345;
+      int num_line_words = (seed >> 16) % 24;
+      for (int i=0; i<num_line_words; i++)
+        {
+          seed = seed * 1103515245 + 12345;
+          if (i)
+            text += ' ';
+          text += words[(seed >> 16) % num_words];
+        }
+      text += '\n';
+    }
+  return text;
+}
+
+static GList *
+split_text(PangoContext *pango_context, PageLayout *page_layout, const string& text)
+{
+  return split_text_into_paragraphs(pango_context,
+                                    page_layout,
+                                    page_layout->column_width,
+                                    text.c_str());
+}
+
+int main(int argc, char *argv[])
+{
+  setlocale(LC_ALL, "");
+  g_set_prgname("paps_bench");
+
+  string text;
+  if (argc > 1)
+    {
+      gchar *contents;
+      gsize length;
+      GError *error = nullptr;
+      if (!g_file_get_contents(argv[1], &contents, &length, &error))
+        {
+          fprintf(stderr, _("%s: Failed to read %s: %s\n"), g_get_prgname (), argv[1], error->message);
+          exit(1);
+        }
+      text = string(contents, length);
+      g_free(contents);
+    }
+  else
+    text = make_text(1 << 20);
+  if (text.empty() || text.back() != '\n')
+    text += '\n';
+
+  /* The default layout of a portrait A4 page */
+  PageLayout page_layout {};
+  page_layout.page_width = paper_sizes[PAPER_TYPE_A4].width;
+  page_layout.page_height = paper_sizes[PAPER_TYPE_A4].height;
+  page_layout.paper_type = PAPER_TYPE_A4;
+  page_layout.num_columns = 1;
+  page_layout.left_margin = MARGIN_LEFT;
+  page_layout.right_margin = MARGIN_RIGHT;
+  page_layout.top_margin = MARGIN_TOP;
+  page_layout.bottom_margin = MARGIN_BOTTOM;
+  page_layout.header_ypos = page_layout.top_margin;
+  page_layout.gutter_width = 40;
+  page_layout.scale_x = page_layout.scale_y = 1.0;
+  page_layout.column_height = (int)page_layout.page_height
+    - page_layout.top_margin - page_layout.bottom_margin;
+  page_layout.column_width = (int)page_layout.page_width
+    - page_layout.left_margin - page_layout.right_margin;
+  page_layout.do_draw_header = true;
+  page_layout.do_draw_footer = true;
+  page_layout.first_line_no = 1;
+  page_layout.pango_dir = PANGO_DIRECTION_LTR;
+  page_layout.filename_path = argc > 1 ? argv[1] : "paps_bench.cc";
+  page_layout.filename = fn_basename(page_layout.filename_path);
+  page_layout.title = page_layout.filename;
+  page_layout.header_font_desc = MAKE_FONT_NAME (HEADER_FONT_FAMILY, HEADER_FONT_SCALE);
+  compute_page_geometry(&page_layout);
+
+  cairo_surface_t *surface = cairo_pdf_surface_create_for_stream(&paps_cairo_write_func,
+                                                                 nullptr,
+                                                                 page_layout.page_width,
+                                                                 page_layout.page_height);
+  cairo_t *cr = cairo_create(surface);
+  PangoContext *pango_context = create_pango_context(cr, page_layout.pango_dir);
+  PangoFontDescription *font_description = pango_font_description_from_string(MAKE_FONT_NAME (DEFAULT_FONT_FAMILY, DEFAULT_FONT_SIZE));
+  pango_context_set_font_description(pango_context, font_description);
+
+  page_layout.text = text.c_str();
+  page_layout.text_length = text.size();
+
+  printf("%zu bytes of input\n", text.size());
+
+  dict_t document_info;
+  build_document_info(&page_layout, document_info);
+  document_info["filename"] = page_layout.filename;
+  document_info["mtime"] = time(nullptr);
+  document_info["page_idx"] = 12;
+  document_info["num_pages"] = 345;
+  const char *templ = "{filename} {mtime:%Y-%m-%d %H:%M} Page {page_idx}/{num_pages}";
+  bench("format_from_dict", 0, [&] {
+      format_from_dict(templ, document_info);
+    });
+  CompiledFormat compiled_format(templ);
+  bench("CompiledFormat::format", 0, [&] {
+      compiled_format.format(document_info);
+    });
+
+  // The text is read from a memfd, as the input of --out-dir is
+  int text_fd = memfd_create("paps-bench", MFD_CLOEXEC);
+  if (text_fd < 0 || write(text_fd, text.data(), text.size()) != (ssize_t)text.size())
+    {
+      fprintf(stderr, _("%s: Failed to create the input file: %s\n"), g_get_prgname (), strerror(errno));
+      exit(1);
+    }
+  auto open_text = [&]() {
+    lseek(text_fd, 0, SEEK_SET);
+    return fdopen(dup(text_fd), "r");
+  };
+  bench("read_file", text.size(), [&] {
+      g_free(read_file(open_text(), (gchar*)"UTF-8"));
+    });
+  // What reading UTF-8 cost before it was passed through: an identity
+  // conversion with iconv, against the validation that replaced it
+  bench("UTF-8 to UTF-8 iconv", text.size(), [&] {
+      g_free(g_convert(text.data(), text.size(), "UTF-8", "UTF-8", nullptr, nullptr, nullptr));
+    });
+  bench("utf8_valid_prefix", text.size(), [&] {
+      volatile size_t result = utf8_valid_prefix(text.data(), text.size());
+      (void)result;
+    });
+  bench("read_file with iconv", text.size(), [&] {
+      g_free(read_file(open_text(), (gchar*)"ISO-8859-1"));
+    });
+  close(text_fd);
+
+  // The startup of fontconfig, which loads the configuration and the
+  // cache of the system fonts, against a configuration of only the file
+  // of the default font, as with --font-file
+  bench("fontconfig with the system fonts", 0, [&] {
+      FcConfigDestroy(FcInitLoadConfigAndFonts());
+    });
+  FcChar8 *font_path = nullptr;
+  FcPattern *font_pattern = FcNameParse((const FcChar8*)DEFAULT_FONT_FAMILY);
+  FcConfigSubstitute(nullptr, font_pattern, FcMatchPattern);
+  FcDefaultSubstitute(font_pattern);
+  FcResult font_result;
+  FcPattern *font_match = FcFontMatch(nullptr, font_pattern, &font_result);
+  if (font_match && FcPatternGetString(font_match, FC_FILE, 0, &font_path) == FcResultMatch)
+    bench("fontconfig with a font file", 0, [&] {
+        FcConfig *config = FcConfigCreate();
+        FcConfigAppFontAddFile(config, font_path);
+        FcConfigDestroy(config);
+      });
+  if (font_match)
+    FcPatternDestroy(font_match);
+  FcPatternDestroy(font_pattern);
+
+  // The paragraph boundaries are found the way that
+  // split_text_into_paragraphs() does it, without creating the layouts.
+  bench("paragraph boundary scan", text.size(), [&] {
+      int num_paragraphs = 0;
+      for (const char *p = text.c_str(); *p; p = g_utf8_next_char(p))
+        {
+          gunichar wc = g_utf8_get_char(p);
+          if (wc == '\r' || wc == '\n' || wc == '\f')
+            num_paragraphs++;
+        }
+      volatile int result = num_paragraphs;
+      (void)result;
+    });
+
+  // A layout of a typical line, with the hyphens turned off
+  string line = text.substr(0, text.find('\n'));
+  bench("layout creation, no hyphens", 0, [&] {
+      PangoLayout *layout = pango_layout_new(pango_context);
+      pango_layout_set_text(layout, line.c_str(), line.size());
+      pango_layout_set_width(layout, page_layout.column_width * PANGO_SCALE);
+      layout_turn_off_hyphens(layout);
+      g_object_unref(layout);
+    });
+
+  GList *paragraphs = nullptr, *pango_lines = nullptr;
+  bench("split_text_into_paragraphs", text.size(), [&] {
+      paragraphs = split_text(pango_context, &page_layout, text);
+    }, nullptr, [&] {
+      free_paragraphs(paragraphs);
+    });
+
+  // The layouts keep their lines, so they are created again for every run
+  bench("split_paragraphs_into_lines", text.size(), [&] {
+      pango_lines = split_paragraphs_into_lines(&page_layout, paragraphs);
+    }, [&] {
+      paragraphs = split_text(pango_context, &page_layout, text);
+    }, [&] {
+      g_list_free_full(pango_lines, g_free);
+      free_paragraphs(paragraphs);
+    });
+
+  int page_idx = 0;
+  bench("header and footer of a page", 0, [&] {
+      page_idx++;
+      document_info["page_idx"] = page_idx;
+      draw_page_header_line_to_page(cr, false, &page_layout, pango_context, page_idx, 345, document_info, false);
+      draw_page_header_line_to_page(cr, true, &page_layout, pango_context, page_idx, 345, document_info, false);
+      cairo_show_page(cr);
+    });
+
+  // cairo writes its output in small pieces
+  FILE *null_fh = fopen("/dev/null", "wb");
+  string chunk(1024, 'x');
+  const size_t write_size = 64 << 20;
+  bench("paps_cairo_write_func", write_size, [&] {
+      for (size_t i=0; i<write_size; i+= chunk.size())
+        paps_cairo_write_func(null_fh, (const unsigned char*)chunk.data(), chunk.size());
+    });
+  fclose(null_fh);
+
+  pango_font_description_free(font_description);
+  g_object_unref(pango_context);
+  cairo_destroy(cr);
+  cairo_surface_destroy(surface);
+
+  return 0;
+}
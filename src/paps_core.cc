@@ -0,0 +1,2975 @@
+/*
+ * paps_core.cc: The rendering core of paps, the layout of the text on
+ * pages and the drawing of them.
+ *
+ * Copyright (C) 2002, 2005, 2022 Dov Grobgeld <dov.grobgeld@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "paps_core.h"
+#include <glib/gstdio.h>
+#include <pango/pangoft2.h>
+#include <cairo/cairo-ps.h>
+#include <cairo/cairo-pdf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <map>
+#include <set>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <libgen.h>
+#include <langinfo.h>
+#include <string>
+#include <fmt/core.h>
+#include "pdf_tools.h"
+#include <vector>
+#include <thread>
+#include <stdexcept>
+
+using namespace std;
+using namespace fmt;
+
+#ifndef _XOPEN_SOURCE
+#define _XOPEN_SOURCE /* for wcwidth */
+// int wcwidth(wchar_t c);
+#endif
+#include <wchar.h>
+
+#define BUFSIZE 1024
+#define READ_BLOCK_SIZE (1 << 20)
+#define ESTIMATE_BLOCK_SIZE (16 * 1024) // The size of the blocks of text that --estimate-pages lays out
+#define ANSI_MAX_PARAM 65535 // The largest value of an SGR parameter
+
+/*
+ * Cairo sets limit on the comment line for cairo_ps_surface_dsc_comment() to
+ * 255 characters, including the initial percent characters.
+ */
+#define	CAIRO_COMMENT_MAX       255
+
+const paper_size_t paper_sizes[] = {
+    { 595.28, 841.89}, /* A4 */
+    { 612, 792},       /* US letter */
+    { 612, 1008},      /* US legal */
+    { 842, 1190}       /* A3 */
+};
+
+// The layouts of the parts of the header and the footer, left to right,
+// and the markup that they were shaped from. They are kept with the
+// pango context of the document, so that the parts that are the same on
+// every page are formatted and shaped once per document.
+struct HeaderLayouts {
+  PageLayout *page_layout;
+  PangoLayout *parts[6];
+  string markup[6];
+};
+
+/* The position of an input line on the pages, for --map */
+struct LineMapEntry {
+  int line_no;
+  int page_idx;
+  int column_idx;
+  double y_pos;          // Baseline of the first output line
+  int continuations;     // Number of further output lines
+};
+
+/* A range of pages that is rendered into a PDF of its own */
+struct PdfShard {
+  PageLayout page_layout;
+  PangoFontDescription *font_description;
+  string text;           // Source text of the paragraphs of the shard
+  int skip_lines;        // Leading lines that belong to the previous shard
+  int num_lines;
+  int first_page_idx;
+  int num_pages;         // Number of pages in the whole document
+  double surface_page_width;
+  double surface_page_height;
+  string pdf;            // The rendered shard
+};
+
+static void   read_all                     (int              fd,
+                                            GString         *inbuf);
+static void   fix_invalid_utf8             (GString         *inbuf);
+static void   write_line_map_entry         (FILE            *map_fh,
+                                            const LineMapEntry& entry);
+static void   render_pdf_shard             (PdfShard        *shard);
+static GList *layout_first_pages           (cairo_surface_t *surface,
+                                            cairo_t         *cr,
+                                            GList           *paragraphs,
+                                            PageLayout      *page_layout,
+                                            PangoContext    *pango_context,
+                                            int              num_pages,
+                                            vector<GList*>  *page_starts);
+static void   init_pdf_shard               (PdfShard        *shard,
+                                            GList           *first,
+                                            GList           *end);
+static GList *split_pdf_shard_lines        (PdfShard        *shard,
+                                            PangoContext    *pango_context,
+                                            GList          **paragraphs);
+static string compare_line_links           (LineLink        *ref,
+                                            const char      *ref_base,
+                                            LineLink        *other,
+                                            const char      *other_base);
+static void   eject_column                 (cairo_t         *cr,
+                                            int              title_height,
+                                            PageLayout   *page_layout,
+                                            int              column_idx,
+                                            bool             measure_only);
+static void   eject_page                   (cairo_t         *cr);
+static void   start_page                   (cairo_surface_t *surface,
+                                            cairo_t         *cr, 
+                                            PageLayout   *page_layout,
+                                            bool            measure_only);
+static void   draw_line_to_page            (cairo_t         *cr,
+                                            int              column_idx,
+                                            int              column_pos,
+                                            PageLayout   *page_layout,
+                                            PangoLayoutLine *line,
+                                            bool         draw_wrap_character,
+                                            int              line_no);
+static void   draw_line_number             (cairo_t         *cr,
+                                            PangoContext    *ctx,
+                                            int              line_no,
+                                            double           x_end,
+                                            double           y_pos);
+static cairo_pattern_t **get_header_form   (cairo_t         *cr,
+                                            bool             is_footer);
+static HeaderLayouts *get_header_layouts   (PangoContext    *ctx,
+                                            PageLayout      *page_layout);
+static void   set_header_part_markup       (PangoContext    *ctx,
+                                            PageLayout      *page_layout,
+                                            dict_t&          document_info,
+                                            HeaderLayouts   *layouts,
+                                            int              part);
+static string header_template              (PageLayout      *page_layout,
+                                            bool             is_footer,
+                                            int              part);
+static void   compile_header_formats       (PageLayout      *page_layout);
+static string get_date                     ();
+
+FILE *output_fh;
+FILE *map_fh = nullptr;
+gint64 first_page_time = 0;
+paper_type_t paper_type = PAPER_TYPE_A4;
+output_format_t output_format = FORMAT_POSTSCRIPT;
+PangoGravity gravity = PANGO_GRAVITY_AUTO;
+PangoGravityHint gravity_hint = PANGO_GRAVITY_HINT_NATURAL;
+PangoWrapMode opt_wrap = PANGO_WRAP_WORD_CHAR;
+invalid_utf8_t invalid_utf8 = INVALID_UTF8_REJECT;
+FcConfig *font_file_config = nullptr;
+cairo_font_face_t *paps_glyph_face = NULL;
+double glyph_font_size = -1;
+vector<Highlight> highlights;
+
+/* Render function for paps glyphs */
+cairo_status_t
+paps_render_glyph(cairo_scaled_font_t *scaled_font G_GNUC_UNUSED,
+                  unsigned long glyph,
+                  cairo_t *cr,
+                  cairo_text_extents_t *extents)
+{
+  char ch = (unsigned char)glyph;
+
+  if (ch == 'R' || ch == 'L')
+  {
+    // A newline sign that I created with MetaPost
+    cairo_save(cr);
+    cairo_scale(cr,0.005,-0.005); // TBD - figure out the scaling.
+    if (ch == 'L')
+    {
+      cairo_scale(cr,-1,1);
+      // cairo_translate(cr,-120,0);  // Keep glyph protruding to the right.
+    }
+    cairo_translate(cr, 20,-50);
+    cairo_move_to(cr, 0, 175);
+    cairo_curve_to(cr, 25.69278, 175, 53.912, 177.59557, 71.25053, 158.75053);
+    cairo_curve_to(cr, 103.52599, 123.67075, 64.54437, 77.19373, 34.99985, 34.99985);
+    cairo_set_line_width(cr, 25);
+    cairo_stroke(cr);
+
+    cairo_move_to(cr,0,0);
+    cairo_line_to(cr,75,0);
+    cairo_line_to(cr,0,75);
+    cairo_close_path(cr);
+    cairo_fill(cr);
+    cairo_restore(cr);
+  }
+  return CAIRO_STATUS_SUCCESS;
+}
+
+bool
+_paps_arg_paper_cb(const char *option_name,
+                   const char *value,
+                   gpointer    data)
+{
+  bool retval = true;
+  
+  if (value && *value)
+    {
+      if (g_ascii_strcasecmp(value, "legal") == 0)
+        paper_type = PAPER_TYPE_US_LEGAL;
+      else if (g_ascii_strcasecmp(value, "letter") == 0)
+        paper_type = PAPER_TYPE_US_LETTER;
+      else if (g_ascii_strcasecmp(value, "a4") == 0)
+        paper_type = PAPER_TYPE_A4;
+      else if (g_ascii_strcasecmp(value, "a3") == 0)
+        paper_type = PAPER_TYPE_A3;
+      else {
+        retval = false;
+        fprintf(stderr, _("Unknown page size name: %s.\n"), value);
+      }
+    }
+  else
+    {
+      fprintf(stderr, _("You must specify page size.\n"));
+      retval = false;
+    }
+  
+  return retval;
+}
+
+/*
+ * Return codeset name of the environment's locale. Use UTF8 by default
+ */
+char*
+get_encoding(void)
+{
+  static char *encoding = nullptr;
+
+  if (encoding == nullptr)
+    encoding = nl_langinfo(CODESET);
+
+  return encoding;
+}
+
+// Write cairo output to the FILE given as closure. Output with a null
+// closure is discarded.
+cairo_status_t paps_cairo_write_func(void *closure,
+                                            const unsigned char *data,
+                                            unsigned int length)
+{
+  if (closure)
+    fwrite(data,length,1,(FILE*)closure);
+  return CAIRO_STATUS_SUCCESS;
+}
+
+// The longest DSC comment that is looked for at the start of the lines
+#define DSC_HEAD_LEN 13
+
+// Record the DSC comment that the current line starts with, if any
+static void
+dsc_index_line(DscIndex *index)
+{
+  const string& head = index->line_head;
+  if (head.compare(0, 7, "%%Page:") == 0)
+    index->pages.push_back(index->line_offset);
+  else if (head.compare(0, 11, "%%EndProlog") == 0)
+    index->end_prolog = index->line_offset;
+  else if (head.compare(0, 12, "%%BeginSetup") == 0)
+    index->begin_setup = index->line_offset;
+  else if (head.compare(0, 9, "%%Trailer") == 0)
+    index->trailer = index->line_offset;
+}
+
+// Write cairo output to the file of the DscIndex given as closure, and
+// index the DSC comments in it. Only the starts of the lines, that
+// may be split over the writes, are looked at.
+cairo_status_t paps_cairo_dsc_index_write_func(void *closure,
+                                                      const unsigned char *data,
+                                                      unsigned int length)
+{
+  DscIndex *index = (DscIndex*)closure;
+  const char *p = (const char*)data;
+  const char *end = p + length;
+
+  if (index->fh)
+    fwrite(data,length,1,index->fh);
+  while (p < end)
+    {
+      const char *nl = (const char*)memchr(p, '\n', end - p);
+      const char *line_end = nl ? nl : end;
+      size_t head_len = index->line_head.size();
+      if (head_len < DSC_HEAD_LEN)
+        {
+          index->line_head.append(p, MIN((size_t)(line_end - p), DSC_HEAD_LEN - head_len));
+          if (index->line_head.size() == DSC_HEAD_LEN || nl)
+            dsc_index_line(index);
+        }
+      if (!nl)
+        break;
+      p = nl + 1;
+      index->line_offset = index->offset + (p - (const char*)data);
+      index->line_head.clear();
+    }
+  index->offset += length;
+
+  return CAIRO_STATUS_SUCCESS;
+}
+
+// Collect cairo output in the string given as closure
+cairo_status_t paps_cairo_string_write_func(void *closure,
+                                                   const unsigned char *data,
+                                                   unsigned int length)
+{
+  ((string*)closure)->append((const char*)data, length);
+  return CAIRO_STATUS_SUCCESS;
+}
+
+/* Add a font file to the fontconfig configuration of the font files.
+ * The first font file creates it, without the configuration and the
+ * fonts of the system unless with_system_fonts is set. Returns the
+ * family of the font.
+ */
+string
+add_font_file(const char *font_file, bool with_system_fonts)
+{
+  int count;
+  FcChar8 *family;
+
+  if (!font_file_config)
+    font_file_config = with_system_fonts ? FcInitLoadConfigAndFonts() : FcConfigCreate();
+
+  FcPattern *pattern = FcFreeTypeQuery((const FcChar8*)font_file, 0, nullptr, &count);
+  if (!pattern
+      || FcPatternGetString(pattern, FC_FAMILY, 0, &family) != FcResultMatch
+      || !FcConfigAppFontAddFile(font_file_config, (const FcChar8*)font_file))
+    {
+      fprintf(stderr, _("%1$s: Failed to load the font file %2$s.\n"), g_get_prgname (), font_file);
+      exit(1);
+    }
+  string result = (const char*)family;
+  FcPatternDestroy(pattern);
+
+  return result;
+}
+
+/* Font maps may not be shared between threads, so every thread has its
+ * own font map of the font files. */
+struct FontFileMap {
+  PangoFontMap *font_map = nullptr;
+  ~FontFileMap()
+  {
+    if (font_map)
+      g_object_unref(font_map);
+  }
+};
+
+/* The font map of the calling thread. With font files it only has their
+ * fonts, and otherwise it is the default one, of the system fonts.
+ */
+PangoFontMap *
+get_font_map()
+{
+  static thread_local FontFileMap font_file_map;
+
+  if (!font_file_config)
+    return pango_cairo_font_map_get_default();
+
+  if (!font_file_map.font_map)
+    {
+      font_file_map.font_map = pango_cairo_font_map_new_for_font_type(CAIRO_FONT_TYPE_FT);
+      pango_fc_font_map_set_config(PANGO_FC_FONT_MAP(font_file_map.font_map), font_file_config);
+    }
+  return font_file_map.font_map;
+}
+
+/* Create a pango context for drawing on cr, set up according to the
+ * command line options.
+ */
+PangoContext *
+create_pango_context(cairo_t *cr,
+                     PangoDirection pango_dir)
+{
+  PangoContext *pango_context = pango_font_map_create_context(get_font_map());
+  pango_cairo_update_context(cr, pango_context);
+  pango_cairo_context_set_resolution(pango_context, 72.0); /* Native postscript resolution */
+
+  pango_context_set_base_dir (pango_context, pango_dir);
+  pango_context_set_language (pango_context, pango_language_get_default ());
+  pango_context_set_base_gravity (pango_context, gravity);
+  pango_context_set_gravity_hint (pango_context, gravity_hint);
+
+  return pango_context;
+}
+
+
+/* Read an entire file into a string
+ */
+char *
+read_file (FILE   *file,
+           gchar  *encoding)
+{
+  GString *inbuf;
+  char *text;
+  char buffer[BUFSIZE];
+  GIConv cvh = nullptr;
+  gsize inc_seq_bytes = 0;
+
+  /* UTF-8 input is read as is and only validated */
+  if (encoding == nullptr
+      || g_ascii_strcasecmp(encoding, "UTF-8") == 0
+      || g_ascii_strcasecmp(encoding, "UTF8") == 0)
+    {
+      inbuf = g_string_new (nullptr);
+      read_all(fileno(file), inbuf);
+      fclose (file);
+
+      fix_invalid_utf8(inbuf);
+      if (inbuf->len && inbuf->str[inbuf->len-1] != '\n')
+        g_string_append(inbuf, "\n");
+      return g_string_free (inbuf, false);
+    }
+
+  if (encoding != nullptr)
+    {
+      cvh = g_iconv_open ("UTF-8", encoding);
+      if (cvh == (GIConv)-1)
+        {
+          fprintf(stderr, _("%s: Invalid encoding: %s\n"), g_get_prgname (), encoding);
+          exit(1);
+        }
+    }
+
+  inbuf = g_string_new (nullptr);
+  while (1)
+    {
+      char *ib, *ob, obuffer[BUFSIZE * 6], *bp;
+      gsize iblen, oblen;
+
+      bp = fgets (buffer+inc_seq_bytes, BUFSIZE-inc_seq_bytes-1, file);
+      if (inc_seq_bytes)
+        inc_seq_bytes = 0;
+
+      if (ferror (file))
+        {
+          fprintf(stderr, _("%s: Error reading file.\n"), g_get_prgname ());
+          (void) g_string_free (inbuf, true);
+          exit(1);
+        }
+      else if (bp == nullptr)
+        break;
+
+      if (cvh != nullptr)
+        {
+          ib = buffer;
+          iblen = strlen (ib);
+          ob = bp = obuffer;
+          oblen = BUFSIZE * 6 - 1;
+          if (g_iconv (cvh, &ib, &iblen, &ob, &oblen) == (gsize)-1)
+            {
+              /*
+               * EINVAL - incomplete sequence at the end of the buffer. Move the
+               * incomplete sequence bytes to the beginning of the buffer for
+               * the next round of conversion.
+               */
+              if (errno == EINVAL)
+                {
+                  inc_seq_bytes = iblen;
+                  memmove (buffer, ib, inc_seq_bytes);
+                }
+              else
+                {
+                  fprintf (stderr, _("%1$s: Error while converting input from '%2$s' to UTF-8.\n"),
+                    g_get_prgname(), encoding);
+                  exit(1);
+                }
+             }
+          obuffer[BUFSIZE * 6 - 1 - oblen] = 0;
+        }
+      g_string_append (inbuf, bp);
+    }
+
+  fclose (file);
+
+  /* Add a trailing new line if it is missing */
+  if (inbuf->len && inbuf->str[inbuf->len-1] != '\n')
+    g_string_append(inbuf, "\n");
+
+  text = g_string_free (inbuf, false);
+
+  if (encoding != nullptr && cvh != nullptr)
+    g_iconv_close(cvh);
+
+  return text;
+}
+
+/* Read all of fd into inbuf, in large blocks straight into the
+ * buffer, which is allocated at once for a regular file. The text is
+ * not copied after that, so the paragraphs can point into it. Nothing
+ * may have been read from the file through stdio before. The input is
+ * always given as a file descriptor, also that of --out-dir, which is
+ * a memfd, so that it is never read through a stdio buffer.
+ */
+void
+read_all(int fd, GString *inbuf)
+{
+  size_t block = READ_BLOCK_SIZE;
+  struct stat st;
+
+  if (fstat(fd, &st) == 0)
+    {
+      /* The size is known, so it is read at once, and the read of
+       * one more byte finds the end. */
+      if (S_ISREG(st.st_mode) && st.st_size > 0)
+        block = st.st_size + 1;
+#ifdef F_SETPIPE_SZ
+      /* A larger pipe lets the writer get further ahead of us, and
+       * every read get more. Failing to grow it is harmless. */
+      else if (S_ISFIFO(st.st_mode))
+        (void) fcntl(fd, F_SETPIPE_SZ, READ_BLOCK_SIZE);
+#endif
+    }
+
+  while (true)
+    {
+      size_t len = inbuf->len;
+      g_string_set_size(inbuf, len + block);
+      ssize_t n = read(fd, inbuf->str + len, block);
+      g_string_set_size(inbuf, len + MAX(n, 0));
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n < 0)
+        {
+          fprintf(stderr, _("%s: Error reading file.\n"), g_get_prgname ());
+          exit(1);
+        }
+      if (n == 0)
+        break;
+
+      /* Fill up what is allocated before the buffer is grown, by
+       * doubling it. */
+      if ((size_t)n < block)
+        block -= n;
+      else
+        block = MAX(inbuf->len, (size_t)READ_BLOCK_SIZE);
+    }
+}
+
+/* Return the length of the longest valid UTF-8 prefix of text. ASCII,
+ * which is most of any input, is skipped a word at a time.
+ */
+size_t
+utf8_valid_prefix(const char *text, size_t length)
+{
+  const unsigned char *p = (const unsigned char*)text;
+  const unsigned char *end = p + length;
+
+  while (p < end)
+    {
+      uint64_t word;
+      while (end - p >= 8)
+        {
+          memcpy(&word, p, 8);
+          if (word & 0x8080808080808080ULL)
+            break;
+          p += 8;
+        }
+      if (p == end)
+        break;
+      if (*p < 0x80)
+        {
+          p++;
+          continue;
+        }
+
+      /* The lead byte gives the length, and the range of the second
+       * byte excludes overlong forms, surrogates and code points above
+       * U+10FFFF. */
+      int len;
+      unsigned char lo = 0x80, hi = 0xbf;
+      if (*p >= 0xc2 && *p <= 0xdf)
+        len = 2;
+      else if (*p >= 0xe0 && *p <= 0xef)
+        {
+          len = 3;
+          if (*p == 0xe0)
+            lo = 0xa0;
+          else if (*p == 0xed)
+            hi = 0x9f;
+        }
+      else if (*p >= 0xf0 && *p <= 0xf4)
+        {
+          len = 4;
+          if (*p == 0xf0)
+            lo = 0x90;
+          else if (*p == 0xf4)
+            hi = 0x8f;
+        }
+      else
+        break;
+
+      if (end - p < len || p[1] < lo || p[1] > hi)
+        break;
+      int i;
+      for (i=2; i<len; i++)
+        if ((p[i] & 0xc0) != 0x80)
+          break;
+      if (i < len)
+        break;
+      p += len;
+    }
+
+  return p - (const unsigned char*)text;
+}
+
+/* Deal with the invalid UTF-8 sequences of the input according to
+ * --invalid-utf8. Valid input is left as is.
+ */
+void
+fix_invalid_utf8(GString *inbuf)
+{
+  size_t pos = utf8_valid_prefix(inbuf->str, inbuf->len);
+  if (pos == inbuf->len)
+    return;
+
+  if (invalid_utf8 == INVALID_UTF8_REJECT)
+    {
+      fprintf(stderr, _("%1$s: Invalid UTF-8 in input at byte %2$zu.\n"), g_get_prgname(), pos);
+      exit(1);
+    }
+
+  /* Copy the valid runs, and replace every invalid byte either by
+   * U+FFFD or by the Latin-1 character with the same code. */
+  GString *fixed = g_string_sized_new(inbuf->len + 16);
+  size_t start = 0;
+  while (pos < inbuf->len)
+    {
+      g_string_append_len(fixed, inbuf->str + start, pos - start);
+      if (invalid_utf8 == INVALID_UTF8_REPLACE)
+        g_string_append(fixed, "\xef\xbf\xbd");
+      else
+        g_string_append_unichar(fixed, (unsigned char)inbuf->str[pos]);
+      start = pos + 1;
+      pos = start + utf8_valid_prefix(inbuf->str + start, inbuf->len - start);
+    }
+  g_string_append_len(fixed, inbuf->str + start, pos - start);
+
+  g_string_truncate(inbuf, 0);
+  g_string_append_len(inbuf, fixed->str, fixed->len);
+  g_string_free(fixed, true);
+}
+
+// Turn off the use of hyphens
+void
+layout_turn_off_hyphens(PangoLayout *layout)
+{
+  // Request not to get any hypens
+  PangoAttrList *attrs = pango_layout_get_attributes(layout);
+  if (attrs == NULL)
+    attrs = pango_attr_list_new ();
+  pango_attr_list_insert(attrs, pango_attr_insert_hyphens_new(FALSE));
+  pango_layout_set_attributes (layout, attrs);
+}
+
+// Add the attributes of the --highlight-regex matches to the text of
+// the layout.
+static void
+layout_add_highlights(PangoLayout *layout)
+{
+  const char *text = pango_layout_get_text(layout);
+  // A modified copy makes sure that the layout sees the change
+  PangoAttrList *attrs = pango_layout_get_attributes(layout);
+  attrs = attrs ? pango_attr_list_copy(attrs) : pango_attr_list_new();
+
+  for (auto& highlight : highlights)
+    {
+      GMatchInfo *match_info;
+      g_regex_match(highlight.regex, text, (GRegexMatchFlags)0, &match_info);
+      while (g_match_info_matches(match_info))
+        {
+          int start, end;
+          g_match_info_fetch_pos(match_info, 0, &start, &end);
+          for (auto attr : highlight.attrs)
+            {
+              PangoAttribute *match_attr = pango_attribute_copy(attr);
+              match_attr->start_index = start;
+              match_attr->end_index = end;
+              pango_attr_list_insert(attrs, match_attr);
+            }
+          g_match_info_next(match_info, nullptr);
+        }
+      g_match_info_free(match_info);
+    }
+  pango_layout_set_attributes (layout, attrs);
+  pango_attr_list_unref (attrs);
+}
+
+/* The color of an entry of the xterm 256 color palette */
+static int
+ansi_palette_color(int idx)
+{
+  static const int base_colors[16] = {
+    0x000000, 0xcd0000, 0x00cd00, 0xcdcd00, 0x0000ee, 0xcd00cd, 0x00cdcd, 0xe5e5e5,
+    0x7f7f7f, 0xff0000, 0x00ff00, 0xffff00, 0x5c5cff, 0xff00ff, 0x00ffff, 0xffffff
+  };
+  static const int cube_levels[6] = { 0, 95, 135, 175, 215, 255 };
+
+  if (idx < 16)
+    return base_colors[idx];
+  if (idx < 232)
+    {
+      idx -= 16;
+      return (cube_levels[idx / 36] << 16) | (cube_levels[idx / 6 % 6] << 8) | cube_levels[idx % 6];
+    }
+  int gray = 8 + (idx - 232) * 10;
+  return (gray << 16) | (gray << 8) | gray;
+}
+
+/* The color of the sub-parameters of an extended color, 38:5:idx or
+ * 38:2:[cs]:r:g:b, or -1 if they are not valid. The color space id of the
+ * ITU form is skipped, and may also be left out altogether, as most
+ * terminals accept.
+ */
+static int
+ansi_extended_color(const vector<int>& sub)
+{
+  if (sub.size() >= 3 && sub[1] == 5)
+    return ansi_palette_color(CLAMP(sub[2], 0, 255));
+  if (sub.size() >= 5 && sub[1] == 2)
+    {
+      size_t rgb = sub.size() >= 6 ? 3 : 2;
+      return (CLAMP(sub[rgb], 0, 255) << 16)
+        | (CLAMP(sub[rgb+1], 0, 255) << 8)
+        | CLAMP(sub[rgb+2], 0, 255);
+    }
+  return -1;
+}
+
+/* Apply the parameters of an SGR escape sequence to state. Each
+ * parameter holds its ':' separated sub-parameters after its value.
+ */
+static void
+apply_ansi_sgr(AnsiState *state, const vector<vector<int>>& params)
+{
+  for (size_t i=0; i<params.size(); i++)
+    {
+      int p = params[i][0];
+      if (p == 0)
+        *state = AnsiState();
+      else if (p == 1)
+        state->bold = true;
+      else if (p == 2)
+        state->faint = true;
+      else if (p == 3)
+        state->italic = true;
+      else if (p == 4)
+        state->underline = true;
+      else if (p == 7)
+        state->reverse = true;
+      else if (p == 9)
+        state->strikethrough = true;
+      else if (p == 22)
+        state->bold = state->faint = false;
+      else if (p == 23)
+        state->italic = false;
+      else if (p == 24)
+        state->underline = false;
+      else if (p == 27)
+        state->reverse = false;
+      else if (p == 29)
+        state->strikethrough = false;
+      else if (p >= 30 && p <= 37)
+        state->fg = ansi_palette_color(p - 30);
+      else if (p >= 90 && p <= 97)
+        state->fg = ansi_palette_color(p - 90 + 8);
+      else if (p == 39)
+        state->fg = -1;
+      else if (p >= 40 && p <= 47)
+        state->bg = ansi_palette_color(p - 40);
+      else if (p >= 100 && p <= 107)
+        state->bg = ansi_palette_color(p - 100 + 8);
+      else if (p == 49)
+        state->bg = -1;
+      else if (p == 38 || p == 48)
+        {
+          // Extended colors, 5;idx or 2;r;g;b, or the same with ':'
+          int color = -1;
+          if (params[i].size() > 1)
+            {
+              color = ansi_extended_color(params[i]);
+              if (color < 0)
+                continue;
+            }
+          else if (i+2 < params.size() && params[i+1][0] == 5)
+            {
+              color = ansi_palette_color(CLAMP(params[i+2][0], 0, 255));
+              i += 2;
+            }
+          else if (i+4 < params.size() && params[i+1][0] == 2)
+            {
+              color = (CLAMP(params[i+2][0], 0, 255) << 16)
+                | (CLAMP(params[i+3][0], 0, 255) << 8)
+                | CLAMP(params[i+4][0], 0, 255);
+              i += 4;
+            }
+          else
+            break;
+          if (p == 38)
+            state->fg = color;
+          else
+            state->bg = color;
+        }
+    }
+}
+
+/* Add the attributes of state for the text between start and end */
+static void
+insert_ansi_attrs(PangoAttrList *attrs,
+                  const AnsiState& state,
+                  guint start,
+                  guint end)
+{
+  if (start == end || state == AnsiState())
+    return;
+
+  int fg = state.fg, bg = state.bg;
+  if (state.reverse)
+    {
+      fg = state.bg < 0 ? 0xffffff : state.bg;
+      bg = state.fg < 0 ? 0x000000 : state.fg;
+    }
+
+  vector<PangoAttribute*> list;
+  if (fg >= 0)
+    list.push_back(pango_attr_foreground_new(((fg >> 16) & 0xff) * 257,
+                                             ((fg >> 8) & 0xff) * 257,
+                                             (fg & 0xff) * 257));
+  if (bg >= 0)
+    list.push_back(pango_attr_background_new(((bg >> 16) & 0xff) * 257,
+                                             ((bg >> 8) & 0xff) * 257,
+                                             (bg & 0xff) * 257));
+  if (state.bold)
+    list.push_back(pango_attr_weight_new(PANGO_WEIGHT_BOLD));
+  if (state.faint)
+    list.push_back(pango_attr_foreground_alpha_new(0x8000));
+  if (state.italic)
+    list.push_back(pango_attr_style_new(PANGO_STYLE_ITALIC));
+  if (state.underline)
+    list.push_back(pango_attr_underline_new(PANGO_UNDERLINE_SINGLE));
+  if (state.strikethrough)
+    list.push_back(pango_attr_strikethrough_new(true));
+
+  for (auto attr : list)
+    {
+      attr->start_index = start;
+      attr->end_index = end;
+      pango_attr_list_insert(attrs, attr);
+    }
+}
+
+/* Set the text of a paragraph that may contain ANSI escape sequences.
+ * The escape sequences are removed, and SGR sequences are turned into
+ * attributes of the layout. The state is carried on to the following
+ * paragraphs.
+ */
+static void
+set_ansi_text(PangoLayout *layout,
+              const char *text,
+              int length,
+              AnsiState *state)
+{
+  string plain;
+  PangoAttrList *attrs = pango_attr_list_new();
+  AnsiState run_state = *state;
+  guint run_start = 0;
+  const char *p = text, *end = text + length;
+
+  while (p < end)
+    {
+      const char *esc = (const char*)memchr(p, '\033', end - p);
+      if (!esc)
+        esc = end;
+      plain.append(p, esc - p);
+      p = esc;
+      if (p == end)
+        break;
+
+      // Only control sequences are interpreted. A lone escape is dropped.
+      p++;
+      if (p == end || *p != '[')
+        continue;
+      const char *seq = ++p;
+      while (p < end && !(*p >= 0x40 && *p <= 0x7e))
+        p++;
+      if (p == end)
+        break;
+      if (*p++ != 'm')
+        continue;
+
+      // A value is clamped, as nothing larger than a color is meaningful
+      vector<vector<int>> params = { { 0 } };
+      for (const char *c = seq; c < p-1; c++)
+        {
+          if (*c == ';')
+            params.push_back({ 0 });
+          else if (*c == ':')
+            params.back().push_back(0);
+          else if (g_ascii_isdigit(*c))
+            {
+              int& value = params.back().back();
+              value = MIN(value * 10 + (*c - '0'), ANSI_MAX_PARAM);
+            }
+        }
+      apply_ansi_sgr(state, params);
+      if (!(*state == run_state))
+        {
+          insert_ansi_attrs(attrs, run_state, run_start, plain.size());
+          run_state = *state;
+          run_start = plain.size();
+        }
+    }
+  insert_ansi_attrs(attrs, run_state, run_start, plain.size());
+
+  pango_layout_set_text(layout, plain.c_str(), plain.size());
+  pango_layout_set_attributes(layout, attrs);
+  pango_attr_list_unref(attrs);
+}
+
+/* Take a UTF8 string and break it into paragraphs on \n characters
+ */
+GList *
+split_text_into_paragraphs (PangoContext *pango_context,
+                            PageLayout *page_layout,
+                            int paint_width,  /* In pixels */
+                            const char *text)
+{
+  const char *p = text;
+  char *next;
+  gunichar wc;
+  GList *result = nullptr;
+  const char *last_para = text;
+  int line_no = page_layout->first_line_no;
+  bool at_line_start = !page_layout->starts_in_line;
+  AnsiState ansi_state = page_layout->ansi_state;
+
+  /* If we are using markup we treat the entire text as a single paragraph.
+   * I tested it and found that this is much slower than the split and
+   * assign method used below. Otherwise we might as well use this single
+   * chunk method always.
+   *
+   * I don't think we need this at all, and are better of reading one
+   * line at a time...
+   */
+#if 0
+  if (0 && page_layout->do_use_markup)
+    {
+      Paragraph *para = g_new (Paragraph, 1);
+      para->wrapped = false; /* No wrapped chars for markups */
+      para->clipped = false;
+      para->text = text;
+      para->length = strlen(text);
+      para->layout = pango_layout_new (pango_context);
+      pango_layout_set_attributes (para->layout, attrs);
+      pango_layout_set_markup (para->layout, para->text, para->length);
+      pango_layout_set_justify (para->layout, page_layout->do_justify);
+      pango_layout_set_alignment (para->layout,
+                                  page_layout->pango_dir == PANGO_DIRECTION_LTR
+                                      ? PANGO_ALIGN_LEFT : PANGO_ALIGN_RIGHT);
+      pango_layout_set_width (para->layout, paint_width * PANGO_SCALE);
+      pango_layout_set_wrap (para->layout, opt_wrap);
+
+      para->height = 0;
+      
+      result = g_list_prepend (result, para);
+    }
+  else
+#endif
+    {
+
+      while (p != nullptr && *p)
+        {
+          wc = g_utf8_get_char (p);
+          next = g_utf8_next_char (p);
+          if (wc == (gunichar)-1)
+            {
+              fprintf (stderr, _("%s: Invalid character in input\n"), g_get_prgname ());
+              wc = 0;
+            }
+          if (!*p || !wc || wc == '\r' || wc == '\n' || wc == '\f')
+            {
+              Paragraph *para = g_new (Paragraph, 1);
+              para->wrapped = false;
+              para->clipped = false;
+              para->text = last_para;
+              para->line_no = line_no;
+              para->starts_line = at_line_start;
+              para->ansi_state = ansi_state;
+              para->length = p - last_para;
+              /* handle dos line breaks */
+              if (wc == '\r' && *next == '\n')
+                  next = g_utf8_next_char(next);
+              para->layout = pango_layout_new (pango_context);
+
+              if (page_layout->cpi > 0.0L)
+                {
+                  /* figuring out the correct width from the pango_font_metrics_get_approximate_width()
+                   * is really hard and pango_layout_set_wrap() doesn't work properly then.
+                   * Those are not reliable to render the characters exactly according to the given CPI.
+                   * So re-calculate the width to wrap up to be comfortable with CPI.
+                   */
+                  wchar_t *wtext = nullptr, *wnewtext = nullptr;
+                  gchar *newtext = nullptr;
+                  gsize len, col, i, wwidth = 0;
+                  PangoRectangle ink_rect, logical_rect;
+
+                  wtext = (wchar_t *)g_utf8_to_ucs4 (para->text, para->length, nullptr, nullptr, nullptr);
+                  if (wtext == nullptr)
+                    {
+                      fprintf (stderr, _("%s: Unable to convert UTF-8 to UCS-4.\n"), g_get_prgname ());
+                    fail:
+                      g_free (wtext);
+                      g_free (wnewtext);
+                      g_free (newtext);
+                      exit (1);
+                    }
+                  len = g_utf8_strlen (para->text, para->length);
+                  /* the amount of characters that can be put on the line against CPI */
+                  col = (int)(page_layout->column_width / 72.0 * page_layout->cpi);
+                  if (len > col)
+                    {
+                      /* need to wrap them up */
+                      wnewtext = g_new (wchar_t, wcslen (wtext) + 1);
+                      para->clipped = true;
+                      if (wnewtext == nullptr)
+                        {
+                          fprintf (stderr, _("%s: Unable to allocate the memory.\n"), g_get_prgname ());
+                          goto fail;
+                        }
+                      for (i = 0; i < len; i++)
+                        {
+                          gssize w = wcwidth (wtext[i]);
+
+                          if (w >= 0)
+                            wwidth += w;
+                          if (wwidth > col)
+                            break;
+                          wnewtext[i] = wtext[i];
+                        }
+                      wnewtext[i] = 0L;
+
+                      newtext = g_ucs4_to_utf8 ((const gunichar *)wnewtext, i, nullptr, nullptr, nullptr);
+                      if (newtext == nullptr)
+                        {
+                          fprintf (stderr, _("%s: Unable to convert UCS-4 to UTF-8.\n"), g_get_prgname ());
+                          goto fail;
+                        }
+                      if (page_layout->do_use_markup)
+                          pango_layout_set_markup (para->layout, newtext, -1);
+                      else
+                          pango_layout_set_text (para->layout, newtext, -1);
+
+                      // Request not to get any hypens
+                      if (!page_layout->do_show_hyphens)
+                        layout_turn_off_hyphens(para->layout);
+
+                      pango_layout_get_extents (para->layout, &ink_rect, &logical_rect);
+                      paint_width = logical_rect.width / PANGO_SCALE;
+                      g_free (wnewtext);
+                      g_free (newtext);
+
+                      para->length = i;
+                      next = g_utf8_offset_to_pointer (para->text, para->length);
+                      wc = g_utf8_get_char (g_utf8_prev_char (next));
+                    }
+                  else
+                    {
+                      pango_layout_set_text (para->layout, para->text, para->length);
+                    }
+
+                  g_free (wtext);
+
+                  pango_layout_set_width (para->layout, -1);
+                }
+              else
+                {
+                  if (page_layout->do_use_markup)
+                      pango_layout_set_markup (para->layout, para->text, para->length);
+                  else if (page_layout->do_ansi)
+                      set_ansi_text (para->layout, para->text, para->length, &ansi_state);
+                  else
+                      pango_layout_set_text (para->layout, para->text, para->length);
+                  pango_layout_set_width (para->layout, paint_width * PANGO_SCALE);
+
+                  pango_layout_set_wrap (para->layout, opt_wrap);
+
+                  if (!page_layout->do_show_hyphens)
+                    layout_turn_off_hyphens(para->layout);
+
+                  if (opt_wrap == PANGO_WRAP_CHAR)
+                      para->wrapped = true;                    
+
+                  /* Should we support truncation as well? */
+                }
+
+              if (!highlights.empty())
+                layout_add_highlights(para->layout);
+                  
+              pango_layout_set_justify (para->layout, page_layout->do_justify);
+              pango_layout_set_alignment (para->layout,
+                                          page_layout->pango_dir == PANGO_DIRECTION_LTR
+                                          ? PANGO_ALIGN_LEFT : PANGO_ALIGN_RIGHT);
+
+              para->height = 0;
+
+              para->source_end = next;
+              last_para = next;
+            
+              if (wc == '\f')
+                para->formfeed = 1;
+              else
+                para->formfeed = 0;
+
+              /* A form feed or a clipped line continues the input line */
+              at_line_start = wc == '\n' || wc == '\r';
+              if (at_line_start)
+                line_no++;
+
+              result = g_list_prepend (result, para);
+            }
+          if (!wc) /* incomplete character at end */
+            break;
+          p = next;
+        }
+    }
+
+  return g_list_reverse (result);
+}
+
+
+
+/* Split a list of paragraphs into a list of lines.
+ */
+GList *
+split_paragraphs_into_lines(PageLayout *page_layout,
+                            GList         *paragraphs)
+{
+  GList *line_list = nullptr;
+  int max_height = 0;
+  /* Read the file */
+
+  /* Now split all the pagraphs into lines */
+  GList *par_list;
+
+  par_list = paragraphs;
+  while(par_list)
+    {
+      int para_num_lines, i;
+      LineLink *line_link;
+      Paragraph *para = (Paragraph*)par_list->data;
+
+      para_num_lines = pango_layout_get_line_count(para->layout);
+
+      for (i=0; i<para_num_lines; i++)
+        {
+          PangoRectangle logical_rect, ink_rect;
+          
+          line_link = g_new(LineLink, 1);
+          line_link->formfeed = 0;
+          line_link->wrapped = (para->wrapped && i < para_num_lines - 1) || (para->clipped);
+          line_link->para = para;
+          line_link->para_line_idx = i;
+          line_link->pango_line = pango_layout_get_line(para->layout, i);
+          pango_layout_line_get_extents(line_link->pango_line,
+                                        &ink_rect, &logical_rect);
+          line_link->logical_rect = logical_rect;
+          if (para->formfeed && i == (para_num_lines - 1))
+              line_link->formfeed = 1;
+          line_link->ink_rect = ink_rect;
+          line_list = g_list_prepend(line_list, line_link);
+          if (logical_rect.height > max_height)
+              max_height = logical_rect.height;
+        }
+
+      par_list = par_list->next;
+    }
+  
+  /*
+   * not fixed for cairo backend: disable
+   *
+  if (page_layout->do_stretch_chars && page_layout->lpi > 0.0L)
+      page_layout->scale_y = 1.0 / page_layout->lpi * 72.0 * PANGO_SCALE / max_height;
+   */
+
+  return g_list_reverse(line_list);
+  
+}
+
+/* Free a list of paragraphs together with their layouts.
+ */
+void
+free_paragraphs(GList *paragraphs)
+{
+  for (GList *p = paragraphs; p; p = p->next)
+    {
+      Paragraph *para = (Paragraph*)p->data;
+      g_object_unref(para->layout);
+      g_free(para);
+    }
+  g_list_free(paragraphs);
+}
+
+
+/*
+ * Define PostScript document header information.
+ */
+void
+postscript_dsc_comments(cairo_surface_t *surface, PageLayout *pl)
+{
+  char buf[CAIRO_COMMENT_MAX];
+  int x, y;
+
+  /*
+   * Title
+   */
+  snprintf(buf, CAIRO_COMMENT_MAX, "%%%%Title: %s", pl->title.c_str());
+  cairo_ps_surface_dsc_comment (surface, buf);
+
+  /*
+   * Orientation
+   */
+  if (pl->do_landscape)
+    {
+      cairo_ps_surface_dsc_comment (surface, "%%Orientation: Landscape");
+      x = (int)pl->page_height;
+      y = (int)pl->page_width;
+    }
+  else
+    {
+      cairo_ps_surface_dsc_comment (surface, "%%Orientation: Portrait");
+      x = (int)pl->page_width;
+      y = (int)pl->page_height;
+    }
+
+  /*
+   * Redefine BoundingBox to cover the whole paper. Cairo creates the entry
+   * based on the text only. This may affect further processing, such as with
+   * convert(1).
+   */
+  snprintf(buf, CAIRO_COMMENT_MAX, "%%%%BoundingBox: 0 0 %d %d", x, y);
+  cairo_ps_surface_dsc_comment (surface, buf);
+
+  /*
+   * Duplex
+   */
+  if (pl->do_duplex)
+    {
+      cairo_ps_surface_dsc_comment(surface, "%%Requirements: duplex");
+      cairo_ps_surface_dsc_begin_setup(surface);
+
+      if (pl->do_tumble)
+        cairo_ps_surface_dsc_comment(surface, "%%IncludeFeature: *Duplex DuplexTumble");
+      else
+        cairo_ps_surface_dsc_comment(surface, "%%IncludeFeature: *Duplex DuplexNoTumble");
+    }
+  else
+    cairo_ps_surface_dsc_begin_setup(surface);
+
+  if (pl->paper_type == PAPER_TYPE_US_LEGAL)
+    cairo_ps_surface_dsc_comment (surface, "%%IncludeFeature: *PageSize Legal");
+  if (pl->paper_type == PAPER_TYPE_US_LETTER)
+    cairo_ps_surface_dsc_comment (surface, "%%IncludeFeature: *PageSize Letter");
+  if (pl->paper_type == PAPER_TYPE_A4)
+    cairo_ps_surface_dsc_comment (surface, "%%IncludeFeature: *PageSize A4");
+  if (pl->paper_type == PAPER_TYPE_A3)
+    cairo_ps_surface_dsc_comment (surface, "%%IncludeFeature: *PageSize A3");
+}
+
+
+int
+output_pages(cairo_surface_t *surface,
+             cairo_t       *cr,
+             GList         *pango_lines,
+             PageLayout *page_layout,
+             PangoContext  *pango_context,
+             int            first_page_idx)
+{
+  int num_pages = -1; // This will be known after the pages are laid out
+  dict_t document_info;
+
+  // Fill in the static document info 
+  build_document_info(page_layout, document_info);
+  document_info["num_pages"] = 0;
+
+  // With {num_pages} in the headers and footers, the pages are counted
+  // first, by a pass that only measures them. The lines are laid out
+  // already, so this is cheap compared to drawing them.
+  if (document_info_keys(page_layout).count("num_pages"))
+    {
+      num_pages = output_pages_pass(surface, cr, pango_lines, page_layout, pango_context,
+                                    document_info, first_page_idx, num_pages, true, nullptr,
+                                    nullptr, nullptr);
+      document_info["num_pages"] = num_pages;
+    }
+
+  // With a single copy in order, the pages are written as they are laid
+  // out.
+  int num_copies = MAX(page_layout->num_copies, 1);
+  if (num_copies == 1 && !page_layout->do_reverse)
+    return output_pages_pass(surface, cr, pango_lines, page_layout, pango_context,
+                             document_info, first_page_idx, num_pages, false, nullptr,
+                             map_fh, nullptr);
+
+  // Otherwise the pages are recorded without their headers and footers,
+  // which are drawn when the recordings are replayed. Every copy of a
+  // page replays the same recording, which the PDF output references as
+  // a single form. The recordings of all of the pages are kept until
+  // the end, so the memory that this takes grows with the document.
+  vector<cairo_surface_t*> page_recordings;
+  num_pages = output_pages_pass(surface, cr, pango_lines, page_layout, pango_context,
+                                document_info, first_page_idx, num_pages, false, nullptr,
+                                map_fh, &page_recordings);
+  document_info["num_pages"] = num_pages;
+
+  auto replay_page = [&](size_t i) {
+    int page_idx = first_page_idx + i;
+    document_info["page_idx"] = page_idx;
+    start_page(surface, cr, page_layout, false);
+    cairo_save(cr);
+    cairo_set_source_surface(cr, page_recordings[i], 0, 0);
+    cairo_paint(cr);
+    cairo_restore(cr);
+    if (page_layout->do_draw_header)
+      draw_page_header_line_to_page(cr, false, page_layout, pango_context, page_idx, num_pages, document_info, false);
+    if (page_layout->do_draw_footer)
+      draw_page_header_line_to_page(cr, true, page_layout, pango_context, page_idx, num_pages, document_info, false);
+    eject_page(cr);
+  };
+
+  size_t count = page_recordings.size();
+  int num_sets = page_layout->do_collate ? num_copies : 1;
+  int num_page_copies = page_layout->do_collate ? 1 : num_copies;
+  for (int set=0; set<num_sets; set++)
+    for (size_t j=0; j<count; j++)
+      for (int copy=0; copy<num_page_copies; copy++)
+        replay_page(page_layout->do_reverse ? count - 1 - j : j);
+
+  for (auto recording : page_recordings)
+    cairo_surface_destroy(recording);
+
+  return num_pages;
+}
+
+/* Lay out the lines on pages, starting with page first_page_idx. If
+ * measure_only is set nothing is drawn. When page_starts is given, the
+ * link of the first line of every page is appended to it, and when
+ * map_fh is given the position of every input line is written to it.
+ * When page_recordings is given, every page is drawn into a recording
+ * surface of its own, that is appended to it, instead of to the
+ * surface, and the headers and footers are only measured.
+ * Returns the index of the last page.
+ */
+int
+output_pages_pass(cairo_surface_t *surface,
+                  cairo_t       *cr,
+                  GList         *pango_lines,
+                  PageLayout *page_layout,
+                  PangoContext  *pango_context,
+                  dict_t&        document_info,
+                  int            first_page_idx,
+                  int            num_pages,
+                  bool           measure_only,
+                  vector<GList*> *page_starts,
+                  FILE          *map_fh,
+                  vector<cairo_surface_t*> *page_recordings)
+{
+  int pango_column_height = page_layout->pango_column_height;
+  int height = 0;
+  int title_height = 0;
+  int page_idx = first_page_idx;
+  LineLink *prev_line_link = nullptr;
+  int column_idx = 0;
+  int column_y_pos = 0;
+  LineMapEntry map_entry = {0, 0, 0, 0, 0};
+  cairo_t *page_cr = cr;
+  bool measure_headers = measure_only || page_recordings;
+
+  auto begin_page = [&]() {
+    if (page_starts)
+      page_starts->push_back(pango_lines);
+    if (page_recordings)
+      {
+        cairo_surface_t *recording = cairo_recording_surface_create(CAIRO_CONTENT_COLOR_ALPHA, nullptr);
+        page_recordings->push_back(recording);
+        page_cr = cairo_create(recording);
+      }
+    else
+      start_page(surface, cr, page_layout, measure_only);
+
+    if (page_layout->do_draw_header)
+      {
+        title_height = draw_page_header_line_to_page(page_cr, false, page_layout, pango_context, page_idx, num_pages, document_info, measure_headers);
+        column_y_pos = title_height;
+      }
+    if (page_layout->do_draw_footer)
+      draw_page_header_line_to_page(page_cr, true, page_layout, pango_context, page_idx, num_pages, document_info, measure_headers);
+  };
+  auto end_page = [&]() {
+    if (page_recordings)
+      cairo_destroy(page_cr);
+    else if (!measure_only)
+      eject_page(cr);
+  };
+
+  document_info["page_idx"] = page_idx;
+  begin_page();
+
+  while(pango_lines)
+    {
+      LineLink *line_link = (LineLink*)pango_lines->data;
+      PangoLayoutLine *line = line_link->pango_line;
+      bool draw_wrap_character = page_layout->do_show_wrap && line_link->wrapped;
+      
+      /* Check if we need to move to next column */
+      if ((column_y_pos + line_link->logical_rect.height
+           >= pango_column_height) ||
+          (prev_line_link && prev_line_link->formfeed))
+        {
+          column_idx++;
+          column_y_pos = title_height;
+          if (column_idx == page_layout->num_columns)
+            {
+              column_idx = 0;
+              end_page();
+              page_idx++;
+              document_info["page_idx"] = page_idx;
+              begin_page();
+            }
+          else
+            {
+              eject_column(page_cr,
+                           title_height,
+                           page_layout,
+                           column_idx,
+                           measure_only
+                           );
+            }
+        }
+      if (page_layout->line_pitch)
+        height = page_layout->line_pitch;
+      else
+        height = line_link->logical_rect.height;
+      if (map_fh)
+        {
+          if (line_link->para->line_no != map_entry.line_no)
+            {
+              if (map_entry.line_no)
+                write_line_map_entry(map_fh, map_entry);
+              map_entry.line_no = line_link->para->line_no;
+              map_entry.page_idx = page_idx;
+              map_entry.column_idx = column_idx;
+              map_entry.y_pos = (double)(page_layout->body_y + column_y_pos + height) / PANGO_SCALE;
+              map_entry.continuations = 0;
+            }
+          else
+            map_entry.continuations++;
+        }
+      if (!measure_only)
+        draw_line_to_page(page_cr,
+                          column_idx,
+                          column_y_pos+height,
+                          page_layout,
+                          line,
+                          draw_wrap_character,
+                          line_link->para_line_idx == 0 && line_link->para->starts_line
+                          ? line_link->para->line_no : 0);
+      column_y_pos += height;
+      pango_lines = pango_lines->next;
+      prev_line_link = line_link;
+    }
+  if (map_fh && map_entry.line_no)
+    write_line_map_entry(map_fh, map_entry);
+  end_page();
+
+  return page_idx;
+}
+
+/* Write the DSC index of the PostScript output as JSON. A range of pages
+ * is extracted by the bytes before the first page, then those from the
+ * first page of the range up to the page after it or the trailer, and
+ * the bytes from the trailer on.
+ */
+void
+write_dsc_index(FILE *index_fh, const DscIndex& index)
+{
+  string pages;
+  for (size_t i=0; i<index.pages.size(); i++)
+    pages += format("{}{}", i ? "," : "", index.pages[i]);
+  string json = format("{{\"end_prolog\":{},\"begin_setup\":{},\"pages\":[{}],\"trailer\":{},\"end\":{}}}\n",
+                       index.end_prolog,
+                       index.begin_setup,
+                       pages,
+                       index.trailer,
+                       index.offset);
+  fputs(json.c_str(), index_fh);
+}
+
+/* Write an entry of the line map as a line of JSON */
+void
+write_line_map_entry(FILE *map_fh, const LineMapEntry& entry)
+{
+  // fmt formats the numbers independently of the locale
+  string json = format("{{\"line\":{},\"page\":{},\"column\":{},\"y\":{},\"continuations\":{}}}\n",
+                       entry.line_no,
+                       entry.page_idx,
+                       entry.column_idx,
+                       entry.y_pos,
+                       entry.continuations);
+  fputs(json.c_str(), map_fh);
+}
+
+/* Paginate the document and split the pages into num_shards ranges
+ * that are rendered into separate PDF documents in parallel threads.
+ * The shards are then merged, in order, into the output as soon as
+ * they are done, or into pdf_output if it is given. Returns the number
+ * of pages.
+ */
+int
+output_pages_sharded(cairo_surface_t *surface,
+                     cairo_t       *cr,
+                     GList         *pango_lines,
+                     PageLayout *page_layout,
+                     PangoContext  *pango_context,
+                     int            num_shards,
+                     double         surface_page_width,
+                     double         surface_page_height,
+                     string        *pdf_output)
+{
+  dict_t document_info;
+  vector<GList*> page_starts;
+
+  build_document_info(page_layout, document_info);
+  document_info["num_pages"] = 0;
+  int num_pages = output_pages_pass(surface, cr, pango_lines, page_layout, pango_context,
+                                    document_info, 1, -1, true, &page_starts,
+                                    map_fh, nullptr);
+  if (num_shards > num_pages)
+    num_shards = num_pages;
+
+  // The date is cached on its first use. Make sure that this happens
+  // before it is read by the threads.
+  get_date();
+
+  vector<PdfShard> shards(num_shards);
+  for (int i=0; i<num_shards; i++)
+    {
+      PdfShard& shard = shards[i];
+      int first_page = i * num_pages / num_shards;
+      int end_page = (i+1) * num_pages / num_shards;
+      GList *first = page_starts[first_page];
+      GList *end = end_page < num_pages ? page_starts[end_page] : nullptr;
+
+      shard.page_layout = *page_layout;
+      shard.font_description = pango_font_description_copy(pango_context_get_font_description(pango_context));
+      shard.first_page_idx = first_page + 1;
+      shard.num_pages = num_pages;
+      shard.surface_page_width = surface_page_width;
+      shard.surface_page_height = surface_page_height;
+      init_pdf_shard(&shard, first, end);
+    }
+
+  vector<thread> threads;
+  for (auto& shard : shards)
+    threads.emplace_back(render_pdf_shard, &shard);
+
+  try
+    {
+      PdfMerger merger([pdf_output](const char *data, size_t len) {
+          if (pdf_output)
+            pdf_output->append(data, len);
+          else
+            fwrite(data, len, 1, output_fh);
+        });
+      for (int i=0; i<num_shards; i++)
+        {
+          threads[i].join();
+          merger.add_document(shards[i].pdf.data(), shards[i].pdf.size());
+          string().swap(shards[i].pdf);
+          if (i == 0 && !pdf_output)
+            {
+              fflush(output_fh);
+              first_page_time = g_get_monotonic_time();
+            }
+        }
+      merger.finish();
+    }
+  catch (const runtime_error& e)
+    {
+      fprintf(stderr, _("%1$s: Failed merging the PDF shards: %2$s\n"), g_get_prgname(), e.what());
+      exit(1);
+    }
+
+  return num_pages;
+}
+
+/* Count the pages of the text by laying it out, without drawing it.
+ * With a fraction below 1, only evenly spread blocks of whole lines,
+ * that add up to about that part of the text, are laid out, and the
+ * count is extrapolated from them by their size.
+ */
+double
+count_pages(cairo_surface_t *surface,
+            cairo_t       *cr,
+            PageLayout *page_layout,
+            PangoContext  *pango_context,
+            double         fraction)
+{
+  const char *text = page_layout->text;
+  const char *text_end = text + page_layout->text_length;
+  size_t stride = (size_t)(ESTIMATE_BLOCK_SIZE / fraction);
+  string sample;
+
+  // Short texts are counted in full
+  if (fraction < 1.0 && page_layout->text_length > 2 * stride)
+    {
+      for (const char *block = text; block < text_end; block += stride)
+        {
+          const char *begin = block;
+          if (begin > text)
+            {
+              begin = (const char*)memchr(begin, '\n', text_end - begin);
+              if (!begin)
+                break;
+              begin++;
+            }
+          const char *end = begin + MIN((size_t)ESTIMATE_BLOCK_SIZE, (size_t)(text_end - begin));
+          end = (const char*)memchr(end, '\n', text_end - end);
+          end = end ? end + 1 : text_end;
+          sample.append(begin, end - begin);
+          if (end >= text_end)
+            break;
+        }
+      text = sample.c_str();
+    }
+
+  dict_t document_info;
+  vector<GList*> page_starts;
+  build_document_info(page_layout, document_info);
+  document_info["num_pages"] = 0;
+
+  GList *paragraphs = split_text_into_paragraphs(pango_context,
+                                                 page_layout,
+                                                 page_layout->column_width,
+                                                 text);
+  GList *pango_lines = split_paragraphs_into_lines(page_layout, paragraphs);
+  output_pages_pass(surface, cr, pango_lines, page_layout, pango_context,
+                    document_info, 1, -1, true, &page_starts,
+                    nullptr, nullptr);
+  double pages = page_starts.size();
+
+  if (!sample.empty())
+    {
+      // The last page of the sample is only counted by how full it is,
+      // in lines, compared to the average of the other pages.
+      if (page_starts.size() > 1)
+        {
+          int num_lines = g_list_length(pango_lines);
+          int lines_before_last = g_list_position(pango_lines, page_starts.back());
+          pages = page_starts.size() - 1
+            + (double)(num_lines - lines_before_last) * (page_starts.size() - 1) / lines_before_last;
+        }
+      pages *= (double)page_layout->text_length / sample.size();
+    }
+
+  g_list_free_full(pango_lines, g_free);
+  free_paragraphs(paragraphs);
+
+  return pages;
+}
+
+/* Lay out the paragraphs until the first num_pages pages are complete,
+ * which is when the page after them is started, or until there are no
+ * more. The first line of every page is appended to page_starts.
+ * Returns the lines that were laid out.
+ */
+GList *
+layout_first_pages(cairo_surface_t *surface,
+                   cairo_t       *cr,
+                   GList         *paragraphs,
+                   PageLayout *page_layout,
+                   PangoContext  *pango_context,
+                   int            num_pages,
+                   vector<GList*> *page_starts)
+{
+  dict_t document_info;
+  GList *pango_lines = nullptr;
+  GList *para_list = paragraphs;
+  int batch_size = 16;
+
+  build_document_info(page_layout, document_info);
+  document_info["num_pages"] = 0;
+
+  // The paragraphs are laid out in growing batches, so that the lines
+  // are measured again only a few times.
+  page_starts->clear();
+  while (para_list && (int)page_starts->size() <= num_pages)
+    {
+      GList *batch = para_list;
+      GList *last = g_list_nth(batch, batch_size - 1);
+      para_list = last ? last->next : nullptr;
+      if (last)
+        last->next = nullptr;
+      pango_lines = g_list_concat(pango_lines,
+                                  split_paragraphs_into_lines(page_layout, batch));
+      if (last)
+        last->next = para_list;
+      batch_size *= 2;
+
+      page_starts->clear();
+      output_pages_pass(surface, cr, pango_lines, page_layout, pango_context,
+                        document_info, 1, -1, true, page_starts,
+                        nullptr, nullptr);
+    }
+
+  return pango_lines;
+}
+
+/* Make room for the line numbers, and a space, in every column of the
+ * given width. Returns whether there is room left for the text.
+ */
+bool
+set_line_number_width(PageLayout *page_layout,
+                      PangoContext *pango_context,
+                      int column_width)
+{
+  page_layout->column_width = column_width;
+  page_layout->line_number_width = 0;
+  if (page_layout->line_number_digits > 0)
+    {
+      PangoLayout *digits = pango_layout_new(pango_context);
+      PangoRectangle logical_rect;
+      pango_layout_set_text(digits, "0123456789", -1);
+      pango_layout_get_extents(digits, nullptr, &logical_rect);
+      g_object_unref(digits);
+      page_layout->line_number_width = (int)ceil((page_layout->line_number_digits + 1)
+                                                 * logical_rect.width / 10.0 / PANGO_SCALE);
+      page_layout->column_width -= page_layout->line_number_width;
+    }
+  compute_page_geometry(page_layout);
+
+  return page_layout->column_width > 0;
+}
+
+/* Find the largest font size, up to the size of font_description, with
+ * which the text fits on max_pages pages, by a binary search in steps
+ * of a quarter point. Every candidate is only laid out, until it takes
+ * more pages than that, and nothing is drawn. The text is split into
+ * paragraphs once, and their layouts are laid out again for every
+ * candidate. The size is set in font_description and in pango_context.
+ * Returns false if the text does not fit even at MIN_FIT_FONT_SIZE,
+ * which is then used.
+ */
+bool
+fit_font_size(cairo_surface_t *surface,
+              cairo_t       *cr,
+              PageLayout *page_layout,
+              PangoContext  *pango_context,
+              PangoFontDescription *font_description,
+              int            column_width,
+              int            max_pages)
+{
+  const int step = PANGO_SCALE / 4;
+
+  auto set_size = [&](int size) {
+    pango_font_description_set_size(font_description, size);
+    pango_context_set_font_description(pango_context, font_description);
+    glyph_font_size = (double)size / PANGO_SCALE;
+    return set_line_number_width(page_layout, pango_context, column_width);
+  };
+  GList *paragraphs = nullptr;
+  auto fits = [&](int size) {
+    if (!set_size(size))
+      return false;
+    if (!paragraphs)
+      paragraphs = split_text_into_paragraphs(pango_context,
+                                              page_layout,
+                                              page_layout->column_width,
+                                              page_layout->text);
+    else
+      for (GList *p = paragraphs; p; p = p->next)
+        {
+          PangoLayout *layout = ((Paragraph*)p->data)->layout;
+          pango_layout_set_width(layout, page_layout->column_width * PANGO_SCALE);
+          pango_layout_context_changed(layout);
+        }
+    vector<GList*> page_starts;
+    GList *pango_lines = layout_first_pages(surface, cr, paragraphs, page_layout, pango_context,
+                                            max_pages, &page_starts);
+    g_list_free_full(pango_lines, g_free);
+    return (int)page_starts.size() <= max_pages;
+  };
+
+  int hi = pango_font_description_get_size(font_description);
+  int lo = MIN_FIT_FONT_SIZE * PANGO_SCALE;
+  if (fits(hi))
+    {
+      free_paragraphs(paragraphs);
+      return true;
+    }
+  if (hi <= lo || !fits(lo))
+    {
+      free_paragraphs(paragraphs);
+      set_size(MIN(lo, hi));
+      return false;
+    }
+
+  // The text fits at lo, but not at hi
+  while (hi - lo > step)
+    {
+      int mid = lo + (hi - lo) / 2 / step * step;
+      if (fits(mid))
+        lo = mid;
+      else
+        hi = mid;
+    }
+  free_paragraphs(paragraphs);
+  set_size(lo);
+
+  return true;
+}
+
+/* Lay out the paragraphs only until the first num_first_pages pages are
+ * complete, and render them from that layout while the rest of the
+ * document is laid out and rendered in a thread, the way that the shards
+ * are. The first pages are written as a complete PDF of their own, which
+ * can be opened before the rest arrives, and the rest is then appended
+ * to it as an incremental update. Returns the number of pages.
+ */
+int
+output_pages_first_fast(cairo_surface_t *surface,
+                        cairo_t       *cr,
+                        GList         *paragraphs,
+                        PageLayout *page_layout,
+                        PangoContext  *pango_context,
+                        int            num_first_pages,
+                        double         surface_page_width,
+                        double         surface_page_height)
+{
+  vector<GList*> page_starts;
+  GList *pango_lines = layout_first_pages(surface, cr, paragraphs, page_layout, pango_context,
+                                          num_first_pages, &page_starts);
+  GList *rest_start = (int)page_starts.size() > num_first_pages
+    ? page_starts[num_first_pages] : nullptr;
+
+  // The date is cached on its first use. Make sure that this happens
+  // before it is read by the thread.
+  get_date();
+
+  // The rest of the document has not been laid out, so its shard runs
+  // to the end of the text.
+  PdfShard rest;
+  thread rest_thread;
+  if (rest_start)
+    {
+      LineLink *link = (LineLink*)rest_start->data;
+      rest.page_layout = *page_layout;
+      rest.font_description = pango_font_description_copy(pango_context_get_font_description(pango_context));
+      rest.num_pages = 0;
+      rest.surface_page_width = surface_page_width;
+      rest.surface_page_height = surface_page_height;
+      init_pdf_shard(&rest, rest_start, nullptr);
+      rest.text = string(link->para->text,
+                         page_layout->text + page_layout->text_length - link->para->text);
+      if (rest.text.empty() || !strchr("\n\r\f", rest.text.back()))
+        rest.text += '\n';
+      rest.num_lines = G_MAXINT;
+      rest.first_page_idx = num_first_pages + 1;
+      rest_thread = thread(render_pdf_shard, &rest);
+    }
+
+  // The first pages are drawn from the lines that were laid out above,
+  // on a PDF surface, as the main surface is, so with its font options.
+  string first_pdf;
+  cairo_surface_t *first_surface = cairo_pdf_surface_create_for_stream(&paps_cairo_string_write_func,
+                                                                       &first_pdf,
+                                                                       surface_page_width,
+                                                                       surface_page_height);
+  cairo_t *first_cr = cairo_create(first_surface);
+  cairo_scale(first_cr, page_layout->scale_x, page_layout->scale_y);
+  dict_t document_info;
+  build_document_info(page_layout, document_info);
+  document_info["num_pages"] = 0;
+  if (rest_start)
+    rest_start->prev->next = nullptr;
+  int num_pages = output_pages_pass(first_surface, first_cr, pango_lines, page_layout, pango_context,
+                                    document_info, 1, 0, false, nullptr, nullptr, nullptr);
+  if (rest_start)
+    rest_start->prev->next = rest_start;
+  cairo_destroy(first_cr);
+  cairo_surface_finish(first_surface);
+  cairo_surface_destroy(first_surface);
+  g_list_free_full(pango_lines, g_free);
+
+  fwrite(first_pdf.data(), first_pdf.size(), 1, output_fh);
+  fflush(output_fh);
+  first_page_time = g_get_monotonic_time();
+
+  if (rest_start)
+    {
+      rest_thread.join();
+      try
+        {
+          PdfReader reader(first_pdf.data(), first_pdf.size());
+          PdfMerger merger([](const char *data, size_t len) {
+              fwrite(data, len, 1, output_fh);
+            }, reader, first_pdf.size());
+          merger.add_document(rest.pdf.data(), rest.pdf.size());
+          num_pages += merger.num_pages();
+          merger.finish();
+        }
+      catch (const runtime_error& e)
+        {
+          fprintf(stderr, _("%1$s: Failed merging the PDF shards: %2$s\n"), g_get_prgname(), e.what());
+          exit(1);
+        }
+    }
+
+  return num_pages;
+}
+
+/* Set up the text of a shard that holds the lines from first up to, but
+ * not including, end. The text starts with the paragraph of the first
+ * line, and the state at that point is carried over in the page layout.
+ */
+void
+init_pdf_shard(PdfShard *shard, GList *first, GList *end)
+{
+  shard->skip_lines = 0;
+  shard->num_lines = 0;
+
+  // Lines are only missing for an empty document
+  if (!first)
+    return;
+
+  LineLink *first_link = (LineLink*)first->data;
+  LineLink *last_link = (LineLink*)(end ? end->prev : g_list_last(first))->data;
+  for (GList *l = first; l != end; l = l->next)
+    shard->num_lines++;
+  shard->skip_lines = first_link->para_line_idx;
+  shard->page_layout.ansi_state = first_link->para->ansi_state;
+  shard->page_layout.first_line_no = first_link->para->line_no;
+  shard->page_layout.starts_in_line = !first_link->para->starts_line;
+  shard->text = string(first_link->para->text,
+                       last_link->para->source_end - first_link->para->text);
+  if (shard->text.empty() || !strchr("\n\r\f", shard->text.back()))
+    shard->text += '\n';
+}
+
+/* Lay out the text of a shard again in pango_context, and return the
+ * lines of the shard. The paragraphs, that the lines refer to, are
+ * returned in paragraphs.
+ */
+GList *
+split_pdf_shard_lines(PdfShard *shard,
+                      PangoContext *pango_context,
+                      GList **paragraphs)
+{
+  PageLayout *page_layout = &shard->page_layout;
+
+  *paragraphs = split_text_into_paragraphs(pango_context,
+                                           page_layout,
+                                           page_layout->column_width,
+                                           shard->text.c_str());
+  GList *pango_lines = split_paragraphs_into_lines(page_layout, *paragraphs);
+
+  // Cut out the lines of the shard
+  GList *first = g_list_nth(pango_lines, shard->skip_lines);
+  if (first && first->prev)
+    {
+      first->prev->next = nullptr;
+      first->prev = nullptr;
+      g_list_free_full(pango_lines, g_free);
+    }
+  GList *end = g_list_nth(first, shard->num_lines);
+  if (end)
+    {
+      end->prev->next = nullptr;
+      end->prev = nullptr;
+      g_list_free_full(end, g_free);
+    }
+
+  return first;
+}
+
+/* Render the pages of a shard into a PDF. This runs in a thread of its
+ * own, so the shard gets its own surface and pango context, and the
+ * text of the shard is laid out again in that context.
+ */
+void
+render_pdf_shard(PdfShard *shard)
+{
+  PageLayout *page_layout = &shard->page_layout;
+  cairo_surface_t *surface = cairo_pdf_surface_create_for_stream(&paps_cairo_string_write_func,
+                                                                 &shard->pdf,
+                                                                 shard->surface_page_width,
+                                                                 shard->surface_page_height);
+  cairo_t *cr = cairo_create(surface);
+  PangoContext *pango_context = create_pango_context(cr, page_layout->pango_dir);
+  pango_context_set_font_description(pango_context, shard->font_description);
+
+  GList *paragraphs;
+  GList *first = split_pdf_shard_lines(shard, pango_context, &paragraphs);
+
+  dict_t document_info;
+  build_document_info(page_layout, document_info);
+  document_info["num_pages"] = shard->num_pages;
+  output_pages_pass(surface, cr, first, page_layout, pango_context,
+                    document_info, shard->first_page_idx, shard->num_pages,
+                    false, nullptr, nullptr, nullptr);
+
+  cairo_destroy(cr);
+  cairo_surface_finish(surface);
+  cairo_surface_destroy(surface);
+  g_list_free_full(first, g_free);
+  free_paragraphs(paragraphs);
+  g_object_unref(pango_context);
+  pango_font_description_free(shard->font_description);
+}
+
+/* Check that every page, when it is laid out on its own the way that
+ * render_pdf_shard() does it, has the same lines, glyph positions and
+ * page break as in the layout of the whole document. The first
+ * difference is reported. Returns whether the layouts are the same.
+ */
+bool
+verify_layout(cairo_surface_t *surface,
+              cairo_t       *cr,
+              GList         *pango_lines,
+              PageLayout *page_layout,
+              PangoContext  *pango_context,
+              double         surface_page_width,
+              double         surface_page_height)
+{
+  dict_t document_info;
+  vector<GList*> page_starts;
+
+  build_document_info(page_layout, document_info);
+  document_info["num_pages"] = 0;
+  int num_pages = output_pages_pass(surface, cr, pango_lines, page_layout, pango_context,
+                                    document_info, 1, -1, true, &page_starts,
+                                    nullptr, nullptr);
+
+  // Nothing is written, but it must be a PDF surface to get the same
+  // font options as a shard.
+  cairo_surface_t *shard_surface = cairo_pdf_surface_create_for_stream(nullptr,
+                                                                       nullptr,
+                                                                       surface_page_width,
+                                                                       surface_page_height);
+  cairo_t *shard_cr = cairo_create(shard_surface);
+  cairo_scale(shard_cr, page_layout->scale_x, page_layout->scale_y);
+  PangoContext *shard_context = create_pango_context(shard_cr, page_layout->pango_dir);
+  pango_context_set_font_description(shard_context, pango_context_get_font_description(pango_context));
+
+  string error;
+  int num_lines = 0;
+  for (int page_idx=1; page_idx<=num_pages && error.empty(); page_idx++)
+    {
+      GList *first = page_starts[page_idx-1];
+      GList *end = page_idx < num_pages ? page_starts[page_idx] : nullptr;
+      if (!first)
+        break;
+
+      PdfShard shard;
+      shard.page_layout = *page_layout;
+      init_pdf_shard(&shard, first, end);
+
+      GList *paragraphs;
+      GList *shard_lines = split_pdf_shard_lines(&shard, shard_context, &paragraphs);
+      const char *ref_base = ((LineLink*)first->data)->para->text;
+      const char *shard_base = shard_lines ? ((LineLink*)shard_lines->data)->para->text : nullptr;
+
+      GList *l, *sl;
+      for (l = first, sl = shard_lines; l != end; l = l->next, sl = sl->next, num_lines++)
+        {
+          if (!sl)
+            {
+              error = format("page {} has only {} of {} lines", page_idx,
+                             g_list_length(shard_lines), shard.num_lines);
+              break;
+            }
+          error = compare_line_links((LineLink*)l->data, ref_base,
+                                     (LineLink*)sl->data, shard_base);
+          if (!error.empty())
+            {
+              error = format("line {} of page {}: {}", g_list_position(first, l) + 1,
+                             page_idx, error);
+              break;
+            }
+        }
+
+      // The lines of the page must fit on exactly one page
+      if (error.empty() && shard_lines)
+        {
+          dict_t shard_info;
+          vector<GList*> shard_starts;
+          build_document_info(&shard.page_layout, shard_info);
+          shard_info["num_pages"] = num_pages;
+          output_pages_pass(shard_surface, shard_cr, shard_lines, &shard.page_layout,
+                            shard_context, shard_info, page_idx, num_pages, true,
+                            &shard_starts, nullptr, nullptr);
+          if (shard_starts.size() != 1)
+            error = format("page {} breaks after line {} instead of at its end",
+                           page_idx, g_list_position(shard_lines, shard_starts[1]));
+        }
+
+      g_list_free_full(shard_lines, g_free);
+      free_paragraphs(paragraphs);
+    }
+
+  g_object_unref(shard_context);
+  cairo_destroy(shard_cr);
+  cairo_surface_destroy(shard_surface);
+
+  if (!error.empty())
+    {
+      fprintf(stderr, _("%1$s: The layout differs at %2$s\n"), g_get_prgname(), error.c_str());
+      return false;
+    }
+
+  fprintf(stderr, _("%1$s: The layout of %2$d pages and %3$d lines is the same.\n"),
+          g_get_prgname(), num_pages, num_lines);
+  return true;
+}
+
+/* Compare a line of the document with the same line of another layout.
+ * The text positions are relative to the bases, and the positions of the
+ * glyphs may differ by a hundredth of a point. Returns a description of
+ * the first difference, or an empty string if there is none.
+ */
+string
+compare_line_links(LineLink *ref,
+                   const char *ref_base,
+                   LineLink *other,
+                   const char *other_base)
+{
+  const int tolerance = PANGO_SCALE / 100;
+  PangoLayoutLine *ref_line = ref->pango_line;
+  PangoLayoutLine *other_line = other->pango_line;
+
+  if (ref->para->text - ref_base != other->para->text - other_base
+      || ref->para_line_idx != other->para_line_idx
+      || ref_line->start_index != other_line->start_index
+      || ref_line->length != other_line->length)
+    return format("the line break differs, text at {}+{} instead of {}+{}",
+                  ref->para->text - ref_base + ref_line->start_index, ref_line->length,
+                  other->para->text - other_base + other_line->start_index, other_line->length);
+  if (ref->formfeed != other->formfeed || ref->wrapped != other->wrapped)
+    return "the form feed or wrap mark differs";
+  if (abs(ref->logical_rect.width - other->logical_rect.width) > tolerance
+      || abs(ref->logical_rect.height - other->logical_rect.height) > tolerance
+      || abs(ref->logical_rect.y - other->logical_rect.y) > tolerance)
+    return format("the extents differ, {}x{} instead of {}x{}",
+                  (double)ref->logical_rect.width / PANGO_SCALE,
+                  (double)ref->logical_rect.height / PANGO_SCALE,
+                  (double)other->logical_rect.width / PANGO_SCALE,
+                  (double)other->logical_rect.height / PANGO_SCALE);
+
+  int x_pos = 0;
+  int glyph_idx = 0;
+  GSList *run_list, *other_run_list;
+  for (run_list = ref_line->runs, other_run_list = other_line->runs;
+       run_list && other_run_list;
+       run_list = run_list->next, other_run_list = other_run_list->next)
+    {
+      PangoGlyphString *glyphs = ((PangoLayoutRun*)run_list->data)->glyphs;
+      PangoGlyphString *other_glyphs = ((PangoLayoutRun*)other_run_list->data)->glyphs;
+      if (glyphs->num_glyphs != other_glyphs->num_glyphs)
+        return format("the shaping differs, {} instead of {} glyphs in a run",
+                      glyphs->num_glyphs, other_glyphs->num_glyphs);
+      for (int i=0; i<glyphs->num_glyphs; i++, glyph_idx++)
+        {
+          PangoGlyphInfo *info = &glyphs->glyphs[i];
+          PangoGlyphInfo *other_info = &other_glyphs->glyphs[i];
+          if (info->glyph != other_info->glyph)
+            return format("glyph {} differs", glyph_idx);
+          if (abs(info->geometry.x_offset - other_info->geometry.x_offset) > tolerance
+              || abs(info->geometry.y_offset - other_info->geometry.y_offset) > tolerance
+              || abs(info->geometry.width - other_info->geometry.width) > tolerance)
+            return format("glyph {} at x={} is displaced by {},{}", glyph_idx,
+                          (double)x_pos / PANGO_SCALE,
+                          (double)(other_info->geometry.x_offset - info->geometry.x_offset) / PANGO_SCALE,
+                          (double)(other_info->geometry.y_offset - info->geometry.y_offset) / PANGO_SCALE);
+          x_pos += info->geometry.width;
+        }
+    }
+  if (run_list || other_run_list)
+    return "the number of runs differs";
+
+  return "";
+}
+
+/* Return the number of pages of the existing PDF file that the output
+ * is appended to. */
+int
+append_pdf_page_count(const char *filename)
+{
+  GError *error = nullptr;
+  GMappedFile *mapped = g_mapped_file_new(filename, false, &error);
+  if (!mapped)
+    {
+      fprintf(stderr, _("%s: Failed to open %s: %s\n"), g_get_prgname (), filename, error->message);
+      exit(1);
+    }
+
+  int num_pages = 0;
+  try
+    {
+      PdfReader reader(g_mapped_file_get_contents(mapped),
+                       g_mapped_file_get_length(mapped));
+      num_pages = reader.page_count();
+    }
+  catch (const runtime_error& e)
+    {
+      fprintf(stderr, _("%s: Failed to read %s: %s\n"), g_get_prgname (), filename, e.what());
+      exit(1);
+    }
+  g_mapped_file_unref(mapped);
+
+  return num_pages;
+}
+
+/* Append the pages of the rendered pdf to the existing PDF file as an
+ * incremental update. The update is built completely before the file
+ * is opened for appending, so a failure leaves the file untouched.
+ */
+void
+append_pdf_update(const char *filename, const string& pdf)
+{
+  GError *error = nullptr;
+  GMappedFile *mapped = g_mapped_file_new(filename, false, &error);
+  if (!mapped)
+    {
+      fprintf(stderr, _("%s: Failed to open %s: %s\n"), g_get_prgname (), filename, error->message);
+      exit(1);
+    }
+  const char *base = g_mapped_file_get_contents(mapped);
+  size_t base_size = g_mapped_file_get_length(mapped);
+
+  string update;
+  try
+    {
+      // The update has to start on a line of its own
+      if (base_size == 0 || !strchr("\n\r", base[base_size-1]))
+        update = "\n";
+
+      PdfReader reader(base, base_size);
+      PdfMerger merger([&update](const char *data, size_t len) {
+          update.append(data, len);
+        }, reader, base_size + update.size());
+      merger.add_document(pdf.data(), pdf.size());
+      merger.finish();
+    }
+  catch (const runtime_error& e)
+    {
+      fprintf(stderr, _("%s: Failed to append to %s: %s\n"), g_get_prgname (), filename, e.what());
+      exit(1);
+    }
+  g_mapped_file_unref(mapped);
+
+  FILE *fh = fopen(filename, "ab");
+  if (!fh
+      || fwrite(update.data(), update.size(), 1, fh) != 1
+      || fclose(fh) != 0)
+    {
+      fprintf(stderr, _("%s: Failed to write to %s!\n"), g_get_prgname (), filename);
+      exit(1);
+    }
+}
+
+/* Write the rendered pdf to the output as a linearized PDF */
+void
+write_linearized_pdf(const string& pdf)
+{
+  try
+    {
+      pdf_linearize(pdf.data(), pdf.size(), [](const char *data, size_t len) {
+          fwrite(data, len, 1, output_fh);
+        });
+    }
+  catch (const runtime_error& e)
+    {
+      fprintf(stderr, _("%s: Failed to linearize the PDF output: %s\n"), g_get_prgname (), e.what());
+      exit(1);
+    }
+}
+
+/* Compute the positions of the columns, in pango units, from the margins,
+ * the gutters and the widths of the columns and of the line numbers.
+ * This must be called again when any of them changes.
+ */
+void
+compute_page_geometry(PageLayout *page_layout)
+{
+  int num_columns = page_layout->num_columns;
+  int column_pitch = (page_layout->column_width
+                      + page_layout->line_number_width
+                      + page_layout->gutter_width) * PANGO_SCALE;
+  bool rtl = page_layout->pango_dir == PANGO_DIRECTION_RTL;
+
+  page_layout->column_x.resize(num_columns);
+  page_layout->separator_x.assign(num_columns, 0);
+  for (int i=0; i<num_columns; i++)
+    {
+      /* Do RTL column layout for RTL direction */
+      int pos = rtl ? num_columns - 1 - i : i;
+      int x = page_layout->left_margin * PANGO_SCALE + pos * column_pitch;
+
+      /* The line numbers are in front of the lines, which is on the
+       * left of an LTR column and on the right of an RTL one */
+      if (!rtl)
+        x += page_layout->line_number_width * PANGO_SCALE;
+      page_layout->column_x[i] = x;
+
+      /* The separation line is in the middle of the gutter towards the
+       * previous column */
+      if (i > 0)
+        {
+          int gutter_end = page_layout->left_margin * PANGO_SCALE
+            + (rtl ? pos + 1 : pos) * column_pitch;
+          page_layout->separator_x[i] = gutter_end - page_layout->gutter_width * PANGO_SCALE / 2;
+        }
+    }
+
+  page_layout->body_y = (page_layout->top_margin + page_layout->header_sep) * PANGO_SCALE;
+  page_layout->pango_column_width = page_layout->column_width * PANGO_SCALE;
+  page_layout->pango_column_height = page_layout->column_height * PANGO_SCALE;
+  page_layout->line_pitch = page_layout->lpi > 0.0L
+    ? (int)(1.0 / page_layout->lpi * 72.0 * PANGO_SCALE) : 0;
+
+  if (rtl)
+    page_layout->line_number_dx = (page_layout->column_width + page_layout->line_number_width) * PANGO_SCALE;
+  else
+    page_layout->line_number_dx = -page_layout->line_number_width * PANGO_SCALE
+      / (page_layout->line_number_digits + 1);
+}
+
+void eject_column(cairo_t *cr,
+                  int title_height,
+                  PageLayout *page_layout,
+                  int column_idx,
+                  bool measure_only)
+{
+  double x_pos, y_top, y_bot;
+
+#if 0
+  fprintf(stderr, "do_draw_separation_line column_idx = %d %d\n", page_layout->do_draw_separation_line, column_idx);
+#endif
+  if (!page_layout->do_draw_separation_line)
+    return;
+
+  x_pos = (double)page_layout->separator_x[column_idx] / PANGO_SCALE;
+  y_top = page_layout->top_margin + page_layout->header_height + page_layout->header_sep / 2
+        + (double)title_height / PANGO_SCALE;
+  y_bot = page_layout->page_height - page_layout->bottom_margin - page_layout->footer_height;
+
+  if (!measure_only)
+    {
+      cairo_move_to(cr,x_pos, y_top);
+      cairo_line_to(cr,x_pos, y_bot);
+      cairo_set_line_width(cr, 0.1);
+      cairo_stroke(cr);
+    }
+}
+
+void eject_page(cairo_t *cr)
+{
+  cairo_show_page(cr);
+}
+
+void start_page(cairo_surface_t *surface,
+                cairo_t *cr,
+                PageLayout *page_layout,
+                bool measure_only)
+{
+  // A measuring pass may run in the middle of the document, e.g. from
+  // output_pages() and paps_next_page(), so it must not emit DSC
+  // comments or change the transformation of the page being drawn.
+  if (measure_only)
+    return;
+
+  cairo_identity_matrix(cr);
+
+  if (output_format == FORMAT_POSTSCRIPT)
+    {
+      char buf[CAIRO_COMMENT_MAX];
+      int x, y;
+
+      if (page_layout->do_landscape)
+        {
+          x = (int)page_layout->page_height;
+          y = (int)page_layout->page_width;
+        }
+      else
+        {
+          x = (int)page_layout->page_width;
+          y = (int)page_layout->page_height;
+        }
+      cairo_ps_surface_dsc_begin_page_setup (surface);
+    
+      snprintf(buf, CAIRO_COMMENT_MAX, "%%%%PageBoundingBox: 0 0 %d %d", x, y);
+      cairo_ps_surface_dsc_comment (surface, buf);
+    }
+
+  if (page_layout->do_landscape)
+    {
+      if (output_format == FORMAT_POSTSCRIPT)
+        {
+          cairo_ps_surface_dsc_comment (surface, "%%PageOrientation: Landscape");
+          cairo_translate(cr, 0, page_layout->page_width);
+          cairo_rotate(cr, -G_PI_2);
+        }
+    }
+  else
+    {
+      if (output_format == FORMAT_POSTSCRIPT)
+        cairo_ps_surface_dsc_comment (surface, "%%PageOrientation: Portrait");
+    }
+}
+
+void
+draw_line_to_page(cairo_t *cr,
+                  int column_idx,
+                  int column_pos,
+                  PageLayout *page_layout,
+                  PangoLayoutLine *line,
+                  bool draw_wrap_character,
+                  int line_no)
+{
+  /* Assume square aspect ratio for now */
+  int column_x = page_layout->column_x[column_idx];
+  int x = column_x;
+  double y_pos = (double)(page_layout->body_y + column_pos) / PANGO_SCALE;
+  PangoRectangle ink_rect, logical_rect;
+
+  /* The line numbers are right aligned in a gutter on the side of the
+   * column where the lines start. */
+  if (line_no && page_layout->line_number_width)
+    draw_line_number(cr, pango_layout_get_context(line->layout), line_no,
+                     (double)(column_x + page_layout->line_number_dx) / PANGO_SCALE,
+                     y_pos);
+  
+  pango_layout_line_get_extents(line,
+                                &ink_rect,
+                                &logical_rect);
+
+  if (page_layout->pango_dir == PANGO_DIRECTION_RTL)
+    x += page_layout->pango_column_width - logical_rect.width;
+
+  cairo_move_to(cr, (double)x / PANGO_SCALE, y_pos);
+  pango_cairo_show_layout_line(cr, line);
+
+  if (draw_wrap_character)
+    {
+      cairo_set_font_face(cr, paps_glyph_face);
+      cairo_set_font_size(cr, glyph_font_size);
+
+      if (page_layout->pango_dir == PANGO_DIRECTION_LTR)
+        {
+          cairo_move_to(cr, (double)(column_x + page_layout->pango_column_width) / PANGO_SCALE, y_pos);
+          cairo_show_text(cr, "R");
+        }
+      else
+        {
+          cairo_move_to(cr, (double)column_x / PANGO_SCALE, y_pos); 
+          cairo_show_text(cr, "L");
+        }
+    }
+}
+
+/* The glyphs of the digits in the font of the text. They are shaped
+ * once for every document, and again only when its font changes, and
+ * then used for all the line numbers. They are kept with the pango
+ * context of the document, and not with the surface, so that the pages
+ * that are recorded on surfaces of their own share them.
+ */
+struct DigitGlyphs {
+  PangoFontDescription *font_desc;
+  cairo_scaled_font_t *scaled_font;
+  unsigned long glyphs[10];
+  double advances[10];
+};
+
+static const char *digit_glyphs_key = "paps-digit-glyphs";
+
+static void
+free_digit_glyphs(void *data)
+{
+  DigitGlyphs *digits = (DigitGlyphs*)data;
+  if (digits->font_desc)
+    pango_font_description_free(digits->font_desc);
+  if (digits->scaled_font)
+    cairo_scaled_font_destroy(digits->scaled_font);
+  g_free(digits);
+}
+
+static DigitGlyphs *
+get_digit_glyphs(PangoContext *ctx)
+{
+  const PangoFontDescription *font_desc = pango_context_get_font_description(ctx);
+  DigitGlyphs *digits = (DigitGlyphs*)g_object_get_data(G_OBJECT(ctx), digit_glyphs_key);
+  if (digits && pango_font_description_equal(digits->font_desc, font_desc))
+    return digits;
+
+  digits = g_new0(DigitGlyphs, 1);
+  digits->font_desc = pango_font_description_copy(font_desc);
+  PangoLayout *layout = pango_layout_new(ctx);
+  pango_layout_set_text(layout, "0123456789", -1);
+  PangoLayoutLine *line = pango_layout_get_line_readonly(layout, 0);
+  int idx = 0;
+  for (GSList *run_list = line->runs; run_list; run_list = run_list->next)
+    {
+      PangoLayoutRun *run = (PangoLayoutRun*)run_list->data;
+      if (!digits->scaled_font)
+        digits->scaled_font = cairo_scaled_font_reference(
+            pango_cairo_font_get_scaled_font(PANGO_CAIRO_FONT(run->item->analysis.font)));
+      for (int i=0; i<run->glyphs->num_glyphs && idx < 10; i++, idx++)
+        {
+          digits->glyphs[idx] = run->glyphs->glyphs[i].glyph;
+          digits->advances[idx] = (double)run->glyphs->glyphs[i].geometry.width / PANGO_SCALE;
+        }
+    }
+  g_object_unref(layout);
+
+  g_object_set_data_full(G_OBJECT(ctx), digit_glyphs_key, digits, free_digit_glyphs);
+  return digits;
+}
+
+/* Draw a line number that ends at x_end, with the pre-shaped glyphs */
+void
+draw_line_number(cairo_t *cr,
+                 PangoContext *ctx,
+                 int line_no,
+                 double x_end,
+                 double y_pos)
+{
+  DigitGlyphs *digits = get_digit_glyphs(ctx);
+  if (!digits->scaled_font)
+    return;
+
+  char number[16];
+  int len = snprintf(number, sizeof(number), "%d", line_no);
+  cairo_glyph_t glyphs[16];
+  double x_pos = x_end;
+  for (int i=len-1; i>=0; i--)
+    {
+      int d = number[i] - '0';
+      x_pos -= digits->advances[d];
+      glyphs[i].index = digits->glyphs[d];
+      glyphs[i].x = x_pos;
+      glyphs[i].y = y_pos;
+    }
+  cairo_set_scaled_font(cr, digits->scaled_font);
+  cairo_show_glyphs(cr, glyphs, len);
+}
+
+/*
+ * Provide date string from current locale converted to UTF-8.
+ */
+string
+get_date()
+{
+  time_t t = time(nullptr);
+  GIConv cvh = nullptr;
+  GString *inbuf;
+  char *ib, *ob, obuffer[BUFSIZE * 6], *bp;
+  gsize iblen, oblen;
+  static char *date_utf8 = nullptr;
+
+  if (date_utf8 == nullptr) {
+    char date[256];
+    t = time(nullptr);
+    strftime(date, sizeof(date), "%c", localtime(&t));
+
+    cvh = g_iconv_open("UTF-8", get_encoding());
+    if (cvh == (GIConv)-1) {
+      fprintf(stderr, _("%s: Invalid encoding: %s\n"), g_get_prgname(), get_encoding());
+      exit(1);
+    }
+
+    inbuf = g_string_new(nullptr);
+    ib = bp = date;
+    iblen = strlen(ib);
+    ob = bp = obuffer;
+    oblen = BUFSIZE * 6 - 1;
+
+    if (g_iconv(cvh, &ib, &iblen, &ob, &oblen) == (gsize)-1) {
+      fprintf(stderr, _("%1$s: Error while converting date string from '%2$s' to UTF-8.\n"),
+        g_get_prgname(), get_encoding());
+      /* Return the unconverted string. */
+      /*
+       * inbuf isn't used here, but a few memory is
+       * allocated by default. so it should be freed anyway.
+       */
+      (void) g_string_free(inbuf, true);
+      g_iconv_close(cvh);
+      return date;
+    }
+
+    obuffer[BUFSIZE * 6 - 1 - oblen] = 0;
+    g_string_append(inbuf, bp);
+
+    date_utf8 = g_string_free(inbuf, false);
+    g_iconv_close(cvh);
+  }
+
+  return date_utf8;
+}
+
+int
+draw_page_header_line_to_page(cairo_t         *cr,
+                              bool             is_footer,
+                              PageLayout   *page_layout,
+                              PangoContext    *ctx,
+                              int              page,
+                              int              num_pages,
+                              dict_t&          document_info,
+                              bool             measure_only)
+{
+  PangoLayoutLine *line;
+  PangoRectangle ink_rect={0,0,0,0}, logical_rect = {0,0,0,0};
+  /* Assume square aspect ratio for now */
+  double x_pos, y_pos;
+  int height;
+  gdouble line_pos;
+
+  /* Reset gravity?? */
+
+  // The left, center and right parts
+  compile_header_formats(page_layout);
+  const CompiledFormat *part_formats = &page_layout->header_formats[is_footer ? 3 : 0];
+  HeaderLayouts *layouts = get_header_layouts(ctx, page_layout);
+  PangoLayout **part_layouts = &layouts->parts[is_footer ? 3 : 0];
+
+  // The parts that are the same on all pages, and the separator line,
+  // are drawn once into a form that is then painted on every page.
+  bool part_is_static[3];
+  bool has_static = page_layout->do_draw_separation_line;
+  for (int i=0; i<3; i++)
+    {
+      part_is_static[i] = !part_formats[i].references("page_idx");
+      has_static |= part_is_static[i] && !part_formats[i].empty();
+    }
+  cairo_pattern_t **form = nullptr;
+  cairo_t *form_cr = nullptr;
+  if (!measure_only && has_static)
+    {
+      form = get_header_form(cr, is_footer);
+      if (!*form)
+        {
+          cairo_rectangle_t extents = { 0, 0,
+                                        (double)page_layout->page_width,
+                                        (double)page_layout->page_height };
+          cairo_surface_t *recording = cairo_recording_surface_create(CAIRO_CONTENT_COLOR_ALPHA, &extents);
+          form_cr = cairo_create(recording);
+          cairo_surface_destroy(recording);
+        }
+    }
+  auto show_part = [&](int part, PangoLayoutLine *line) {
+    if (measure_only)
+      return;
+    cairo_t *part_cr = part_is_static[part] ? form_cr : cr;
+    if (!part_cr)
+      return;
+    cairo_move_to(part_cr, x_pos, y_pos);
+    pango_cairo_show_layout_line(part_cr, line);
+  };
+
+  // Only the parts that refer to the page are formatted and shaped again
+  // on every page. Those that refer to the number of pages are shaped
+  // again when it changes, i.e. after the measuring passes.
+  for (int i=0; i<3; i++)
+    if (!part_layouts[i]
+        || part_formats[i].references("page_idx")
+        || part_formats[i].references("num_pages"))
+      set_header_part_markup(ctx, page_layout, document_info, layouts, (is_footer ? 3 : 0) + i);
+
+  /* The title is in the center */
+  line = pango_layout_get_line(part_layouts[0], 0);
+  pango_layout_line_get_extents(line,
+                                &ink_rect,
+                                &logical_rect);
+  x_pos = page_layout->left_margin;
+
+  height = logical_rect.height / PANGO_SCALE /3.0;
+
+  /* The header is placed right after the margin */
+  if (is_footer)
+    {
+      y_pos = page_layout->page_height - page_layout->bottom_margin*0.5;
+      page_layout->footer_height = height;
+    }
+  else
+    {
+      y_pos = page_layout->top_margin + height;
+      page_layout->header_height = height;
+    }
+
+  show_part(0, line);
+
+  /* output a right edge of header/footer */
+  line = pango_layout_get_line(part_layouts[1], 0);
+  pango_layout_line_get_extents(line,
+                                &ink_rect,
+                                &logical_rect);
+  /* pagenum_rect = logical_rect; */
+  x_pos = page_layout->left_margin + (page_layout->page_width-page_layout->left_margin-page_layout->right_margin)*0.5 - 0.5*logical_rect.width/PANGO_SCALE;
+  show_part(1, line);
+
+  /* output a "center" of header/footer */
+  line = pango_layout_get_line(part_layouts[2], 0);
+  pango_layout_line_get_extents(line,
+                                &ink_rect,
+                                &logical_rect);
+  x_pos = page_layout->page_width - page_layout->right_margin - (logical_rect.width / PANGO_SCALE );
+
+  //  x_pos = page_layout->page_width - page_layout->right_margin -
+  //      ((logical_rect.width + pagenum_rect.width) / PANGO_SCALE + page_layout->gutter_width);
+  show_part(2, line);
+
+  /* header separator */
+  if (form_cr && page_layout->do_draw_separation_line)
+    {
+      if (is_footer)
+        line_pos = page_layout->page_height - page_layout->bottom_margin * 1.1;
+      else
+        line_pos = page_layout->top_margin + page_layout->header_height + page_layout->header_sep;
+      line_pos += logical_rect.height/2.0/PANGO_SCALE;
+      cairo_move_to(form_cr, page_layout->left_margin, line_pos);
+      cairo_line_to(form_cr,page_layout->page_width - page_layout->right_margin, line_pos);
+      cairo_set_line_width(form_cr,0.1); // TBD
+      cairo_stroke(form_cr);
+    }
+
+  if (form_cr)
+    {
+      *form = cairo_pattern_create_for_surface(cairo_get_target(form_cr));
+      cairo_destroy(form_cr);
+    }
+  if (form)
+    {
+      cairo_save(cr);
+      cairo_set_source(cr, *form);
+      cairo_paint(cr);
+      cairo_restore(cr);
+    }
+
+  return logical_rect.height;
+}
+
+// The forms with the static parts of the header and the footer. They
+// are kept with the surface that they are painted on, so that every
+// surface, e.g. of a shard, gets forms of its own.
+static cairo_user_data_key_t header_forms_key;
+
+static void
+free_header_forms(void *data)
+{
+  cairo_pattern_t **forms = (cairo_pattern_t**)data;
+  for (int i=0; i<2; i++)
+    if (forms[i])
+      cairo_pattern_destroy(forms[i]);
+  g_free(forms);
+}
+
+static cairo_pattern_t **
+get_header_form(cairo_t *cr, bool is_footer)
+{
+  cairo_surface_t *target = cairo_get_target(cr);
+  cairo_pattern_t **forms = (cairo_pattern_t**)cairo_surface_get_user_data(target, &header_forms_key);
+  if (!forms)
+    {
+      forms = g_new0(cairo_pattern_t*, 2);
+      cairo_surface_set_user_data(target, &header_forms_key, forms, free_header_forms);
+    }
+  return &forms[is_footer ? 1 : 0];
+}
+
+static const char *header_layouts_key = "paps-header-layouts";
+
+static void
+free_header_layouts(void *data)
+{
+  HeaderLayouts *layouts = (HeaderLayouts*)data;
+  for (int i=0; i<6; i++)
+    if (layouts->parts[i])
+      g_object_unref(layouts->parts[i]);
+  delete layouts;
+}
+
+static HeaderLayouts *
+get_header_layouts(PangoContext *ctx, PageLayout *page_layout)
+{
+  HeaderLayouts *layouts = (HeaderLayouts*)g_object_get_data(G_OBJECT(ctx), header_layouts_key);
+  if (!layouts || layouts->page_layout != page_layout)
+    {
+      layouts = new HeaderLayouts();
+      layouts->page_layout = page_layout;
+      g_object_set_data_full(G_OBJECT(ctx), header_layouts_key, layouts, free_header_layouts);
+    }
+  return layouts;
+}
+
+// Format a part of the header or the footer, and shape it into its
+// layout, unless it is unchanged.
+static void
+set_header_part_markup(PangoContext  *ctx,
+                       PageLayout    *page_layout,
+                       dict_t&        document_info,
+                       HeaderLayouts *layouts,
+                       int            part)
+{
+  string markup;
+  try
+    {
+      markup = format("<span font_desc=\"{}\">{}</span>",
+                      page_layout->header_font_desc,
+                      page_layout->header_formats[part].format(document_info));
+    }
+  catch (const runtime_error& e)
+    {
+      fprintf(stderr, _("%1$s: Failed formatting the header or footer: %2$s\n"), g_get_prgname(), e.what());
+      exit(1);
+    }
+
+  if (layouts->parts[part] && markup == layouts->markup[part])
+    return;
+  if (!layouts->parts[part])
+    layouts->parts[part] = pango_layout_new(ctx);
+  pango_layout_set_markup(layouts->parts[part], markup.c_str(), -1);
+  layouts->markup[part] = markup;
+}
+
+// The template of a part of the header or the footer, from left to right
+static string
+header_template(PageLayout *page_layout, bool is_footer, int part)
+{
+  const char *templ;
+  if (is_footer)
+    templ = part == 0 ? page_layout->footer_left
+      : part == 1 ? page_layout->footer_center
+      : page_layout->footer_right;
+  else
+    templ = part == 0 ? page_layout->header_left
+      : part == 1 ? page_layout->header_center
+      : page_layout->header_right;
+  if (templ)
+    return templ;
+
+  if (is_footer)
+    return "";
+  if (part == 0)
+    return get_date();
+  if (part == 1)
+    return page_layout->filename;
+  return "{page_idx}";
+}
+
+// Parse the header and footer templates once, so that the fields that
+// they use are known before the document info is built.
+static void
+compile_header_formats(PageLayout *page_layout)
+{
+  if (!page_layout->header_formats.empty())
+    return;
+
+  try
+    {
+      for (int i=0; i<6; i++)
+        page_layout->header_formats.emplace_back(header_template(page_layout, i >= 3, i % 3));
+    }
+  catch (const runtime_error& e)
+    {
+      fprintf(stderr, _("%1$s: Invalid header or footer template: %2$s\n"), g_get_prgname(), e.what());
+      exit(1);
+    }
+}
+
+// The fields of the document info that the templates of the drawn
+// headers and footers refer to
+set<string>
+document_info_keys(PageLayout *page_layout)
+{
+  set<string> keys;
+
+  compile_header_formats(page_layout);
+  for (int i=0; i<6; i++)
+    if (i < 3 ? page_layout->do_draw_header : page_layout->do_draw_footer)
+      keys.insert(page_layout->header_formats[i].keys().begin(),
+                  page_layout->header_formats[i].keys().end());
+  return keys;
+}
+
+// Build the document info hash table that may be used in the headers
+// and footers. Only the fields that the templates of the drawn headers
+// and footers refer to are filled in. They are computed once and then
+// kept in the page layout.
+void
+build_document_info(PageLayout* page_layout,
+                    dict_t& document_info)
+{
+  if (!page_layout->document_info_built)
+    {
+      set<string> keys = document_info_keys(page_layout);
+      dict_t& info = page_layout->document_info;
+      if (keys.count("filename"))
+        info["filename"] = page_layout->filename;
+      if (keys.count("path"))
+        info["path"] = page_layout->filename_path;
+      if (keys.count("now") || keys.count("mtime"))
+        info["now"] = time(nullptr);
+      if (keys.count("mtime"))
+        {
+          // The input from stdin is as new as the output
+          GStatBuf stat_buf;
+          if (page_layout->filename_path != "stdin"
+              && g_stat(page_layout->filename_path.c_str(), &stat_buf) == 0)
+            info["mtime"] = (time_t)stat_buf.st_mtime;
+          else
+            info["mtime"] = info["now"];
+        }
+      if (keys.count("size"))
+        info["size"] = (int)MIN(page_layout->text_length, (size_t)G_MAXINT);
+      if (keys.count("lines"))
+        {
+          int num_lines = 0;
+          const char *end = page_layout->text + page_layout->text_length;
+          for (const char *p = page_layout->text;
+               (p = (const char*)memchr(p, '\n', end - p)) != nullptr;
+               p++)
+            num_lines++;
+          info["lines"] = num_lines;
+        }
+      if (keys.count("checksum"))
+        {
+          gchar *checksum = g_compute_checksum_for_data(G_CHECKSUM_SHA256,
+                                                        (const guchar*)page_layout->text,
+                                                        page_layout->text_length);
+          info["checksum"] = string(checksum);
+          g_free(checksum);
+        }
+      page_layout->document_info_built = true;
+    }
+
+  document_info = page_layout->document_info;
+}
+
+string fn_basename(const string& filename)
+{
+  return basename((char*)filename.c_str());
+}
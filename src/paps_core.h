@@ -0,0 +1,370 @@
+/*
+ * paps_core.h: The rendering core of paps, that paps, libpaps and
+ * paps_bench are linked with.
+ *
+ * Copyright (C) 2002, 2005, 2022 Dov Grobgeld <dov.grobgeld@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ *
+ */
+#ifndef PAPS_CORE_H
+#define PAPS_CORE_H
+
+#include <config.h>
+#include <pango/pango.h>
+#include <pango/pangocairo.h>
+#include <pango/pangofc-fontmap.h>
+#include <cairo/cairo.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <string>
+#include <vector>
+#include <set>
+#include "format_from_dict.h"
+
+#if ENABLE_NLS
+#include <libintl.h>
+
+#define	_(str)		gettext(str)
+#ifdef gettext_noop
+#define N_(str)		gettext_noop(str)
+#else
+#define N_(str)		(str)
+#endif
+
+#else	/* NLS is disabled */
+#define _(str)		(str)
+#define N_(str)		(str)
+#endif
+
+#define MIN_FIT_FONT_SIZE 4     // The smallest font size that --fit-pages tries
+#define DEFAULT_FONT_FAMILY     "Monospace"
+#define DEFAULT_FONT_SIZE       "12"
+#define HEADER_FONT_FAMILY      "Monospace Bold"
+#define HEADER_FONT_SCALE       "12"
+#define MAKE_FONT_NAME(f,s)     f " " s
+
+#define	MARGIN_LEFT     36
+#define	MARGIN_RIGHT    36
+#define	MARGIN_TOP      36
+#define	MARGIN_BOTTOM   36
+
+
+typedef enum {
+    PAPER_TYPE_A4 = 0,
+    PAPER_TYPE_US_LETTER = 1,
+    PAPER_TYPE_US_LEGAL = 2,
+    PAPER_TYPE_A3 = 3
+} paper_type_t ;
+
+typedef enum {
+    FORMAT_POSTSCRIPT = 0,
+    FORMAT_PDF = 1,
+    FORMAT_SVG = 2
+} output_format_t ;
+
+typedef enum {
+    INVALID_UTF8_REJECT = 0,
+    INVALID_UTF8_REPLACE = 1,
+    INVALID_UTF8_LATIN1 = 2
+} invalid_utf8_t ;
+
+typedef struct  {
+    double width;
+    double height;
+} paper_size_t;
+
+extern const paper_size_t paper_sizes[];
+
+/* The graphic rendition set by ANSI SGR escape sequences */
+struct AnsiState {
+  int fg = -1;                 // 0xRRGGBB, or -1 for the default color
+  int bg = -1;
+  bool bold = false;
+  bool faint = false;
+  bool italic = false;
+  bool underline = false;
+  bool reverse = false;
+  bool strikethrough = false;
+
+  bool operator==(const AnsiState& o) const
+  {
+    return fg == o.fg && bg == o.bg && bold == o.bold && faint == o.faint
+      && italic == o.italic && underline == o.underline
+      && reverse == o.reverse && strikethrough == o.strikethrough;
+  }
+};
+
+struct PageLayout {
+  ~PageLayout() {
+  };
+
+  int column_width;
+  int column_height;
+  int num_columns;
+  int gutter_width;  /* These are all in postscript points=1/72 inch... */
+  int top_margin;  
+  int bottom_margin;
+  int left_margin;
+  int right_margin;
+  int num_pages;
+  double page_width;
+  double page_height;
+  int header_ypos;
+  int header_sep;
+  int header_height;
+  int footer_height;
+  paper_type_t paper_type;
+  gdouble scale_x;
+  gdouble scale_y;
+  bool do_draw_header;
+  bool do_draw_footer;
+  bool do_duplex;
+  bool do_tumble;
+  bool do_landscape;
+  bool do_justify;
+  bool do_show_hyphens;
+  bool do_draw_separation_line;
+  bool do_draw_contour;
+  bool do_show_wrap;
+  bool do_use_markup;
+  bool do_ansi;
+  int num_copies;           // Of every page, with 0 or 1 for a single copy
+  bool do_collate;          // Whether the copies are of the whole document
+  bool do_reverse;          // Whether the pages are output from the last one
+  int line_number_digits;   // Width of the line numbers, or 0 for none
+  int line_number_width;    // Width of the line number gutter of a column
+
+  // The geometry of the columns in pango units, computed once by
+  // compute_page_geometry(), so that the lines are laid out on the
+  // pages with integer adds and compares only.
+  std::vector<int> column_x;     // Left edge of the text of every column
+  std::vector<int> separator_x;  // Separation line before every column but the first
+  int body_y;               // Top of the columns
+  int pango_column_width;
+  int pango_column_height;
+  int line_pitch;           // Line height of --lpi, or 0 for the height of every line
+  int line_number_dx;       // End of the line numbers relative to column_x
+
+  // The state at the start of the text, for a shard that starts in the
+  // middle of the document.
+  AnsiState ansi_state;
+  int first_line_no;
+  bool starts_in_line;   // Whether the text starts within an input line
+  bool do_stretch_chars;
+  PangoDirection pango_dir;
+  std::string title;
+  std::string filename_path;
+  std::string filename;
+  char* header_left = nullptr;
+  char* header_center = nullptr;
+  char* header_right = nullptr;
+  char* footer_left = nullptr;
+  char* footer_center = nullptr;
+  char* footer_right = nullptr;
+  std::string header_font_desc;
+  gdouble lpi;
+  gdouble cpi;
+
+  // The input, for the size, lines and checksum of the document info
+  const char *text;
+  size_t text_length;
+
+  // The header and footer templates, from left to right, and the
+  // fields of the document info that they use.
+  std::vector<CompiledFormat> header_formats;
+  dict_t document_info;
+  bool document_info_built;
+};
+
+typedef struct _Paragraph Paragraph;
+
+struct LineLink {
+  PangoLayoutLine *pango_line;
+  PangoRectangle logical_rect;
+  PangoRectangle ink_rect;
+  int formfeed;
+  bool wrapped;   // Whether the paragraph was character wrapped
+  Paragraph *para;     // The paragraph that the line belongs to
+  int para_line_idx;   // Index of the line within its paragraph
+};
+
+/* Structure representing a paragraph
+ */
+struct _Paragraph {
+  const char *text;
+  int line_no;             // The input line that the paragraph starts in
+  bool starts_line;        // Whether the paragraph starts the input line
+  const char *source_end;  // End of the paragraph in the input, including its terminator
+  int length;
+  int height;   /* Height, in pixels */
+  int formfeed;
+  bool wrapped; 
+  bool clipped;   // Whether the line was clipped. Used for CPI.
+  AnsiState ansi_state;  // The ANSI state at the start of the paragraph
+  PangoLayout *layout;
+};
+
+
+/* The byte offsets of the DSC sections of PostScript output, that are
+ * found in the output as it is written, for --page-index */
+struct DscIndex {
+  FILE *fh;              // Where the output is written
+  off_t offset;          // Of the next byte of the output
+  off_t line_offset;     // Of the line that is being written
+  std::string line_head;      // The start of that line, up to the length of a DSC comment
+  off_t end_prolog;      // Of %%EndProlog, or -1
+  off_t begin_setup;     // Of %%BeginSetup, or -1
+  std::vector<off_t> pages;   // Of the %%Page: of every page
+  off_t trailer;         // Of %%Trailer, or -1
+};
+
+
+/* A --highlight-regex pattern and the attributes given to its matches */
+struct Highlight {
+  GRegex *regex;
+  std::vector<PangoAttribute*> attrs;
+};
+
+/* The state of the rendering, that is set from the options */
+extern FILE *output_fh;
+extern FILE *map_fh;                 // Output of --map
+extern gint64 first_page_time;       // When the first page was written, for --stats
+extern paper_type_t paper_type;
+extern output_format_t output_format;
+extern PangoGravity gravity;
+extern PangoGravityHint gravity_hint;
+extern PangoWrapMode opt_wrap;
+extern invalid_utf8_t invalid_utf8;
+extern FcConfig *font_file_config;    /* The fonts of --font-file and --header-font-file */
+extern cairo_font_face_t *paps_glyph_face; /* Special face for paps characters, e.g. newline */
+extern double glyph_font_size;
+extern std::vector<Highlight> highlights;
+
+cairo_status_t paps_render_glyph           (cairo_scaled_font_t *scaled_font,
+                                            unsigned long    glyph,
+                                            cairo_t         *cr,
+                                            cairo_text_extents_t *extents);
+bool   _paps_arg_paper_cb                  (const char      *option_name,
+                                            const char      *value,
+                                            gpointer         data);
+cairo_status_t paps_cairo_write_func       (void            *closure,
+                                            const unsigned char *data,
+                                            unsigned int     length);
+cairo_status_t paps_cairo_string_write_func(void            *closure,
+                                            const unsigned char *data,
+                                            unsigned int     length);
+cairo_status_t paps_cairo_dsc_index_write_func(void         *closure,
+                                            const unsigned char *data,
+                                            unsigned int     length);
+void   write_dsc_index                     (FILE            *index_fh,
+                                            const DscIndex&  index);
+char  *get_encoding                        ();
+std::string add_font_file                  (const char      *font_file,
+                                            bool             with_system_fonts);
+PangoFontMap *get_font_map                 ();
+PangoContext *create_pango_context         (cairo_t         *cr,
+                                            PangoDirection   pango_dir);
+char  *read_file                           (FILE            *file,
+                                            gchar           *encoding);
+size_t utf8_valid_prefix                   (const char      *text,
+                                            size_t           length);
+void   layout_turn_off_hyphens             (PangoLayout     *layout);
+GList *split_text_into_paragraphs          (PangoContext    *pango_context,
+                                            PageLayout      *page_layout,
+                                            int              paint_width,
+                                            const char      *text);
+GList *split_paragraphs_into_lines         (PageLayout      *page_layout,
+                                            GList           *paragraphs);
+void   free_paragraphs                     (GList           *paragraphs);
+void   postscript_dsc_comments             (cairo_surface_t *surface,
+                                            PageLayout      *page_layout);
+int    output_pages                        (cairo_surface_t *surface,
+                                            cairo_t         *cr,
+                                            GList           *pango_lines,
+                                            PageLayout      *page_layout,
+                                            PangoContext    *pango_context,
+                                            int              first_page_idx);
+int    output_pages_pass                   (cairo_surface_t *surface,
+                                            cairo_t         *cr,
+                                            GList           *pango_lines,
+                                            PageLayout      *page_layout,
+                                            PangoContext    *pango_context,
+                                            dict_t&          document_info,
+                                            int              first_page_idx,
+                                            int              num_pages,
+                                            bool             measure_only,
+                                            std::vector<GList*> *page_starts,
+                                            FILE            *map_fh,
+                                            std::vector<cairo_surface_t*> *page_recordings);
+int    output_pages_sharded                (cairo_surface_t *surface,
+                                            cairo_t         *cr,
+                                            GList           *pango_lines,
+                                            PageLayout      *page_layout,
+                                            PangoContext    *pango_context,
+                                            int              num_shards,
+                                            double           surface_page_width,
+                                            double           surface_page_height,
+                                            std::string     *pdf_output);
+int    output_pages_first_fast             (cairo_surface_t *surface,
+                                            cairo_t         *cr,
+                                            GList           *paragraphs,
+                                            PageLayout      *page_layout,
+                                            PangoContext    *pango_context,
+                                            int              num_first_pages,
+                                            double           surface_page_width,
+                                            double           surface_page_height);
+double count_pages                         (cairo_surface_t *surface,
+                                            cairo_t         *cr,
+                                            PageLayout      *page_layout,
+                                            PangoContext    *pango_context,
+                                            double           fraction);
+bool   set_line_number_width               (PageLayout      *page_layout,
+                                            PangoContext    *pango_context,
+                                            int              column_width);
+bool   fit_font_size                       (cairo_surface_t *surface,
+                                            cairo_t         *cr,
+                                            PageLayout      *page_layout,
+                                            PangoContext    *pango_context,
+                                            PangoFontDescription *font_description,
+                                            int              column_width,
+                                            int              max_pages);
+bool   verify_layout                       (cairo_surface_t *surface,
+                                            cairo_t         *cr,
+                                            GList           *pango_lines,
+                                            PageLayout      *page_layout,
+                                            PangoContext    *pango_context,
+                                            double           surface_page_width,
+                                            double           surface_page_height);
+int    append_pdf_page_count               (const char      *filename);
+void   append_pdf_update                   (const char      *filename,
+                                            const std::string& pdf);
+void   write_linearized_pdf                (const std::string& pdf);
+void   compute_page_geometry               (PageLayout      *page_layout);
+int    draw_page_header_line_to_page       (cairo_t         *cr,
+                                            bool             is_footer,
+                                            PageLayout      *page_layout,
+                                            PangoContext    *ctx,
+                                            int              page,
+                                            int              num_pages,
+                                            dict_t&          document_info,
+                                            bool             measure_only);
+std::set<std::string> document_info_keys   (PageLayout      *page_layout);
+void   build_document_info                 (PageLayout      *page_layout,
+                                            dict_t&          document_info);
+std::string fn_basename                    (const std::string& filename);
+
+#endif /* PAPS_CORE_H */
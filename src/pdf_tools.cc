@@ -0,0 +1,1626 @@
+/*
+ * pdf_tools.cc: Minimal PDF object reading and writing used by paps.
+ *
+ * Copyright (C) 2002, 2005, 2022 Dov Grobgeld <dov.grobgeld@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "pdf_tools.h"
+#include <stdexcept>
+#include <string.h>
+#include <stdlib.h>
+#include <zlib.h>
+#include <limits.h>
+#include <algorithm>
+#include <fmt/core.h>
+
+using namespace std;
+using namespace fmt;
+
+// The maximum nesting of the page tree that we follow
+#define MAX_PAGE_TREE_DEPTH 64
+
+PdfObject PdfObject::make_ref(int num, int gen)
+{
+  PdfObject obj;
+  obj.type = Type::Ref;
+  obj.num = num;
+  obj.gen = gen;
+  return obj;
+}
+
+PdfObject PdfObject::make_name(const string& name)
+{
+  PdfObject obj;
+  obj.type = Type::Name;
+  obj.text = name;
+  return obj;
+}
+
+PdfObject PdfObject::make_number(long value)
+{
+  PdfObject obj;
+  obj.type = Type::Number;
+  obj.text = to_string(value);
+  return obj;
+}
+
+PdfObject PdfObject::make_dict()
+{
+  PdfObject obj;
+  obj.type = Type::Dict;
+  return obj;
+}
+
+PdfObject PdfObject::make_array()
+{
+  PdfObject obj;
+  obj.type = Type::Array;
+  return obj;
+}
+
+bool PdfObject::is_name(const string& name) const
+{
+  return type == Type::Name && text == name;
+}
+
+long PdfObject::as_long() const
+{
+  if (type != Type::Number)
+    throw runtime_error("Expected a number in PDF object!");
+  return strtol(text.c_str(), nullptr, 10);
+}
+
+PdfObject *PdfObject::get(const string& key)
+{
+  for (size_t i=0; i<keys.size(); i++)
+    if (keys[i] == key)
+      return &items[i];
+  return nullptr;
+}
+
+const PdfObject *PdfObject::get(const string& key) const
+{
+  for (size_t i=0; i<keys.size(); i++)
+    if (keys[i] == key)
+      return &items[i];
+  return nullptr;
+}
+
+void PdfObject::set(const string& key, PdfObject value)
+{
+  PdfObject *old = get(key);
+  if (old)
+    *old = std::move(value);
+  else
+    {
+      keys.push_back(key);
+      items.push_back(std::move(value));
+    }
+}
+
+void PdfObject::erase(const string& key)
+{
+  for (size_t i=0; i<keys.size(); i++)
+    if (keys[i] == key)
+      {
+        keys.erase(keys.begin()+i);
+        items.erase(items.begin()+i);
+        return;
+      }
+}
+
+void pdf_serialize(const PdfObject& obj, string& out)
+{
+  switch (obj.type)
+    {
+    case PdfObject::Type::Null:
+      out += "null";
+      break;
+    case PdfObject::Type::Bool:
+    case PdfObject::Type::Number:
+    case PdfObject::Type::String:
+      out += obj.text;
+      break;
+    case PdfObject::Type::Name:
+      out += '/';
+      out += obj.text;
+      break;
+    case PdfObject::Type::Ref:
+      out += format("{} {} R", obj.num, obj.gen);
+      break;
+    case PdfObject::Type::Array:
+      out += '[';
+      for (size_t i=0; i<obj.items.size(); i++)
+        {
+          if (i)
+            out += ' ';
+          pdf_serialize(obj.items[i], out);
+        }
+      out += ']';
+      break;
+    case PdfObject::Type::Dict:
+      out += "<<";
+      for (size_t i=0; i<obj.keys.size(); i++)
+        {
+          out += " /";
+          out += obj.keys[i];
+          out += ' ';
+          pdf_serialize(obj.items[i], out);
+        }
+      out += " >>";
+      break;
+    }
+}
+
+/*======================================================================
+//  Lexical parsing of PDF syntax.
+//----------------------------------------------------------------------*/
+static bool is_white(char c)
+{
+  return c == ' ' || c == '\n' || c == '\r' || c == '\t' || c == '\f' || c == '\0';
+}
+
+static bool is_delim(char c)
+{
+  return strchr("()<>[]{}/%", c) != nullptr;
+}
+
+class PdfParser {
+public:
+  PdfParser(const char *data, size_t size, size_t pos=0)
+    : m_data(data), m_size(size), m_pos(pos) {}
+
+  size_t pos() const { return m_pos; }
+  void set_pos(size_t pos) { m_pos = pos; }
+
+  void skip_white()
+  {
+    while (m_pos < m_size)
+      {
+        char c = m_data[m_pos];
+        if (c == '%')
+          {
+            while (m_pos < m_size && m_data[m_pos] != '\n' && m_data[m_pos] != '\r')
+              m_pos++;
+          }
+        else if (is_white(c))
+          m_pos++;
+        else
+          break;
+      }
+  }
+
+  // A keyword or number, i.e. a sequence of regular characters
+  string regular_token()
+  {
+    skip_white();
+    size_t start = m_pos;
+    while (m_pos < m_size && !is_white(m_data[m_pos]) && !is_delim(m_data[m_pos]))
+      m_pos++;
+    return string(m_data+start, m_pos-start);
+  }
+
+  bool expect_keyword(const char *keyword)
+  {
+    size_t save = m_pos;
+    if (regular_token() == keyword)
+      return true;
+    m_pos = save;
+    return false;
+  }
+
+  PdfObject parse_object()
+  {
+    skip_white();
+    if (m_pos >= m_size)
+      throw runtime_error("Unexpected end of PDF data!");
+
+    PdfObject obj;
+    char c = m_data[m_pos];
+    if (c == '/')
+      {
+        size_t start = ++m_pos;
+        while (m_pos < m_size && !is_white(m_data[m_pos]) && !is_delim(m_data[m_pos]))
+          m_pos++;
+        obj.type = PdfObject::Type::Name;
+        obj.text = string(m_data+start, m_pos-start);
+      }
+    else if (c == '(')
+      {
+        size_t start = m_pos++;
+        int depth = 1;
+        while (m_pos < m_size && depth > 0)
+          {
+            char s = m_data[m_pos++];
+            if (s == '\\')
+              m_pos++;
+            else if (s == '(')
+              depth++;
+            else if (s == ')')
+              depth--;
+          }
+        if (depth > 0)
+          throw runtime_error("Unterminated string in PDF data!");
+        obj.type = PdfObject::Type::String;
+        obj.text = string(m_data+start, m_pos-start);
+      }
+    else if (c == '<' && m_pos+1 < m_size && m_data[m_pos+1] == '<')
+      {
+        m_pos += 2;
+        obj.type = PdfObject::Type::Dict;
+        while (true)
+          {
+            skip_white();
+            if (m_pos+1 < m_size && m_data[m_pos] == '>' && m_data[m_pos+1] == '>')
+              {
+                m_pos += 2;
+                break;
+              }
+            PdfObject key = parse_object();
+            if (key.type != PdfObject::Type::Name)
+              throw runtime_error(format("Expected a name as dictionary key at offset {}!", m_pos));
+            obj.keys.push_back(key.text);
+            obj.items.push_back(parse_object());
+          }
+      }
+    else if (c == '<')
+      {
+        size_t start = m_pos;
+        const char *end = (const char*)memchr(m_data+m_pos, '>', m_size-m_pos);
+        if (!end)
+          throw runtime_error("Unterminated hex string in PDF data!");
+        m_pos = end - m_data + 1;
+        obj.type = PdfObject::Type::String;
+        obj.text = string(m_data+start, m_pos-start);
+      }
+    else if (c == '[')
+      {
+        m_pos++;
+        obj.type = PdfObject::Type::Array;
+        while (true)
+          {
+            skip_white();
+            if (m_pos < m_size && m_data[m_pos] == ']')
+              {
+                m_pos++;
+                break;
+              }
+            obj.items.push_back(parse_object());
+          }
+      }
+    else
+      {
+        string token = regular_token();
+        if (token.empty())
+          throw runtime_error(format("Unexpected character '{}' at offset {} in PDF data!", c, m_pos));
+        if (token == "true" || token == "false")
+          {
+            obj.type = PdfObject::Type::Bool;
+            obj.text = token;
+          }
+        else if (token == "null")
+          obj.type = PdfObject::Type::Null;
+        else if (strchr("+-.0123456789", token[0]))
+          {
+            obj.type = PdfObject::Type::Number;
+            obj.text = token;
+
+            // An integer may be the start of a reference "num gen R"
+            if (token.find_first_not_of("0123456789") == string::npos)
+              {
+                size_t save = m_pos;
+                string gen = regular_token();
+                if (!gen.empty()
+                    && gen.find_first_not_of("0123456789") == string::npos
+                    && regular_token() == "R")
+                  {
+                    obj.type = PdfObject::Type::Ref;
+                    obj.num = atoi(token.c_str());
+                    obj.gen = atoi(gen.c_str());
+                    obj.text.clear();
+                  }
+                else
+                  m_pos = save;
+              }
+          }
+        else
+          throw runtime_error(format("Unexpected keyword '{}' in PDF data!", token));
+      }
+
+    return obj;
+  }
+
+private:
+  const char *m_data;
+  size_t m_size;
+  size_t m_pos;
+};
+
+/*======================================================================
+//  Stream filters
+//----------------------------------------------------------------------*/
+static string flate_decode(const string& data)
+{
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  if (inflateInit(&zs) != Z_OK)
+    throw runtime_error("Failed to initialize zlib!");
+
+  string res;
+  char buf[16384];
+  zs.next_in = (Bytef*)data.data();
+  zs.avail_in = data.size();
+  // Inflate until the end of the stream, which may take several rounds
+  // of output after all of the input has been consumed. Running out of
+  // input before the end is an error, as is any other failure.
+  int ret;
+  do {
+    zs.next_out = (Bytef*)buf;
+    zs.avail_out = sizeof(buf);
+    ret = inflate(&zs, Z_NO_FLUSH);
+    if (ret != Z_OK && ret != Z_STREAM_END)
+      {
+        inflateEnd(&zs);
+        throw runtime_error(ret == Z_BUF_ERROR
+                            ? "Truncated compressed PDF stream!"
+                            : "Failed to decompress PDF stream!");
+      }
+    res.append(buf, sizeof(buf) - zs.avail_out);
+  } while (ret != Z_STREAM_END);
+  inflateEnd(&zs);
+
+  return res;
+}
+
+// Undo the PNG predictors (Predictor >= 10) for 8-bit samples
+static string png_unpredict(const string& data, int columns)
+{
+  string res;
+  size_t row_len = columns + 1;
+  string prev(columns, '\0');
+
+  for (size_t row=0; row+row_len <= data.size(); row+= row_len)
+    {
+      int filter = (unsigned char)data[row];
+      string cur = data.substr(row+1, columns);
+      for (int i=0; i<columns; i++)
+        {
+          int a = i > 0 ? (unsigned char)cur[i-1] : 0;
+          int b = (unsigned char)prev[i];
+          int c = i > 0 ? (unsigned char)prev[i-1] : 0;
+          int x = (unsigned char)cur[i];
+          switch (filter)
+            {
+            case 0: break;
+            case 1: x += a; break;
+            case 2: x += b; break;
+            case 3: x += (a+b)/2; break;
+            case 4:
+              {
+                int p = a + b - c;
+                int pa = abs(p-a), pb = abs(p-b), pc = abs(p-c);
+                x += (pa <= pb && pa <= pc) ? a : (pb <= pc ? b : c);
+                break;
+              }
+            default:
+              throw runtime_error("Unsupported PNG predictor in PDF stream!");
+            }
+          cur[i] = (char)x;
+        }
+      res += cur;
+      prev = cur;
+    }
+  return res;
+}
+
+/*======================================================================
+//  PdfReader
+//----------------------------------------------------------------------*/
+PdfReader::PdfReader(const char *data, size_t size)
+  : m_data(data), m_size(size)
+{
+  if (size < 8 || strncmp(data, "%PDF-", 5) != 0)
+    throw runtime_error("Not a PDF file!");
+  const char *eol = data + 5;
+  while (eol < data + size && !is_white(*eol))
+    eol++;
+  m_version = string(data + 5, eol - data - 5);
+
+  // Find the last startxref
+  size_t tail = size > 1024 ? size - 1024 : 0;
+  const char *key = "startxref";
+  size_t pos = string::npos;
+  for (size_t i=tail; i+9 <= size; i++)
+    if (memcmp(data+i, key, 9) == 0)
+      pos = i;
+  if (pos == string::npos)
+    throw runtime_error("No startxref found in PDF file!");
+
+  PdfParser parser(data, size, pos+9);
+  string offset = parser.regular_token();
+  m_startxref = strtoul(offset.c_str(), nullptr, 10);
+
+  set<size_t> visited;
+  read_xref_section(m_startxref, visited);
+}
+
+int PdfReader::size() const
+{
+  const PdfObject *size = m_trailer.get("Size");
+  if (size)
+    return size->as_long();
+  return m_xref.empty() ? 1 : m_xref.rbegin()->first + 1;
+}
+
+void PdfReader::read_xref_section(size_t offset, set<size_t>& visited)
+{
+  if (offset >= m_size || visited.count(offset))
+    throw runtime_error("Invalid cross reference offset in PDF file!");
+  visited.insert(offset);
+  // The newest section, that the file ends with, has the trailer. The
+  // sections that it leads to are read recursively, so this is checked
+  // before they are.
+  bool is_first = visited.size() == 1;
+
+  PdfParser parser(m_data, m_size, offset);
+  PdfObject trailer;
+  if (parser.expect_keyword("xref"))
+    {
+      while (true)
+        {
+          size_t save = parser.pos();
+          string first = parser.regular_token();
+          if (first == "trailer" || first.empty())
+            {
+              if (first.empty())
+                parser.set_pos(save);
+              break;
+            }
+          int start = atoi(first.c_str());
+          int count = atoi(parser.regular_token().c_str());
+          for (int i=0; i<count; i++)
+            {
+              string off = parser.regular_token();
+              string gen = parser.regular_token();
+              string type = parser.regular_token();
+              int num = start + i;
+              if (m_xref.count(num))
+                continue;      // A newer section already defines it
+              XrefEntry entry;
+              entry.type = type == "n" ? 1 : 0;
+              entry.offset = strtoul(off.c_str(), nullptr, 10);
+              entry.index = atoi(gen.c_str());
+              m_xref[num] = entry;
+            }
+        }
+      trailer = parser.parse_object();
+
+      // Hybrid files keep the compressed objects in an xref stream
+      const PdfObject *xref_stm = trailer.get("XRefStm");
+      if (xref_stm && xref_stm->type == PdfObject::Type::Number)
+        read_xref_section(xref_stm->as_long(), visited);
+    }
+  else
+    {
+      PdfIndirect xref = parse_indirect_at(offset, -1);
+      const PdfObject *type = xref.value.get("Type");
+      if (!xref.is_stream || !type || !type->is_name("XRef"))
+        throw runtime_error("Invalid cross reference section in PDF file!");
+      if (is_first)
+        m_xref_stream = true;
+      trailer = xref.value;
+
+      string data = decode_stream(xref);
+      const PdfObject *w = trailer.get("W");
+      if (!w || w->type != PdfObject::Type::Array || w->items.size() != 3)
+        throw runtime_error("Invalid /W in cross reference stream!");
+      int widths[3];
+      for (int i=0; i<3; i++)
+        widths[i] = w->items[i].as_long();
+      size_t entry_len = widths[0] + widths[1] + widths[2];
+
+      vector<pair<int,int>> index;
+      const PdfObject *idx = trailer.get("Index");
+      if (idx && idx->type == PdfObject::Type::Array)
+        {
+          for (size_t i=0; i+1<idx->items.size(); i+=2)
+            index.push_back({(int)idx->items[i].as_long(), (int)idx->items[i+1].as_long()});
+        }
+      else
+        {
+          const PdfObject *size = trailer.get("Size");
+          if (!size)
+            throw runtime_error("Missing /Size in cross reference stream!");
+          index.push_back({0, (int)size->as_long()});
+        }
+
+      size_t pos = 0;
+      for (auto& [start, count] : index)
+        for (int i=0; i<count; i++)
+          {
+            if (pos + entry_len > data.size())
+              throw runtime_error("Truncated cross reference stream!");
+            size_t fields[3];
+            for (int f=0; f<3; f++)
+              {
+                size_t v = 0;
+                for (int b=0; b<widths[f]; b++)
+                  v = (v << 8) | (unsigned char)data[pos++];
+                // Default type is 1 when the field is missing
+                fields[f] = (f == 0 && widths[0] == 0) ? 1 : v;
+              }
+            int num = start + i;
+            if (m_xref.count(num))
+              continue;
+            XrefEntry entry;
+            entry.type = fields[0];
+            entry.offset = fields[1];
+            entry.index = fields[2];
+            m_xref[num] = entry;
+          }
+    }
+
+  if (is_first)
+    m_trailer = trailer;
+
+  const PdfObject *prev = trailer.get("Prev");
+  if (prev && prev->type == PdfObject::Type::Number)
+    read_xref_section(prev->as_long(), visited);
+}
+
+int PdfReader::page_count()
+{
+  const PdfObject *root = m_trailer.get("Root");
+  if (!root)
+    throw runtime_error("PDF file has no /Root!");
+  PdfObject catalog = resolve(*root);
+  const PdfObject *pages = catalog.get("Pages");
+  if (!pages)
+    throw runtime_error("PDF catalog has no /Pages!");
+  PdfObject tree = resolve(*pages);
+  const PdfObject *count = tree.get("Count");
+  if (!count)
+    throw runtime_error("PDF page tree has no /Count!");
+  return resolve(*count).as_long();
+}
+
+PdfIndirect PdfReader::parse_indirect_at(size_t offset, int expected_num)
+{
+  PdfParser parser(m_data, m_size, offset);
+  string num = parser.regular_token();
+  parser.regular_token();   // Generation
+  if (!parser.expect_keyword("obj")
+      || (expected_num >= 0 && atoi(num.c_str()) != expected_num))
+    throw runtime_error(format("Object {} not found at offset {}!", expected_num, offset));
+
+  PdfIndirect res;
+  res.value = parser.parse_object();
+  if (parser.expect_keyword("stream"))
+    {
+      size_t pos = parser.pos();
+      if (pos < m_size && m_data[pos] == '\r')
+        pos++;
+      if (pos < m_size && m_data[pos] == '\n')
+        pos++;
+
+      long length = -1;
+      const PdfObject *len = res.value.get("Length");
+      if (len && len->type == PdfObject::Type::Number)
+        length = len->as_long();
+      else if (len && len->type == PdfObject::Type::Ref && len->num != expected_num)
+        length = resolve(*len).as_long();
+
+      // Verify the length, and search for endstream if it is broken
+      bool ok = length >= 0 && pos + length <= m_size;
+      if (ok)
+        {
+          PdfParser check(m_data, m_size, pos + length);
+          ok = check.expect_keyword("endstream");
+        }
+      if (!ok)
+        {
+          const char *key = "endstream";
+          const char *end = nullptr;
+          for (size_t i=pos; i+9 <= m_size; i++)
+            if (memcmp(m_data+i, key, 9) == 0)
+              {
+                end = m_data+i;
+                break;
+              }
+          if (!end)
+            throw runtime_error("Unterminated stream in PDF data!");
+          length = end - (m_data+pos);
+          while (length > 0 && (m_data[pos+length-1] == '\n' || m_data[pos+length-1] == '\r'))
+            length--;
+        }
+      res.is_stream = true;
+      res.stream.assign(m_data+pos, length);
+    }
+  return res;
+}
+
+PdfIndirect PdfReader::load(int num)
+{
+  auto it = m_xref.find(num);
+  if (it == m_xref.end() || it->second.type == 0)
+    throw runtime_error(format("Object {} missing from PDF file!", num));
+
+  XrefEntry entry = it->second;
+  if (entry.type == 1)
+    return parse_indirect_at(entry.offset, num);
+
+  // The object is compressed inside an object stream
+  int stm_num = entry.offset;
+  auto cached = m_objstm_cache.find(stm_num);
+  if (cached == m_objstm_cache.end())
+    {
+      PdfIndirect stm = load(stm_num);
+      const PdfObject *n = stm.value.get("N");
+      const PdfObject *first = stm.value.get("First");
+      if (!n || !first)
+        throw runtime_error(format("Invalid object stream {} in PDF file!", stm_num));
+      ObjStm objstm = { decode_stream(stm), (int)n->as_long(), (size_t)first->as_long() };
+      cached = m_objstm_cache.emplace(stm_num, std::move(objstm)).first;
+    }
+  int n = cached->second.n;
+  size_t first = cached->second.first;
+  const string& data = cached->second.data;
+
+  PdfParser parser(data.data(), data.size());
+  for (int i=0; i<n; i++)
+    {
+      int onum = atoi(parser.regular_token().c_str());
+      size_t ooff = strtoul(parser.regular_token().c_str(), nullptr, 10);
+      if (onum == num)
+        {
+          PdfParser obj_parser(data.data(), data.size(), first + ooff);
+          PdfIndirect res;
+          res.value = obj_parser.parse_object();
+          return res;
+        }
+    }
+  throw runtime_error(format("Object {} missing from its object stream!", num));
+}
+
+PdfObject PdfReader::resolve(const PdfObject& obj)
+{
+  if (obj.type != PdfObject::Type::Ref)
+    return obj;
+  return load(obj.num).value;
+}
+
+string PdfReader::decode_stream(const PdfIndirect& obj)
+{
+  const PdfObject *filter = obj.value.get("Filter");
+  if (!filter)
+    return obj.stream;
+
+  PdfObject filter_obj = resolve(*filter);
+  bool flate = filter_obj.is_name("FlateDecode")
+    || (filter_obj.type == PdfObject::Type::Array
+        && filter_obj.items.size() == 1
+        && filter_obj.items[0].is_name("FlateDecode"));
+  if (!flate)
+    throw runtime_error("Unsupported PDF stream filter!");
+
+  string res = flate_decode(obj.stream);
+
+  const PdfObject *parms = obj.value.get("DecodeParms");
+  if (parms)
+    {
+      PdfObject p = resolve(*parms);
+      if (p.type == PdfObject::Type::Array && p.items.size() == 1)
+        p = p.items[0];
+      const PdfObject *predictor = p.get("Predictor");
+      if (predictor && predictor->as_long() >= 10)
+        {
+          const PdfObject *columns = p.get("Columns");
+          res = png_unpredict(res, columns ? columns->as_long() : 1);
+        }
+      else if (predictor && predictor->as_long() > 1)
+        throw runtime_error("Unsupported PDF stream predictor!");
+    }
+  return res;
+}
+
+void PdfReader::collect_pages(const PdfObject& node,
+                              PdfObject inherited,
+                              vector<pair<int, PdfIndirect>>& result,
+                              int depth)
+{
+  if (depth > MAX_PAGE_TREE_DEPTH)
+    throw runtime_error("PDF page tree is too deep!");
+  if (node.type != PdfObject::Type::Ref)
+    throw runtime_error("Expected a page reference in page tree!");
+
+  PdfIndirect obj = load(node.num);
+  const PdfObject *type = obj.value.get("Type");
+  const PdfObject *kids = obj.value.get("Kids");
+  if (kids && !(type && type->is_name("Page")))
+    {
+      for (const char *attr : {"Resources", "MediaBox", "CropBox", "Rotate"})
+        {
+          const PdfObject *val = obj.value.get(attr);
+          if (val)
+            inherited.set(attr, *val);
+        }
+      PdfObject kids_arr = resolve(*kids);
+      for (auto& kid : kids_arr.items)
+        collect_pages(kid, inherited, result, depth+1);
+    }
+  else
+    {
+      for (size_t i=0; i<inherited.keys.size(); i++)
+        if (!obj.value.get(inherited.keys[i]))
+          obj.value.set(inherited.keys[i], inherited.items[i]);
+      result.push_back({node.num, std::move(obj)});
+    }
+}
+
+vector<pair<int, PdfIndirect>> PdfReader::pages()
+{
+  vector<pair<int, PdfIndirect>> result;
+  const PdfObject *root = m_trailer.get("Root");
+  if (!root)
+    throw runtime_error("PDF file has no /Root!");
+  PdfObject catalog = resolve(*root);
+  const PdfObject *pages = catalog.get("Pages");
+  if (!pages)
+    throw runtime_error("PDF catalog has no /Pages!");
+  collect_pages(*pages, PdfObject::make_dict(), result, 0);
+  return result;
+}
+
+/*======================================================================
+//  PdfWriter
+//----------------------------------------------------------------------*/
+PdfWriter::PdfWriter(write_func_t write_func, size_t base_offset)
+  : m_write_func(write_func), m_offset(base_offset)
+{
+}
+
+void PdfWriter::write(const char *data, size_t len)
+{
+  m_write_func(data, len);
+  m_offset += len;
+}
+
+void PdfWriter::write_raw(const string& data)
+{
+  write(data.data(), data.size());
+}
+
+void PdfWriter::write_header(const string& version)
+{
+  // The binary comment tells transfer programs that the file is binary
+  write_raw(format("%PDF-{}\n%\xb5\xed\xae\xfb\n", version));
+}
+
+void PdfWriter::write_object(int num, const PdfIndirect& obj)
+{
+  m_offsets[num] = m_offset;
+
+  string out = format("{} 0 obj\n", num);
+  if (obj.is_stream)
+    {
+      PdfObject dict = obj.value;
+      dict.set("Length", PdfObject::make_number(obj.stream.size()));
+      pdf_serialize(dict, out);
+      out += "\nstream\n";
+      write_raw(out);
+      write(obj.stream.data(), obj.stream.size());
+      write_raw("\nendstream\nendobj\n");
+    }
+  else
+    {
+      pdf_serialize(obj.value, out);
+      out += "\nendobj\n";
+      write_raw(out);
+    }
+}
+
+// Group the written objects into contiguous subsections
+static vector<pair<int,int>> xref_subsections(const map<int, size_t>& offsets,
+                                              bool include_zero)
+{
+  vector<pair<int,int>> res;
+  if (include_zero)
+    res.push_back({0, 1});
+  for (auto& it : offsets)
+    {
+      if (!res.empty() && res.back().first + res.back().second == it.first)
+        res.back().second++;
+      else
+        res.push_back({it.first, 1});
+    }
+  return res;
+}
+
+void PdfWriter::write_xref_table(PdfObject trailer)
+{
+  size_t xref_offset = m_offset;
+  int size = m_offsets.empty() ? 1 : m_offsets.rbegin()->first + 1;
+  const PdfObject *old_size = trailer.get("Size");
+  if (old_size && old_size->as_long() > size)
+    size = old_size->as_long();
+
+  // A complete file gets a single section, an update only its objects
+  bool is_update = trailer.get("Prev") != nullptr;
+  map<int, size_t> offsets = m_offsets;
+  if (!is_update)
+    for (int i=1; i<size; i++)
+      if (!offsets.count(i))
+        offsets[i] = 0;
+
+  string out = "xref\n";
+  for (auto& [start, count] : xref_subsections(offsets, !is_update))
+    {
+      out += format("{} {}\n", start, count);
+      for (int num=start; num<start+count; num++)
+        {
+          if (num == 0)
+            out += "0000000000 65535 f \n";
+          else if (offsets[num] == 0)
+            out += "0000000000 00001 f \n";
+          else
+            out += format("{:010d} 00000 n \n", offsets[num]);
+        }
+    }
+  trailer.set("Size", PdfObject::make_number(size));
+  out += "trailer\n";
+  pdf_serialize(trailer, out);
+  out += format("\nstartxref\n{}\n%%EOF\n", xref_offset);
+  write_raw(out);
+}
+
+void PdfWriter::write_xref_stream(int xref_num, PdfObject trailer)
+{
+  size_t xref_offset = m_offset;
+  m_offsets[xref_num] = xref_offset;
+  int size = m_offsets.rbegin()->first + 1;
+  const PdfObject *old_size = trailer.get("Size");
+  if (old_size && old_size->as_long() > size)
+    size = old_size->as_long();
+
+  bool is_update = trailer.get("Prev") != nullptr;
+  map<int, size_t> offsets = m_offsets;
+  if (!is_update)
+    for (int i=1; i<size; i++)
+      if (!offsets.count(i))
+        offsets[i] = 0;
+
+  // Fixed field widths [1 4 2] and no compression
+  PdfIndirect xref;
+  PdfObject index = PdfObject::make_array();
+  for (auto& [start, count] : xref_subsections(offsets, !is_update))
+    {
+      index.items.push_back(PdfObject::make_number(start));
+      index.items.push_back(PdfObject::make_number(count));
+      for (int num=start; num<start+count; num++)
+        {
+          size_t off = offsets[num];
+          bool in_use = num != 0 && off != 0;
+          xref.stream += (char)(in_use ? 1 : 0);
+          for (int b=3; b>=0; b--)
+            xref.stream += (char)((off >> (8*b)) & 0xff);
+          char gen = num == 0 ? (char)0xff : 0;
+          xref.stream += gen;
+          xref.stream += gen;
+        }
+    }
+
+  for (const char *key : {"Filter", "DecodeParms", "XRefStm", "Length"})
+    trailer.erase(key);
+  trailer.set("Type", PdfObject::make_name("XRef"));
+  trailer.set("Size", PdfObject::make_number(size));
+  trailer.set("Index", index);
+  PdfObject w = PdfObject::make_array();
+  for (int v : {1, 4, 2})
+    w.items.push_back(PdfObject::make_number(v));
+  trailer.set("W", w);
+  xref.value = trailer;
+  xref.is_stream = true;
+
+  write_object(xref_num, xref);
+  write_raw(format("startxref\n{}\n%%EOF\n", xref_offset));
+}
+
+/*======================================================================
+//  PdfMerger
+//----------------------------------------------------------------------*/
+PdfMerger::PdfMerger(PdfWriter::write_func_t write_func)
+  : m_writer(write_func)
+{
+  // The page tree root is referenced from all pages, so reserve it first
+  m_pages_num = 1;
+  m_next_num = 2;
+}
+
+PdfMerger::PdfMerger(PdfWriter::write_func_t write_func,
+                     PdfReader& base,
+                     size_t base_size)
+  : m_writer(write_func, base_size), m_base(&base)
+{
+  // The objects of the update would have to be encrypted too
+  if (base.trailer().get("Encrypt"))
+    throw runtime_error("Encrypted PDF files can not be appended to!");
+
+  const PdfObject *root = base.trailer().get("Root");
+  if (!root)
+    throw runtime_error("PDF file has no /Root!");
+  PdfObject catalog = base.resolve(*root);
+  const PdfObject *pages = catalog.get("Pages");
+  if (!pages || pages->type != PdfObject::Type::Ref)
+    throw runtime_error("PDF catalog has no /Pages!");
+
+  // New pages are hung directly under the existing root of the page tree
+  m_pages_num = pages->num;
+  m_next_num = base.size();
+  m_header_written = true;
+}
+
+// Collect all references contained in an object
+static void find_refs(const PdfObject& obj, vector<int>& refs)
+{
+  if (obj.type == PdfObject::Type::Ref)
+    refs.push_back(obj.num);
+  for (auto& item : obj.items)
+    find_refs(item, refs);
+}
+
+// A key identifying the content of a written object, used for sharing
+// identical objects between documents.
+static string content_key(const PdfIndirect& obj)
+{
+  string out;
+  pdf_serialize(obj.value, out);
+  if (obj.is_stream)
+    out += obj.stream;
+
+  uint64_t fnv = 1469598103934665603ULL;
+  for (unsigned char c : out)
+    fnv = (fnv ^ c) * 1099511628211ULL;
+  unsigned long crc = crc32(0L, (const Bytef*)out.data(), out.size());
+  return format("{}:{:x}:{:x}", out.size(), crc, fnv);
+}
+
+void PdfMerger::remap_refs(PdfReader& reader, PdfObject& obj, map<int, int>& renum)
+{
+  if (obj.type == PdfObject::Type::Ref)
+    {
+      obj.num = copy_object(reader, obj.num, renum);
+      obj.gen = 0;
+    }
+  for (auto& item : obj.items)
+    remap_refs(reader, item, renum);
+}
+
+// Copy an object and, depth first, everything it references. Returns
+// the number of the object in the merged document.
+int PdfMerger::copy_object(PdfReader& reader, int num, map<int, int>& renum)
+{
+  auto it = renum.find(num);
+  if (it != renum.end())
+    return it->second;
+
+  // A reference cycle. Give the object its number now and write it
+  // when its own copy is done.
+  if (m_in_progress.count(num))
+    {
+      int new_num = m_next_num++;
+      renum[num] = new_num;
+      m_reserved.insert(num);
+      return new_num;
+    }
+
+  m_in_progress.insert(num);
+  PdfIndirect obj = reader.load(num);
+  if (obj.is_stream)
+    {
+      obj.value.erase("Length");   // May be an indirect object
+      obj.value.erase("DL");
+    }
+  remap_refs(reader, obj.value, renum);
+  m_in_progress.erase(num);
+
+  if (m_reserved.count(num))
+    {
+      m_writer.write_object(renum[num], obj);
+      return renum[num];
+    }
+
+  string key = content_key(obj);
+  auto shared = m_shared.find(key);
+  if (shared != m_shared.end())
+    {
+      renum[num] = shared->second;
+      return shared->second;
+    }
+
+  int new_num = m_next_num++;
+  renum[num] = new_num;
+  m_shared[key] = new_num;
+  m_writer.write_object(new_num, obj);
+  return new_num;
+}
+
+void PdfMerger::add_document(const char *data, size_t size)
+{
+  PdfReader reader(data, size);
+  map<int, int> renum;
+  m_in_progress.clear();
+  m_reserved.clear();
+
+  if (!m_header_written)
+    {
+      m_writer.write_header(reader.version());
+      m_header_written = true;
+    }
+
+  auto pages = reader.pages();
+
+  // Pages are never shared, so number them up front. This also takes
+  // care of back references to the page, e.g. from annotations.
+  for (auto& [num, page] : pages)
+    {
+      renum[num] = m_next_num++;
+      m_reserved.insert(num);
+    }
+
+  for (auto& [num, page] : pages)
+    {
+      page.value.erase("Parent");
+      remap_refs(reader, page.value, renum);
+      page.value.set("Parent", PdfObject::make_ref(m_pages_num));
+      m_writer.write_object(renum[num], page);
+      m_kids.push_back(renum[num]);
+    }
+
+  // Keep the document info of the first document
+  const PdfObject *info = reader.trailer().get("Info");
+  if (m_info.type == PdfObject::Type::Null && info)
+    {
+      PdfObject info_ref = *info;
+      remap_refs(reader, info_ref, renum);
+      m_info = info_ref;
+    }
+}
+
+void PdfMerger::finish()
+{
+  if (m_base)
+    {
+      finish_update();
+      return;
+    }
+
+  if (!m_header_written)
+    m_writer.write_header("1.7");
+
+  PdfIndirect pages;
+  pages.value = PdfObject::make_dict();
+  pages.value.set("Type", PdfObject::make_name("Pages"));
+  PdfObject kids = PdfObject::make_array();
+  for (int kid : m_kids)
+    kids.items.push_back(PdfObject::make_ref(kid));
+  pages.value.set("Kids", kids);
+  pages.value.set("Count", PdfObject::make_number(m_kids.size()));
+  m_writer.write_object(m_pages_num, pages);
+
+  int catalog_num = m_next_num++;
+  PdfIndirect catalog;
+  catalog.value = PdfObject::make_dict();
+  catalog.value.set("Type", PdfObject::make_name("Catalog"));
+  catalog.value.set("Pages", PdfObject::make_ref(m_pages_num));
+  m_writer.write_object(catalog_num, catalog);
+
+  PdfObject trailer = PdfObject::make_dict();
+  trailer.set("Root", PdfObject::make_ref(catalog_num));
+  if (m_info.type != PdfObject::Type::Null)
+    trailer.set("Info", m_info);
+  m_writer.write_xref_table(trailer);
+}
+
+void PdfMerger::finish_update()
+{
+  PdfIndirect pages = m_base->load(m_pages_num);
+  const PdfObject *kids = pages.value.get("Kids");
+  const PdfObject *count = pages.value.get("Count");
+  if (!kids || !count)
+    throw runtime_error("Invalid root of the PDF page tree!");
+
+  PdfObject new_kids = m_base->resolve(*kids);
+  for (int kid : m_kids)
+    new_kids.items.push_back(PdfObject::make_ref(kid));
+  long new_count = m_base->resolve(*count).as_long() + m_kids.size();
+  pages.value.set("Kids", new_kids);
+  pages.value.set("Count", PdfObject::make_number(new_count));
+  m_writer.write_object(m_pages_num, pages);
+
+  // The trailer keeps /Root and /Info of the base document
+  PdfObject trailer = PdfObject::make_dict();
+  for (const char *key : {"Root", "Info", "ID"})
+    {
+      const PdfObject *val = m_base->trailer().get(key);
+      if (val)
+        trailer.set(key, *val);
+    }
+  trailer.set("Size", PdfObject::make_number(m_next_num));
+  trailer.set("Prev", PdfObject::make_number(m_base->startxref()));
+
+  // Readers expect an update to use the same kind of cross reference
+  // section as the file it is appended to.
+  if (m_base->has_xref_stream())
+    m_writer.write_xref_stream(m_next_num++, trailer);
+  else
+    m_writer.write_xref_table(trailer);
+}
+
+/*======================================================================
+//  Linearization
+//----------------------------------------------------------------------*/
+
+// Packs the fields of the hint tables, most significant bit first
+struct BitWriter {
+  string data;
+  unsigned int byte = 0;
+  int nbits = 0;
+
+  void write(unsigned long value, int bits)
+  {
+    for (int i=bits-1; i>=0; i--)
+      {
+        byte = (byte << 1) | ((value >> i) & 1);
+        if (++nbits == 8)
+          {
+            data += (char)byte;
+            byte = 0;
+            nbits = 0;
+          }
+      }
+  }
+
+  // Every item of a hint table starts at a byte boundary
+  void flush()
+  {
+    if (nbits)
+      write(0, 8-nbits);
+  }
+};
+
+// The number of bits needed to represent value
+static int bits_needed(unsigned long value)
+{
+  int bits = 0;
+  for (; value; value >>= 1)
+    bits++;
+  return bits;
+}
+
+static string serialize_object(int num, const PdfIndirect& obj)
+{
+  string out;
+  PdfWriter writer([&out](const char *data, size_t len) {
+      out.append(data, len);
+    });
+  writer.write_object(num, obj);
+  return out;
+}
+
+// The file is laid out as described in Annex F of the PDF reference:
+//
+//   header, linearization dictionary, first page xref and trailer,
+//   catalog and document level objects, hint stream, first page,
+//   remaining pages, shared objects, other objects, main xref.
+//
+// The objects up to the first page get the highest numbers so that
+// they are covered by the first page xref, while the rest of the file
+// is covered by the main xref. All values in the hint tables are
+// computed as if the hint stream was not present, so the hint stream is
+// built from the offsets of such a layout and then inserted.
+void pdf_linearize(const char *data,
+                   size_t size,
+                   PdfWriter::write_func_t write_func)
+{
+  PdfReader reader(data, size);
+  auto pages = reader.pages();
+  if (pages.empty())
+    {
+      write_func(data, size);
+      return;
+    }
+  const PdfObject *root = reader.trailer().get("Root");
+  if (!root || root->type != PdfObject::Type::Ref)
+    throw runtime_error("PDF file has no /Root!");
+
+  // The objects of the document with the inherited page attributes
+  // moved into the pages.
+  map<int, PdfIndirect> objects;
+  set<int> page_tree;
+  for (auto& [num, page] : pages)
+    {
+      objects[num] = page;
+      page_tree.insert(num);
+    }
+  auto load = [&](int num) -> PdfIndirect& {
+    auto it = objects.find(num);
+    if (it != objects.end())
+      return it->second;
+    PdfIndirect obj = reader.load(num);
+    if (obj.is_stream)
+      {
+        obj.value.erase("Length");   // May be an indirect object
+        obj.value.erase("DL");
+      }
+    const PdfObject *type = obj.value.get("Type");
+    if (type && type->is_name("Pages"))
+      {
+        page_tree.insert(num);
+        for (const char *attr : {"Resources", "MediaBox", "CropBox", "Rotate"})
+          obj.value.erase(attr);
+      }
+    return objects[num] = std::move(obj);
+  };
+
+  // The objects reachable from obj, depth first in the order that they
+  // are found. Objects in stop are not entered, and neither is the page
+  // tree unless enter_page_tree is set.
+  auto collect = [&](const PdfObject& obj, const set<int>& stop, bool enter_page_tree) {
+    vector<int> result, stack, refs;
+    set<int> seen;
+    find_refs(obj, refs);
+    stack.assign(refs.rbegin(), refs.rend());
+    while (!stack.empty())
+      {
+        int num = stack.back();
+        stack.pop_back();
+        if (seen.count(num) || stop.count(num))
+          continue;
+        seen.insert(num);
+        PdfIndirect& o = load(num);
+        if (page_tree.count(num) && !enter_page_tree)
+          continue;
+        result.push_back(num);
+        refs.clear();
+        find_refs(o.value, refs);
+        stack.insert(stack.end(), refs.rbegin(), refs.rend());
+      }
+    return result;
+  };
+
+  int num_pages = pages.size();
+  vector<vector<int>> page_objects(num_pages);
+  map<int, int> num_users;
+  for (int i=0; i<num_pages; i++)
+    {
+      page_objects[i] = collect(pages[i].second.value, {}, false);
+      for (int num : page_objects[i])
+        num_users[num]++;
+    }
+
+  // Part 4: The catalog and what is needed for opening the document
+  int catalog_num = root->num;
+  PdfObject catalog = load(catalog_num).value;
+  vector<int> part4 = { catalog_num };
+  set<int> assigned = { catalog_num };
+  PdfObject open_document = PdfObject::make_array();
+  for (const char *key : {"ViewerPreferences", "Threads", "OpenAction", "AcroForm"})
+    {
+      const PdfObject *val = catalog.get(key);
+      if (val)
+        open_document.items.push_back(*val);
+    }
+  for (int num : collect(open_document, assigned, false))
+    if (!num_users.count(num))
+      {
+        part4.push_back(num);
+        assigned.insert(num);
+      }
+
+  // Part 6: The first page and everything that it uses
+  vector<int> part6 = { pages[0].first };
+  assigned.insert(pages[0].first);
+  for (int num : page_objects[0])
+    if (assigned.insert(num).second)
+      part6.push_back(num);
+
+  // Part 7: The remaining pages, each followed by its private objects
+  vector<int> part7;
+  vector<size_t> page_start(num_pages), page_end(num_pages);
+  page_start[0] = 0;
+  page_end[0] = part6.size();
+  for (int i=1; i<num_pages; i++)
+    {
+      page_start[i] = part7.size();
+      part7.push_back(pages[i].first);
+      assigned.insert(pages[i].first);
+      for (int num : page_objects[i])
+        if (num_users[num] == 1 && assigned.insert(num).second)
+          part7.push_back(num);
+      page_end[i] = part7.size();
+    }
+
+  // Part 8: Objects shared by the pages after the first one
+  vector<int> part8;
+  for (int i=1; i<num_pages; i++)
+    for (int num : page_objects[i])
+      if (assigned.insert(num).second)
+        part8.push_back(num);
+
+  // Part 9: Everything else, e.g. the page tree and the document info
+  PdfObject rest = PdfObject::make_array();
+  for (int num : part4)
+    rest.items.push_back(load(num).value);
+  const PdfObject *info = reader.trailer().get("Info");
+  if (info)
+    rest.items.push_back(*info);
+  vector<int> part9 = collect(rest, assigned, true);
+
+  // Number the main part of the file first
+  map<int, int> renum;
+  int next_num = 1;
+  for (auto *part : {&part7, &part8, &part9})
+    for (int num : *part)
+      renum[num] = next_num++;
+  int first_num = next_num;
+  int lin_num = next_num++;
+  for (int num : part4)
+    renum[num] = next_num++;
+  int hint_num = next_num++;
+  for (int num : part6)
+    renum[num] = next_num++;
+  int total_num = next_num;
+
+  function<void(PdfObject&)> remap = [&](PdfObject& obj) {
+    if (obj.type == PdfObject::Type::Ref)
+      {
+        auto it = renum.find(obj.num);
+        if (it == renum.end())
+          obj = PdfObject();   // A reference to an object that we dropped
+        else
+          {
+            obj.num = it->second;
+            obj.gen = 0;
+          }
+      }
+    for (auto& item : obj.items)
+      remap(item);
+  };
+  auto serialize_part = [&](const vector<int>& part) {
+    vector<string> res;
+    for (int num : part)
+      {
+        PdfIndirect obj = objects[num];
+        remap(obj.value);
+        res.push_back(serialize_object(renum[num], obj));
+      }
+    return res;
+  };
+  vector<string> s4 = serialize_part(part4);
+  vector<string> s6 = serialize_part(part6);
+  vector<string> s7 = serialize_part(part7);
+  vector<string> s8 = serialize_part(part8);
+  vector<string> s9 = serialize_part(part9);
+
+  string header;
+  PdfWriter(
+    [&header](const char *data, size_t len) { header.append(data, len); }
+  ).write_header(reader.version());
+
+  // The linearization dictionary and the first page trailer are padded
+  // to a fixed size, so that they can be written before their values
+  // are known.
+  int first_page_num = renum[pages[0].first];
+  auto lin_dict = [&](size_t file_len, size_t hint_off, size_t hint_len,
+                      size_t end_first_page, size_t main_xref_entry) {
+    return format("{} 0 obj\n<< /Linearized 1 /L {:10} /H [{:10} {:10}] /O {} "
+                  "/E {:10} /N {} /T {:10} >>\nendobj\n",
+                  lin_num, file_len, hint_off, hint_len, first_page_num,
+                  end_first_page, num_pages, main_xref_entry);
+  };
+  string trailer_keys;
+  if (info)
+    {
+      PdfObject info_ref = *info;
+      remap(info_ref);
+      trailer_keys += " /Info ";
+      pdf_serialize(info_ref, trailer_keys);
+    }
+  const PdfObject *id = reader.trailer().get("ID");
+  if (id)
+    {
+      trailer_keys += " /ID ";
+      pdf_serialize(*id, trailer_keys);
+    }
+  auto first_xref = [&](const vector<size_t>& offsets, size_t main_xref_off) {
+    string out = format("xref\n{} {}\n", first_num, total_num - first_num);
+    for (int num=first_num; num<total_num; num++)
+      out += format("{:010d} 00000 n \n", offsets[num]);
+    out += format("trailer\n<< /Size {} /Root {} 0 R{} /Prev {:10} >>\n"
+                  "startxref\n0\n%%EOF\n",
+                  total_num, renum[catalog_num], trailer_keys, main_xref_off);
+    return out;
+  };
+
+  // Lay out the file without the hint stream
+  vector<size_t> offsets(total_num, 0);
+  vector<size_t> lengths(total_num, 0);
+  size_t pos = header.size();
+  offsets[lin_num] = pos;
+  pos += lin_dict(0, 0, 0, 0, 0).size();
+  size_t first_xref_off = pos;
+  pos += first_xref(offsets, 0).size();
+  auto place = [&](const vector<int>& part, const vector<string>& strs) {
+    for (size_t i=0; i<part.size(); i++)
+      {
+        offsets[renum[part[i]]] = pos;
+        lengths[renum[part[i]]] = strs[i].size();
+        pos += strs[i].size();
+      }
+  };
+  place(part4, s4);
+  size_t hint_off = pos;
+  place(part6, s6);
+  size_t end_first_page = pos;
+  place(part7, s7);
+  place(part8, s8);
+  place(part9, s9);
+  size_t main_xref_off = pos;
+
+  // The page offset hint table
+  auto obj_offset = [&](int num) { return offsets[renum[num]]; };
+  auto obj_length = [&](int num) { return lengths[renum[num]]; };
+  vector<unsigned long> page_nobjects(num_pages), page_length(num_pages);
+  vector<vector<int>> page_shared(num_pages);
+  map<int, int> shared_index;
+  for (size_t i=0; i<part6.size(); i++)
+    shared_index[part6[i]] = i;
+  for (size_t i=0; i<part8.size(); i++)
+    shared_index[part8[i]] = part6.size() + i;
+  for (int i=0; i<num_pages; i++)
+    {
+      const vector<int>& part = i == 0 ? part6 : part7;
+      page_nobjects[i] = page_end[i] - page_start[i];
+      page_length[i] = 0;
+      for (size_t j=page_start[i]; j<page_end[i]; j++)
+        page_length[i] += obj_length(part[j]);
+
+      // The first page holds all that it uses
+      if (i > 0)
+        for (int num : page_objects[i])
+          if (num_users[num] > 1)
+            page_shared[i].push_back(shared_index[num]);
+    }
+  unsigned long min_nobjects = *min_element(page_nobjects.begin(), page_nobjects.end());
+  unsigned long max_nobjects = *max_element(page_nobjects.begin(), page_nobjects.end());
+  unsigned long min_length = *min_element(page_length.begin(), page_length.end());
+  unsigned long max_length = *max_element(page_length.begin(), page_length.end());
+  unsigned long max_nshared = 0, max_shared_id = 0;
+  for (auto& shared : page_shared)
+    {
+      max_nshared = max(max_nshared, (unsigned long)shared.size());
+      for (int idx : shared)
+        max_shared_id = max(max_shared_id, (unsigned long)idx);
+    }
+  int nbits_nobjects = bits_needed(max_nobjects - min_nobjects);
+  int nbits_length = bits_needed(max_length - min_length);
+  int nbits_nshared = bits_needed(max_nshared);
+  int nbits_shared_id = bits_needed(max_shared_id);
+
+  BitWriter hint;
+  hint.write(min_nobjects, 32);
+  hint.write(obj_offset(pages[0].first), 32);
+  hint.write(nbits_nobjects, 16);
+  hint.write(min_length, 32);
+  hint.write(nbits_length, 16);
+  // The content streams are described as spanning the whole page
+  hint.write(0, 32);
+  hint.write(0, 16);
+  hint.write(min_length, 32);
+  hint.write(nbits_length, 16);
+  hint.write(nbits_nshared, 16);
+  hint.write(nbits_shared_id, 16);
+  hint.write(0, 16);    // No fractional positions of shared objects
+  hint.write(1, 16);
+  for (int i=0; i<num_pages; i++)
+    hint.write(page_nobjects[i] - min_nobjects, nbits_nobjects);
+  hint.flush();
+  for (int i=0; i<num_pages; i++)
+    hint.write(page_length[i] - min_length, nbits_length);
+  hint.flush();
+  for (int i=0; i<num_pages; i++)
+    hint.write(page_shared[i].size(), nbits_nshared);
+  hint.flush();
+  for (int i=0; i<num_pages; i++)
+    for (int idx : page_shared[i])
+      hint.write(idx, nbits_shared_id);
+  hint.flush();
+  // Content stream offsets and lengths are all at their minimum, and
+  // the fractional positions take no bits.
+  for (int i=0; i<num_pages; i++)
+    hint.write(page_length[i] - min_length, nbits_length);
+  hint.flush();
+
+  // The shared object hint table, with a group for each object of the
+  // first page followed by one for each shared object.
+  size_t shared_table_off = hint.data.size();
+  vector<int> groups = part6;
+  groups.insert(groups.end(), part8.begin(), part8.end());
+  unsigned long min_group = ULONG_MAX, max_group = 0;
+  for (int num : groups)
+    {
+      min_group = min(min_group, (unsigned long)obj_length(num));
+      max_group = max(max_group, (unsigned long)obj_length(num));
+    }
+  int nbits_group = bits_needed(max_group - min_group);
+  hint.write(part8.empty() ? 0 : renum[part8[0]], 32);
+  hint.write(part8.empty() ? 0 : obj_offset(part8[0]), 32);
+  hint.write(part6.size(), 32);
+  hint.write(groups.size(), 32);
+  hint.write(0, 16);    // A single object in every group
+  hint.write(min_group, 32);
+  hint.write(nbits_group, 16);
+  for (int num : groups)
+    hint.write(obj_length(num) - min_group, nbits_group);
+  hint.flush();
+  for (size_t i=0; i<groups.size(); i++)
+    hint.write(0, 1);   // No MD5 signatures
+  hint.flush();
+
+  PdfIndirect hint_stream;
+  hint_stream.value = PdfObject::make_dict();
+  hint_stream.value.set("S", PdfObject::make_number(shared_table_off));
+  hint_stream.is_stream = true;
+  hint_stream.stream = std::move(hint.data);
+  string hint_str = serialize_object(hint_num, hint_stream);
+
+  // Move everything after the hint stream into its final place
+  size_t hint_len = hint_str.size();
+  offsets[hint_num] = hint_off;
+  for (int num : part6)
+    offsets[renum[num]] += hint_len;
+  for (auto *part : {&part7, &part8, &part9})
+    for (int num : *part)
+      offsets[renum[num]] += hint_len;
+  end_first_page += hint_len;
+  main_xref_off += hint_len;
+
+  string main_xref = format("xref\n0 {}\n", first_num);
+  size_t main_xref_entry = main_xref_off + main_xref.size() - 1;
+  main_xref += "0000000000 65535 f \n";
+  for (int num=1; num<first_num; num++)
+    main_xref += format("{:010d} 00000 n \n", offsets[num]);
+  main_xref += format("trailer\n<< /Size {} >>\nstartxref\n{}\n%%EOF\n",
+                      first_num, first_xref_off);
+  size_t file_len = main_xref_off + main_xref.size();
+
+  PdfWriter writer(write_func);
+  writer.write_raw(header);
+  writer.write_raw(lin_dict(file_len, hint_off, hint_len, end_first_page, main_xref_entry));
+  writer.write_raw(first_xref(offsets, main_xref_off));
+  for (auto& s : s4)
+    writer.write_raw(s);
+  writer.write_raw(hint_str);
+  for (auto *strs : {&s6, &s7, &s8, &s9})
+    for (auto& s : *strs)
+      writer.write_raw(s);
+  writer.write_raw(main_xref);
+  if (writer.offset() != file_len)
+    throw runtime_error("Internal error in the layout of the linearized PDF!");
+}
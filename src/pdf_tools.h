@@ -0,0 +1,209 @@
+/*
+ * pdf_tools.h: Minimal PDF object reading and writing used by paps.
+ *
+ * Copyright (C) 2002, 2005, 2022 Dov Grobgeld <dov.grobgeld@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ *
+ */
+#ifndef PDF_TOOLS_H
+#define PDF_TOOLS_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <functional>
+
+// A PDF object. Scalars keep their raw token text so that numbers and
+// strings are written back exactly as they were read.
+struct PdfObject {
+  enum class Type { Null, Bool, Number, Name, String, Array, Dict, Ref };
+
+  Type type = Type::Null;
+  std::string text;               // Raw token. Names are kept without the '/'
+  int num = 0;                    // Object number of a reference
+  int gen = 0;                    // Generation of a reference
+  std::vector<std::string> keys;  // Dictionary keys, parallel to items
+  std::vector<PdfObject> items;   // Array elements or dictionary values
+
+  static PdfObject make_ref(int num, int gen=0);
+  static PdfObject make_name(const std::string& name);
+  static PdfObject make_number(long value);
+  static PdfObject make_dict();
+  static PdfObject make_array();
+
+  bool is_name(const std::string& name) const;
+  long as_long() const;
+
+  // Dictionary access
+  PdfObject *get(const std::string& key);
+  const PdfObject *get(const std::string& key) const;
+  void set(const std::string& key, PdfObject value);
+  void erase(const std::string& key);
+};
+
+// An indirect object as found in a file, i.e. a value and possibly the
+// raw (still encoded) stream data that follows it.
+struct PdfIndirect {
+  PdfObject value;
+  bool is_stream = false;
+  std::string stream;
+};
+
+// Serialize an object in PDF syntax
+void pdf_serialize(const PdfObject& obj, std::string& out);
+
+// Random access reader for a complete PDF file held in memory. Both
+// classic cross reference tables and cross reference streams with
+// object streams are supported. Errors are reported by throwing
+// std::runtime_error.
+class PdfReader {
+ public:
+  PdfReader(const char *data, size_t size);
+
+  const PdfObject& trailer() const { return m_trailer; }
+  const std::string& version() const { return m_version; }
+  size_t startxref() const { return m_startxref; }
+  bool has_xref_stream() const { return m_xref_stream; }
+  int size() const;
+
+  // The page count from the root of the page tree
+  int page_count();
+
+  // Load an indirect object. Throws if the object does not exist.
+  PdfIndirect load(int num);
+
+  // Follow a reference, or return the object itself if it is direct
+  PdfObject resolve(const PdfObject& obj);
+
+  // Decode the stream data of an object. Only FlateDecode is supported.
+  std::string decode_stream(const PdfIndirect& obj);
+
+  // Leaf page objects in document order. Inheritable attributes of
+  // the page tree are copied into the returned pages.
+  std::vector<std::pair<int, PdfIndirect>> pages();
+
+ private:
+  struct XrefEntry {
+    int type = 0;        // 0 free, 1 in file, 2 in object stream
+    size_t offset = 0;   // File offset, or object stream number
+    int index = 0;       // Generation, or index in the object stream
+  };
+
+  void read_xref_section(size_t offset, std::set<size_t>& visited);
+  PdfIndirect parse_indirect_at(size_t offset, int expected_num);
+  void collect_pages(const PdfObject& node,
+                     PdfObject inherited,
+                     std::vector<std::pair<int, PdfIndirect>>& result,
+                     int depth);
+
+  // A decoded object stream
+  struct ObjStm {
+    std::string data;
+    int n;
+    size_t first;
+  };
+
+  const char *m_data;
+  size_t m_size;
+  std::string m_version;
+  size_t m_startxref = 0;
+  bool m_xref_stream = false;
+  PdfObject m_trailer;
+  std::map<int, XrefEntry> m_xref;
+  std::map<int, ObjStm> m_objstm_cache;
+};
+
+// Sequential PDF writer that keeps track of the offsets of the written
+// objects and emits the cross reference section.
+class PdfWriter {
+ public:
+  using write_func_t = std::function<void(const char *data, size_t len)>;
+
+  PdfWriter(write_func_t write_func, size_t base_offset = 0);
+
+  void write_header(const std::string& version);
+  void write_raw(const std::string& data);
+  void write_object(int num, const PdfIndirect& obj);
+  size_t offset() const { return m_offset; }
+
+  // Write a classic xref table covering the written objects followed
+  // by the trailer. /Size is filled in from the written objects, unless
+  // the trailer already holds a larger one.
+  void write_xref_table(PdfObject trailer);
+
+  // Same as write_xref_table() but as a cross reference stream object
+  // with the number xref_num.
+  void write_xref_stream(int xref_num, PdfObject trailer);
+
+ private:
+  void write(const char *data, size_t len);
+
+  write_func_t m_write_func;
+  size_t m_offset;
+  std::map<int, size_t> m_offsets;
+};
+
+// Streaming merge of complete PDF documents into a single document. The
+// objects of each added document are renumbered and written out
+// immediately, so only one input document needs to be kept in memory
+// at a time. Identical objects, e.g. embedded font programs, are shared
+// between the documents.
+//
+// When constructed with a base document, the added pages are instead
+// written as an incremental update that is to be appended to the base
+// file of size base_size. Only the new objects, the updated root of the
+// page tree and a new cross reference section are written.
+class PdfMerger {
+ public:
+  PdfMerger(PdfWriter::write_func_t write_func);
+  PdfMerger(PdfWriter::write_func_t write_func,
+            PdfReader& base,
+            size_t base_size);
+
+  void add_document(const char *data, size_t size);
+  void finish();
+  int num_pages() const { return (int)m_kids.size(); }
+
+ private:
+  int copy_object(PdfReader& reader, int num, std::map<int, int>& renum);
+  void remap_refs(PdfReader& reader, PdfObject& obj, std::map<int, int>& renum);
+
+  void finish_update();
+
+  PdfWriter m_writer;
+  PdfReader *m_base = nullptr;
+  bool m_header_written = false;
+  int m_pages_num;
+  int m_next_num;
+  std::vector<int> m_kids;
+  PdfObject m_info;
+  std::map<std::string, int> m_shared;
+  std::set<int> m_in_progress;
+  std::set<int> m_reserved;
+};
+
+// Rewrite a complete PDF document as a linearized ("fast web view")
+// PDF, i.e. with the objects of the first page and a hint stream at the
+// start of the file, so that a viewer can show the first page before
+// the rest of the file has been read. A document without pages is
+// written unchanged.
+void pdf_linearize(const char *data,
+                   size_t size,
+                   PdfWriter::write_func_t write_func);
+
+#endif /* PDF_TOOLS_H */